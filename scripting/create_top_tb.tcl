@@ -8,6 +8,7 @@
 # ###########################################################
 
 set FP_ROOT $env(FP_ROOT)
+set VEC_ID_WIDTH [expr {[info exists env(VEC_ID_WIDTH)] ? $env(VEC_ID_WIDTH) : 16}]
 
 # This script creates a top level block design with a manager
 # and subordinate AXI VIP connected to the in- and output ports
@@ -27,6 +28,7 @@ open_bd_design {${FP_ROOT}/top_level_tb/top_level_tb.srcs/sources_1/bd/top_level
 # Create RTL block from source files.
 startgroup
 create_bd_cell -type module -reference top_intf -name top_intf_0
+set_property CONFIG.VEC_ID_WIDTH $VEC_ID_WIDTH [get_bd_cells top_intf_0]
 endgroup
 
 # Add, configure and connect AXI Stream VIPs
@@ -35,7 +37,7 @@ create_bd_cell -type ip -vlnv xilinx.com:ip:axi4stream_vip:1.1 axi4stream_vip_0
 create_bd_cell -type ip -vlnv xilinx.com:ip:axi4stream_vip:1.1 axi4stream_vip_1
 
 set_property -dict [list CONFIG.INTERFACE_MODE {MASTER} CONFIG.TDEST_WIDTH {0} CONFIG.TID_WIDTH {0} CONFIG.TDATA_WIDTH {64}] [get_bd_cells axi4stream_vip_0]
-set_property -dict [list CONFIG.INTERFACE_MODE {SLAVE} CONFIG.TDEST_WIDTH {0} CONFIG.TID_WIDTH {0} CONFIG.TDATA_WIDTH {2}] [get_bd_cells axi4stream_vip_1]
+set_property -dict [list CONFIG.INTERFACE_MODE {SLAVE} CONFIG.TDEST_WIDTH {0} CONFIG.TID_WIDTH {0} CONFIG.TDATA_WIDTH [expr {2 * $VEC_ID_WIDTH / 8}]] [get_bd_cells axi4stream_vip_1]
 
 connect_bd_intf_net [get_bd_intf_pins axi4stream_vip_0/M_AXIS] [get_bd_intf_pins top_intf_0/S_AXIS_DATA]
 connect_bd_intf_net [get_bd_intf_pins axi4stream_vip_1/S_AXIS] [get_bd_intf_pins top_intf_0/M_AXIS_ID_PAIR]
@@ -0,0 +1,99 @@
+#!/bin/bash
+# Compare the search server's model engine against its CPU engine.
+#
+# Usage: model_test.sh SERVER MAIN WORKDIR ID_WIDTH
+#   SERVER   - server_cpu binary (build/server_cpu/server)
+#   MAIN     - C implementation (src/c_impl/main.o), generates the jobs
+#   WORKDIR  - scratch directory for vectors, results and server logs
+#   ID_WIDTH - vector ID width SERVER was built with (8, 16 or 32)
+#
+# Every job is generated with main.o --generate, sent to a CPU engine and a
+# model engine server, and the returned pairs have to be byte equal (the
+# server sorts them, whatever the engine). Whether a job overflows the
+# kernel's ID pair buffer (KERNEL_ID_PAIRS) is checked as well:
+#   partial  - a single ref, the group's padding rows must not fill the
+#              buffer with hits of their own
+#   overflow - more hits than the buffer holds, the model engine has to
+#              split and rerun its tiles, unless IDs are 8 bits wide: a tile
+#              then has at most 8 x 247 pairs and cannot fill the buffer
+# Exits non-zero on a mismatch.
+
+SERVER=$1
+MAIN=$2
+WORKDIR=$3
+ID_WIDTH=$4
+
+if [ -z "$SERVER" ] || [ -z "$MAIN" ] || [ -z "$WORKDIR" ] || [ -z "$ID_WIDTH" ]; then
+    echo "Usage: $0 SERVER MAIN WORKDIR ID_WIDTH" >&2
+    exit 1
+fi
+
+mkdir -p "$WORKDIR"
+SERVER=$(realpath "$SERVER")
+MAIN=$(realpath "$MAIN")
+cd "$WORKDIR" || exit 1
+
+# name  ref-no  cmp-no  threshold  overflows (yes, no, - for either)
+JOBS=(
+    "small     8      24   0.66  -"
+    "refs     21     500   0.66  -"
+    "tiles    40    3000   0.70  -"
+    "loose    30    2000   0.30  -"
+    "partial   1  300000   0.80  no"
+    "overflow  8  300000   0.10  yes"
+)
+if [ "$ID_WIDTH" -le 8 ]; then
+    JOBS[5]="overflow  8  300000   0.10  -"
+fi
+
+rm -f cpu.sock model.sock
+"$SERVER" --engine cpu --socket cpu.sock > cpu.log 2>&1 & CPU_PID=$!
+# Line buffered, a job's log lines are in model.log once its reply is
+stdbuf -oL "$SERVER" --engine model --socket model.sock > model.log 2>&1 & MODEL_PID=$!
+
+stopServers()
+{
+    kill -INT $CPU_PID $MODEL_PID 2> /dev/null
+    wait $CPU_PID $MODEL_PID 2> /dev/null
+}
+trap stopServers EXIT
+
+for _ in $(seq 50); do
+    [ -S cpu.sock ] && [ -S model.sock ] && break
+    sleep 0.1
+done
+
+status=0
+for job in "${JOBS[@]}"; do
+    read -r name ref_no cmp_no threshold overflows <<< "$job"
+    log_start=$(wc -l < model.log)
+
+    "$MAIN" --generate --stream --ref-no "$ref_no" --cmp-no "$cmp_no" \
+        --vectors "$name.bin" --results "${name}_c.bin" > /dev/null || exit 1
+    for engine in cpu model; do
+        if ! "$SERVER" --query --socket $engine.sock --vectors "$name.bin" --ref-no "$ref_no" \
+                --threshold "$threshold" --results "${name}_$engine.bin" > /dev/null; then
+            echo "[ERROR] $name: $engine engine query failed."
+            exit 1
+        fi
+    done
+
+    pairs=$(( $(stat -c %s "${name}_cpu.bin") / 8 ))
+    if cmp -s "${name}_cpu.bin" "${name}_model.bin"; then
+        echo "[INFO] $name: $ref_no x $cmp_no @ $threshold, $ID_WIDTH bit IDs, $pairs pairs, model matches cpu."
+    else
+        echo "[ERROR] $name: $ref_no x $cmp_no @ $threshold, $ID_WIDTH bit IDs, model differs from cpu."
+        status=1
+    fi
+
+    overflowed=no
+    if tail -n +$((log_start + 1)) model.log | grep -q "ID buffers overflowed"; then
+        overflowed=yes
+    fi
+    if [ "$overflows" != "-" ] && [ "$overflows" != "$overflowed" ]; then
+        echo "[ERROR] $name: ID pair buffer overflowed: $overflowed, expected: $overflows."
+        status=1
+    fi
+done
+
+exit $status
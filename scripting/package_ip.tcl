@@ -17,9 +17,13 @@ add_files -fileset sources_1 [glob ./src/verilog/sources_1/*.v]
 add_files -fileset sim_1 [glob ./src/verilog/sim_1/tb_*.v]
 update_compile_order -fileset sources_1
 
+# Vector ID width, the Makefile passes ID_WIDTH so the host and HLS kernel agree.
+set VEC_ID_WIDTH [expr {[info exists env(VEC_ID_WIDTH)] ? $env(VEC_ID_WIDTH) : 16}]
+
 # Create RTL block from source files.
 startgroup
 create_bd_cell -type module -reference top_intf -name top_intf_0
+set_property CONFIG.VEC_ID_WIDTH $VEC_ID_WIDTH [get_bd_cells top_intf_0]
 endgroup
 
 # Make interfaces and clock/reset pins external. --> These will be visible to v++.
@@ -0,0 +1,355 @@
+#include "tanimoto.h"
+#include "popcnt.h"
+#include "search.h"
+#include "threshold.h"
+#include "worksteal.h"
+#include "bench.h"
+#include <string.h>
+
+/*
+ * Benchmarks of the software reference: popcount kernels, per-pair
+ * threshold evaluation and the full all-pairs search, on random
+ * fingerprints of a given width and bit density. Prints CSV (see bench.h).
+ */
+
+#define BENCH_DEFAULT_REF_NO        1024
+#define BENCH_DEFAULT_CMP_NO        16384
+#define BENCH_DEFAULT_REPEAT        5
+#define BENCH_THRESHOLD_TRIPLES     (1u << 20)     // weight triples for the threshold benchmarks
+
+typedef struct {
+    FingerprintStore ref;
+    FingerprintStore cmp;
+    SearchConfig     cfg;
+    ThresholdTable   table;
+    uint32_t        *triples;       /* {CNT(A), CNT(B), CNT(A & B)} x tripleNo */
+    size_t           tripleNo;
+    uint64_t         hits;          /* Counted by countSink() */
+} Bench;
+
+typedef uint64_t (*BenchFn)(Bench *bench);
+
+
+/*
+ * Function: nextRandom
+ * xorshift64*, fixed seed: every run benchmarks the same data.
+ */
+static uint64_t nextRandom(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+
+/*
+ * Function: fillRandom
+ * Every bit is set with probability density.
+ */
+static void fillRandom(FingerprintStore *store, double density, uint32_t firstID, uint64_t *state)
+{
+    uint64_t limit = (uint64_t)(density * 9007199254740992.0);   // 2^53
+
+    for (size_t i = 0; i < store->count; i++) {
+        uint64_t *row = fpStoreRow(store, i);
+        for (uint32_t bit = 0; bit < store->width; bit++) {
+            if ((nextRandom(state) >> 11) < limit) {
+                row[bit / 64] |= 1ULL << (bit % 64);
+            }
+        }
+    }
+
+    fpStoreAssignIDs(store, firstID);
+    fpStoreComputeWeights(store);
+}
+
+
+static void countSink(void *ctx, uint32_t refID, uint32_t cmpID, double coeff)
+{
+    (void)refID;
+    (void)cmpID;
+    (void)coeff;
+    ((Bench *)ctx)->hits++;
+}
+
+
+/* CNT(A & B) of every pair, one pair at a time */
+static uint64_t benchPopcntAnd(Bench *b)
+{
+    uint64_t sum = 0;
+
+    for (size_t r = 0; r < b->ref.count; r++) {
+        for (size_t c = 0; c < b->cmp.count; c++) {
+            sum += calculateIntersectionWeight(&b->ref, r, &b->cmp, c);
+        }
+    }
+
+    return sum;
+}
+
+
+/* CNT(A & B) of every full POPCNT_BLOCK_REF x POPCNT_BLOCK_CMP block */
+static uint64_t benchPopcntBlock(Bench *b)
+{
+    PopcntAndBlockFn block = popcntAndBlockForWidth(b->ref.width);
+    uint32_t cnt[POPCNT_BLOCK_REF * POPCNT_BLOCK_CMP];
+    uint64_t sum = 0;
+
+    for (size_t r = 0; r + POPCNT_BLOCK_REF <= b->ref.count; r += POPCNT_BLOCK_REF) {
+        for (size_t c = 0; c + POPCNT_BLOCK_CMP <= b->cmp.count; c += POPCNT_BLOCK_CMP) {
+            block(fpStoreRow(&b->ref, r), fpStoreRow(&b->cmp, c), b->ref.stride, cnt);
+            for (unsigned int k = 0; k < POPCNT_BLOCK_REF * POPCNT_BLOCK_CMP; k++) {
+                sum += cnt[k];
+            }
+        }
+    }
+
+    return sum;
+}
+
+
+/* Dissimilarity criterion in floating point, as computeTanimotoSimilarity() */
+static uint64_t benchThresholdDouble(Bench *b)
+{
+    uint64_t hits = 0;
+
+    for (size_t i = 0; i < b->tripleNo; i++) {
+        const uint32_t *t = &b->triples[i * 3];
+        hits += computeTanimotoSimilarity(t[0], t[1], t[2]) > b->cfg.threshold;
+    }
+
+    return hits;
+}
+
+
+/* Same criterion through the accelerator's integer table */
+static uint64_t benchThresholdTable(Bench *b)
+{
+    uint64_t hits = 0;
+
+    for (size_t i = 0; i < b->tripleNo; i++) {
+        const uint32_t *t = &b->triples[i * 3];
+        hits += thresholdTableMatch(&b->table, t[0], t[1], t[2]);
+    }
+
+    return hits;
+}
+
+
+static uint64_t benchSearch(Bench *b)
+{
+    b->hits = 0;
+    if (searchParallel(&b->ref, &b->cmp, &b->cfg, countSink, b, NULL) != 0) {
+        return 0;
+    }
+    return b->hits;
+}
+
+
+static uint64_t benchSelf(Bench *b)
+{
+    b->hits = 0;
+    if (searchSelf(&b->cmp, &b->cfg, countSink, b, NULL) != 0) {
+        return 0;
+    }
+    return b->hits;
+}
+
+
+/*
+ * Function: runBest
+ * Best wall time of repeat runs, the result of the last run in *hits.
+ */
+static double runBest(BenchFn fn, Bench *bench, unsigned int repeat, uint64_t *hits)
+{
+    double best = 0.0;
+
+    for (unsigned int i = 0; i < repeat; i++) {
+        double start   = benchNow();
+        *hits          = fn(bench);
+        double elapsed = benchNow() - start;
+
+        if (i == 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+
+    return best;
+}
+
+
+static void report(BenchRecord *rec, const char *level, const char *name, BenchFn fn,
+                   Bench *bench, unsigned int repeat, uint64_t items, uint64_t bytes)
+{
+    rec->level   = level;
+    rec->name    = name;
+    rec->items   = items;
+    rec->bytes   = bytes;
+    rec->seconds = runBest(fn, bench, repeat, &rec->hits);
+    benchPrint(rec);
+    fflush(stdout);
+}
+
+
+int main(int argc, char *argv[])
+{
+    size_t refNo = BENCH_DEFAULT_REF_NO;
+    size_t cmpNo = BENCH_DEFAULT_CMP_NO;
+    uint32_t width = VECTOR_WIDTH;
+    double density = 0.5;
+    double threshold = THRESHOLD;
+    unsigned int threadNo = workStealDefaultThreads();
+    unsigned int repeat = BENCH_DEFAULT_REPEAT;
+    bool header = true;
+
+    static struct option long_opts[] = {
+        // name             has_arg               flag  short-val
+        { "ref-no",         required_argument   , NULL, 'R' },
+        { "cmp-no",         required_argument   , NULL, 'C' },
+        { "width",          required_argument   , NULL, 'w' },
+        { "density",        required_argument   , NULL, 'd' },
+        { "threshold",      required_argument   , NULL, 'T' },
+        { "threads",        required_argument   , NULL, 'j' },
+        { "repeat",         required_argument   , NULL, 'n' },
+        { "no-header",      no_argument         , NULL, 'N' },
+        { NULL,             0                   , NULL,  0  }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "R:C:w:d:T:j:n:N", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'R':
+                refNo = strtoull(optarg, NULL, 0);
+                break;
+            case 'C':
+                cmpNo = strtoull(optarg, NULL, 0);
+                break;
+            case 'w':
+                width = (uint32_t)strtoul(optarg, NULL, 0);
+                break;
+            case 'd':
+                density = strtod(optarg, NULL);
+                break;
+            case 'T':
+                threshold = strtod(optarg, NULL);
+                break;
+            case 'j':
+                threadNo = (unsigned int)strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                repeat = (unsigned int)strtoul(optarg, NULL, 0);
+                break;
+            case 'N':
+                header = false;
+                break;
+            default:
+                fprintf(stderr,
+                        "Usage: %s [--ref-no N] [--cmp-no N] [--width BITS] [--density D] [--threshold T]"
+                        " [--threads N] [--repeat N] [--no-header]\n",
+                        argv[0]);
+                return -1;
+        }
+    }
+
+    if (width == 0 || refNo == 0 || cmpNo == 0 || repeat == 0 || density < 0.0 || density > 1.0) {
+        fprintf(stderr, "Width, vector counts and repeat must be positive, density in [0, 1].\n");
+        return -1;
+    }
+
+    Bench bench;
+    uint64_t rng = 0x9E3779B97F4A7C15ULL;
+
+    memset(&bench, 0, sizeof(bench));
+    if (fpStoreInit(&bench.ref, refNo, width) || fpStoreInit(&bench.cmp, cmpNo, width) ||
+        thresholdTableInit(&bench.table, width, (float)threshold)) {
+        fpStoreFree(&bench.ref);
+        fpStoreFree(&bench.cmp);
+        return 1;
+    }
+    fillRandom(&bench.ref, density, 1, &rng);
+    fillRandom(&bench.cmp, density, (uint32_t)refNo + 1, &rng);
+
+    // Weight triples of real pairs, so the thresholds see a realistic mix
+    uint64_t pairs = (uint64_t)refNo * cmpNo;
+    bench.tripleNo = pairs < BENCH_THRESHOLD_TRIPLES ? (size_t)pairs : BENCH_THRESHOLD_TRIPLES;
+    bench.triples  = (uint32_t *)malloc(bench.tripleNo * 3 * sizeof(uint32_t));
+    if (!bench.triples) {
+        fprintf(stderr, "Failed to allocate weight triples\n");
+        thresholdTableFree(&bench.table);
+        fpStoreFree(&bench.ref);
+        fpStoreFree(&bench.cmp);
+        return 1;
+    }
+    for (size_t i = 0; i < bench.tripleNo; i++) {
+        size_t r = i / cmpNo, c = i % cmpNo;
+        bench.triples[i * 3]     = bench.ref.weights[r];
+        bench.triples[i * 3 + 1] = bench.cmp.weights[c];
+        bench.triples[i * 3 + 2] = calculateIntersectionWeight(&bench.ref, r, &bench.cmp, c);
+    }
+
+    bench.cfg.threshold = threshold;
+    bench.cfg.mode      = MATCH_DISSIMILAR;
+    bench.cfg.threadNo  = threadNo;
+
+    BenchRecord rec = { "", "", popcntKernelName(popcntKernel()), width, refNo, cmpNo,
+                        density, threshold, threadNo, 0.0, 0, 0, 0 };
+    uint64_t rowBytes   = fpStoreRowBytes(&bench.ref);
+    uint64_t blockPairs = (uint64_t)(refNo / POPCNT_BLOCK_REF * POPCNT_BLOCK_REF) *
+                          (cmpNo / POPCNT_BLOCK_CMP * POPCNT_BLOCK_CMP);
+
+    if (header) {
+        printf("%s\n", BENCH_CSV_HEADER);
+    }
+
+    // Kernels are single-threaded, bytes are both operands of every pair
+    rec.threadNo = 1;
+    report(&rec, "kernel", "popcnt_and", benchPopcntAnd, &bench, repeat, pairs, pairs * 2 * rowBytes);
+    report(&rec, "kernel", "popcnt_block", benchPopcntBlock, &bench, repeat,
+           blockPairs, blockPairs * 2 * rowBytes);
+    report(&rec, "threshold", "threshold_double", benchThresholdDouble, &bench, repeat, bench.tripleNo, 0);
+    report(&rec, "threshold", "threshold_table", benchThresholdTable, &bench, repeat, bench.tripleNo, 0);
+
+    // All-pairs search, hits included in the time (counted, not stored)
+    rec.threadNo = threadNo;
+    report(&rec, "search", "search_dissimilar", benchSearch, &bench, repeat, pairs, pairs * 2 * rowBytes);
+
+    bench.cfg.mode = MATCH_TABLE;
+    bench.cfg.table = &bench.table;
+    report(&rec, "search", "search_table", benchSearch, &bench, repeat, pairs, pairs * 2 * rowBytes);
+
+    // Similarity search with weight pruning, pairs counts the whole space
+    WeightBuckets buckets;
+    bench.cfg.mode = MATCH_SIMILAR;
+    bench.cfg.table = NULL;
+    if (fpStoreSortByWeight(&bench.ref, NULL) == 0 && fpStoreSortByWeight(&bench.cmp, &buckets) == 0) {
+        bench.cfg.cmpBuckets = &buckets;
+        report(&rec, "search", "search_similar_pruned", benchSearch, &bench, repeat, pairs, pairs * 2 * rowBytes);
+
+        // Same search counted dense and from sparse cmp rows, whatever the density
+        bench.cfg.sparse = SPARSE_OFF;
+        report(&rec, "search", "search_similar_dense", benchSearch, &bench, repeat, pairs, pairs * 2 * rowBytes);
+        bench.cfg.sparse = SPARSE_ON;
+        report(&rec, "search", "search_similar_sparse", benchSearch, &bench, repeat, pairs, pairs * 2 * rowBytes);
+        bench.cfg.sparse = SPARSE_AUTO;
+
+        // Same search behind the folded prefilter
+        bench.cfg.foldBits = 64;
+        report(&rec, "search", "search_similar_fold64", benchSearch, &bench, repeat, pairs, pairs * 2 * rowBytes);
+        bench.cfg.foldBits = 128;
+        report(&rec, "search", "search_similar_fold128", benchSearch, &bench, repeat, pairs, pairs * 2 * rowBytes);
+        bench.cfg.foldBits = 0;
+
+        // Self-join of the cmp vectors, pairs counts the triangle
+        uint64_t selfPairs = (uint64_t)cmpNo * (cmpNo - 1) / 2;
+        report(&rec, "search", "search_self_similar", benchSelf, &bench, repeat,
+               selfPairs, selfPairs * 2 * rowBytes);
+        weightBucketsFree(&buckets);
+    }
+
+    free(bench.triples);
+    thresholdTableFree(&bench.table);
+    fpStoreFree(&bench.ref);
+    fpStoreFree(&bench.cmp);
+    return 0;
+}
@@ -0,0 +1,72 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Benchmark records
+ * Every benchmark (bench.c for the kernels and the search, bench_host.cpp
+ * for the host's result handling) prints one CSV line per measurement, in
+ * the same columns, so runs can be concatenated and tracked over time:
+ *
+ * level        - kernel, threshold, search or host
+ * name         - what was measured
+ * kernel       - popcount kernel in use (popcntKernelName())
+ * width .. threads - parameters of the run
+ * seconds      - best of the repeated runs
+ * items        - pairs (or IDs, for the host) processed per run
+ * items_per_s  - items / seconds
+ * gb_per_s     - fingerprint (or ID) bytes read per second, 0 if not meaningful
+ * hits         - matches found (sum of counts for the kernels), to check runs
+ *                against each other
+ */
+
+#define BENCH_CSV_HEADER \
+    "level,name,kernel,width,ref_no,cmp_no,density,threshold,threads,seconds,items,items_per_s,gb_per_s,hits"
+
+typedef struct {
+    const char   *level;
+    const char   *name;
+    const char   *kernel;
+    uint32_t      width;
+    size_t        refNo;
+    size_t        cmpNo;
+    double        density;
+    double        threshold;
+    unsigned int  threadNo;
+    double        seconds;
+    uint64_t      items;
+    uint64_t      bytes;
+    uint64_t      hits;
+} BenchRecord;
+
+/* Monotonic time in seconds */
+static inline double benchNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static inline void benchPrint(const BenchRecord *r)
+{
+    double seconds = r->seconds > 0.0 ? r->seconds : 1e-12;
+
+    printf("%s,%s,%s,%u,%zu,%zu,%.4f,%.4f,%u,%.9f,%llu,%.6e,%.4f,%llu\n",
+           r->level, r->name, r->kernel, r->width, r->refNo, r->cmpNo,
+           r->density, r->threshold, r->threadNo, r->seconds,
+           (unsigned long long)r->items, (double)r->items / seconds,
+           (double)r->bytes / seconds * 1e-9, (unsigned long long)r->hits);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BENCH_H
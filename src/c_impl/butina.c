@@ -0,0 +1,215 @@
+#include "butina.h"
+#include <string.h>
+
+// Pairs (i, j), i < j, as delivered by searchSelf()
+typedef struct {
+    uint32_t *pairs;
+    size_t    n;
+    size_t    cap;
+    int       error;
+} PairList;
+
+static void pairListPush(void *ctx, uint32_t refID, uint32_t cmpID, double coeff)
+{
+    PairList *list = (PairList *)ctx;
+    (void)coeff;
+
+    if (list->error) {
+        return;
+    }
+    if (list->n + 2 > list->cap) {
+        size_t    cap   = list->cap ? list->cap * 2 : 4096;
+        uint32_t *pairs = (uint32_t *)realloc(list->pairs, cap * sizeof(uint32_t));
+        if (!pairs) {
+            fprintf(stderr, "Failed to allocate the neighbour pairs\n");
+            list->error = 1;
+            return;
+        }
+        list->pairs = pairs;
+        list->cap   = cap;
+    }
+    list->pairs[list->n++] = refID;
+    list->pairs[list->n++] = cmpID;
+}
+
+
+/*
+ * Function: neighbourGraphBuild
+ * The self-join runs on a view of store whose IDs are the row indices, so
+ * the hits index the graph directly. Hits come ref-major with ascending
+ * cmp rows, filling both directions in that order leaves every list sorted:
+ * the neighbours before a row (as cmp of earlier refs) come first.
+ */
+int neighbourGraphBuild(NeighbourGraph *graph,
+                        const FingerprintStore *store,
+                        const SearchConfig *cfg,
+                        SearchStats *stats)
+{
+    FingerprintStore view   = *store;
+    SearchConfig     config = *cfg;
+    PairList         pairs  = { NULL, 0, 0, 0 };
+    SearchStats      local;
+
+    memset(graph, 0, sizeof(*graph));
+    config.mode = MATCH_SIMILAR;
+
+    view.ids = (uint32_t *)malloc((store->count ? store->count : 1) * sizeof(uint32_t));
+    if (!view.ids) {
+        fprintf(stderr, "Failed to allocate the row indices\n");
+        return -1;
+    }
+    for (size_t i = 0; i < store->count; i++) {
+        view.ids[i] = (uint32_t)i;
+    }
+
+    int error = searchSelf(&view, &config, pairListPush, &pairs, stats ? stats : &local);
+    free(view.ids);
+    if (error || pairs.error) {
+        free(pairs.pairs);
+        return -1;
+    }
+
+    graph->rowNo   = store->count;
+    graph->offsets = (uint64_t *)calloc(store->count + 1, sizeof(uint64_t));
+    graph->list    = (uint32_t *)malloc((pairs.n ? pairs.n : 1) * sizeof(uint32_t));
+    if (!graph->offsets || !graph->list) {
+        fprintf(stderr, "Failed to allocate the neighbour graph\n");
+        free(pairs.pairs);
+        neighbourGraphFree(graph);
+        return -1;
+    }
+
+    // Degrees, then row starts; offsets[i + 1] is the fill position of row i
+    for (size_t p = 0; p < pairs.n; p++) {
+        graph->offsets[pairs.pairs[p] + 1]++;
+    }
+    for (size_t i = 1; i <= store->count; i++) {
+        graph->offsets[i] += graph->offsets[i - 1];
+    }
+    memmove(graph->offsets + 1, graph->offsets, store->count * sizeof(uint64_t));
+
+    for (size_t p = 0; p < pairs.n; p += 2) {
+        uint32_t a = pairs.pairs[p];
+        uint32_t b = pairs.pairs[p + 1];
+
+        graph->list[graph->offsets[a + 1]++] = b;
+        graph->list[graph->offsets[b + 1]++] = a;
+    }
+
+    free(pairs.pairs);
+    return 0;
+}
+
+
+void neighbourGraphFree(NeighbourGraph *graph)
+{
+    free(graph->offsets);
+    free(graph->list);
+    memset(graph, 0, sizeof(*graph));
+}
+
+
+/*
+ * Function: butinaCluster
+ * Rows are ordered by neighbour count with a counting sort, walking the
+ * counts from the top and the rows of a count in order.
+ */
+int butinaCluster(ButinaClusters *clusters, const NeighbourGraph *graph)
+{
+    size_t    rowNo     = graph->rowNo;
+    uint64_t  maxDegree = 0;
+
+    memset(clusters, 0, sizeof(*clusters));
+    for (size_t i = 0; i < rowNo; i++) {
+        uint64_t degree = graph->offsets[i + 1] - graph->offsets[i];
+        maxDegree = degree > maxDegree ? degree : maxDegree;
+    }
+
+    size_t   *starts = (size_t *)calloc(maxDegree + 2, sizeof(size_t));
+    uint32_t *order  = (uint32_t *)malloc((rowNo ? rowNo : 1) * sizeof(uint32_t));
+    clusters->rowNo     = rowNo;
+    clusters->clusterOf = (uint32_t *)malloc((rowNo ? rowNo : 1) * sizeof(uint32_t));
+    clusters->centroids = (uint32_t *)malloc((rowNo ? rowNo : 1) * sizeof(uint32_t));
+    clusters->sizes     = (uint32_t *)calloc(rowNo ? rowNo : 1, sizeof(uint32_t));
+    if (!starts || !order || !clusters->clusterOf || !clusters->centroids || !clusters->sizes) {
+        fprintf(stderr, "Failed to allocate the clusters\n");
+        free(starts);
+        free(order);
+        butinaClustersFree(clusters);
+        return -1;
+    }
+
+    // Descending degree: bucket d starts after all buckets above it
+    for (size_t i = 0; i < rowNo; i++) {
+        starts[maxDegree - (graph->offsets[i + 1] - graph->offsets[i]) + 1]++;
+    }
+    for (uint64_t d = 1; d <= maxDegree + 1; d++) {
+        starts[d] += starts[d - 1];
+    }
+    for (size_t i = 0; i < rowNo; i++) {
+        order[starts[maxDegree - (graph->offsets[i + 1] - graph->offsets[i])]++] = (uint32_t)i;
+    }
+
+    memset(clusters->clusterOf, 0xff, rowNo * sizeof(uint32_t));
+    for (size_t n = 0; n < rowNo; n++) {
+        uint32_t row     = order[n];
+        uint32_t cluster = (uint32_t)clusters->clusterNo;
+
+        if (clusters->clusterOf[row] != UINT32_MAX) {
+            continue;
+        }
+
+        clusters->centroids[cluster] = row;
+        clusters->clusterOf[row]     = cluster;
+        clusters->sizes[cluster]     = 1;
+        for (uint64_t e = graph->offsets[row]; e < graph->offsets[row + 1]; e++) {
+            uint32_t member = graph->list[e];
+            if (clusters->clusterOf[member] == UINT32_MAX) {
+                clusters->clusterOf[member] = cluster;
+                clusters->sizes[cluster]++;
+            }
+        }
+        clusters->clusterNo++;
+    }
+
+    free(starts);
+    free(order);
+    return 0;
+}
+
+
+void butinaClustersFree(ButinaClusters *clusters)
+{
+    free(clusters->clusterOf);
+    free(clusters->centroids);
+    free(clusters->sizes);
+    memset(clusters, 0, sizeof(*clusters));
+}
+
+
+/*
+ * Function: writeButinaToTxtFile
+ */
+int writeButinaToTxtFile(const ButinaClusters *clusters, const FingerprintStore *store,
+                         const char *filename)
+{
+    FILE *fp = fopen(filename, "w");
+    if (!fp) {
+        perror("Error opening output file");
+        return -1;
+    }
+
+    for (size_t i = 0; i < clusters->rowNo; i++) {
+        uint32_t cluster = clusters->clusterOf[i];
+
+        fprintf(fp, "ID:\t0x%08x\tcluster:\t%u\tcentroid:\t0x%08x\n",
+                store->ids[i], cluster, store->ids[clusters->centroids[cluster]]);
+    }
+
+    if (fclose(fp) != 0) {
+        perror("Failed to close output file");
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,57 @@
+#ifndef BUTINA_H
+#define BUTINA_H
+
+#include "search.h"
+
+/*
+ * Taylor-Butina clustering
+ * Built on the self-join (searchSelf()): the pairs of one store within a
+ * similarity threshold form a neighbour graph, kept in compressed rows
+ * (the neighbours of row i at list[offsets[i], offsets[i + 1])). Rows are
+ * then taken in order of descending neighbour count, every row not yet
+ * clustered becomes a centroid and takes all its unclustered neighbours.
+ * The graph stores every pair twice, its size is what limits the store
+ * size, not the search.
+ */
+
+typedef struct {
+    size_t     rowNo;
+    uint64_t  *offsets;         /* rowNo + 1 entries */
+    uint32_t  *list;            /* offsets[rowNo] entries, row indices, ascending per row */
+} NeighbourGraph;
+
+typedef struct {
+    size_t     rowNo;
+    size_t     clusterNo;
+    uint32_t  *clusterOf;       /* rowNo entries, cluster of every row */
+    uint32_t  *centroids;       /* clusterNo entries, row of the centroid */
+    uint32_t  *sizes;           /* clusterNo entries, rows in the cluster */
+} ButinaClusters;
+
+/*
+ * Neighbour graph of store: rows i and j are neighbours if their Tanimoto
+ * similarity is at least cfg->threshold. cfg->mode is not used, the other
+ * fields are passed on to searchSelf(). stats may be NULL. Returns 0 on
+ * success.
+ */
+int  neighbourGraphBuild(NeighbourGraph *graph,
+                         const FingerprintStore *store,
+                         const SearchConfig *cfg,
+                         SearchStats *stats);
+
+void neighbourGraphFree(NeighbourGraph *graph);
+
+/*
+ * Cluster the rows of graph. Equal neighbour counts are taken in row order,
+ * so the result is deterministic. Clusters are numbered in the order their
+ * centroids were picked. Returns 0 on success.
+ */
+int  butinaCluster(ButinaClusters *clusters, const NeighbourGraph *graph);
+
+void butinaClustersFree(ButinaClusters *clusters);
+
+/* One line per row of store: its ID, cluster and the ID of the centroid */
+int  writeButinaToTxtFile(const ButinaClusters *clusters, const FingerprintStore *store,
+                          const char *filename);
+
+#endif // BUTINA_H
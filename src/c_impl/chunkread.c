@@ -0,0 +1,294 @@
+#include "chunkread.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Function: preadFull
+ * pread() until all bytes are read, short reads are retried. Returns 0,
+ * the errno of a failed pread() or CHUNK_READ_TRUNCATED. errno is the
+ * reader thread's own, it is returned for the consumer to report.
+ */
+static int preadFull(int fd, void *dst, size_t bytes, uint64_t offset)
+{
+    uint8_t *p = (uint8_t *)dst;
+
+    while (bytes > 0) {
+        ssize_t got = pread(fd, p, bytes, (off_t)offset);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got < 0) {
+            return errno;
+        }
+        if (got == 0) {
+            return CHUNK_READ_TRUNCATED;
+        }
+        p      += got;
+        bytes  -= (size_t)got;
+        offset += (uint64_t)got;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Function: loadChunk
+ * Rows are stored with their padding in the file, so bits are read straight
+ * into the aligned store. Weights are checked as fpStoreMapFile() checks
+ * them, they index the chunk's buckets. Returns 0 or a ChunkReader error.
+ */
+static int loadChunk(ChunkReader *reader, FingerprintStore *store, size_t first, size_t rows)
+{
+    const FingerprintFileHeader *h = &reader->header;
+    size_t strideBytes = fpStoreStrideBytes(store);
+    int    error;
+
+    store->count = rows;
+
+    error = preadFull(reader->fd, store->bits, rows * strideBytes, h->bitsOffset + first * strideBytes);
+    if (!error) {
+        error = preadFull(reader->fd, store->weights, rows * sizeof(uint32_t),
+                          h->weightsOffset + first * sizeof(uint32_t));
+    }
+    if (!error) {
+        error = preadFull(reader->fd, store->ids, rows * sizeof(uint32_t),
+                          h->idsOffset + first * sizeof(uint32_t));
+    }
+    for (size_t i = 0; i < rows && !error; i++) {
+        if (store->weights[i] > h->width) {
+            error = CHUNK_READ_BAD_WEIGHT;
+        }
+    }
+
+    return error;
+}
+
+
+/*
+ * Function: readerMain
+ * Fills the buffers in turns, each one as soon as the consumer released it.
+ */
+static void *readerMain(void *arg)
+{
+    ChunkReader *reader = (ChunkReader *)arg;
+    unsigned int slot   = 0;
+
+    while (reader->next < reader->end) {
+        pthread_mutex_lock(&reader->lock);
+        while (reader->full[slot] && !reader->stop) {
+            pthread_cond_wait(&reader->cond, &reader->lock);
+        }
+        int stop = reader->stop;
+        pthread_mutex_unlock(&reader->lock);
+        if (stop) {
+            break;
+        }
+
+        size_t rows = reader->end - reader->next;
+        if (rows > reader->chunkRows) {
+            rows = reader->chunkRows;
+        }
+
+        int error = loadChunk(reader, &reader->buf[slot], reader->next, rows);
+        reader->next += rows;
+
+        pthread_mutex_lock(&reader->lock);
+        if (error) {
+            reader->error = error;
+        } else {
+            reader->full[slot] = 1;
+        }
+        pthread_cond_broadcast(&reader->cond);
+        pthread_mutex_unlock(&reader->lock);
+        if (error) {
+            break;
+        }
+
+        slot = (slot + 1) % CHUNK_READER_BUFFERS;
+    }
+
+    pthread_mutex_lock(&reader->lock);
+    reader->done = 1;
+    pthread_cond_broadcast(&reader->cond);
+    pthread_mutex_unlock(&reader->lock);
+
+    return NULL;
+}
+
+
+/*
+ * Function: chunkReaderOpen
+ */
+int chunkReaderOpen(ChunkReader *reader, const char *filename,
+                    size_t first, size_t count, size_t chunkRows)
+{
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = -1;
+
+    if (chunkRows == 0) {
+        fprintf(stderr, "Chunks must hold at least one row\n");
+        return -1;
+    }
+    if (fpStoreReadFileHeader(filename, &reader->header)) {
+        return -1;
+    }
+    if (first > reader->header.count ||
+        (count != FP_STORE_ALL && count > reader->header.count - first)) {
+        fprintf(stderr, "%s: rows out of the file's %llu rows\n", filename,
+                (unsigned long long)reader->header.count);
+        return -1;
+    }
+
+    reader->next      = first;
+    reader->end       = count == FP_STORE_ALL ? (size_t)reader->header.count : first + count;
+    reader->chunkRows = chunkRows;
+
+    reader->fd = open(filename, O_RDONLY);
+    if (reader->fd < 0) {
+        perror("Failed to open fingerprint file");
+        return -1;
+    }
+
+    for (unsigned int b = 0; b < CHUNK_READER_BUFFERS; b++) {
+        if (fpStoreInit(&reader->buf[b], chunkRows, reader->header.width)) {
+            chunkReaderClose(reader);
+            return -1;
+        }
+    }
+
+    pthread_mutex_init(&reader->lock, NULL);
+    pthread_cond_init(&reader->cond, NULL);
+    if (pthread_create(&reader->reader, NULL, readerMain, reader) != 0) {
+        fprintf(stderr, "Failed to start the chunk reader thread\n");
+        pthread_cond_destroy(&reader->cond);
+        pthread_mutex_destroy(&reader->lock);
+        chunkReaderClose(reader);
+        return -1;
+    }
+    reader->started = 1;
+
+    return 0;
+}
+
+
+/*
+ * Function: chunkReaderNext
+ * Chunks come in buffer order, the reader fills them in the same order.
+ */
+int chunkReaderNext(ChunkReader *reader, const FingerprintStore **chunk)
+{
+    pthread_mutex_lock(&reader->lock);
+
+    if (reader->holding) {
+        reader->full[reader->current] = 0;
+        reader->holding = 0;
+        reader->current = (reader->current + 1) % CHUNK_READER_BUFFERS;
+        pthread_cond_broadcast(&reader->cond);
+    }
+
+    while (!reader->full[reader->current] && !reader->done && !reader->error) {
+        pthread_cond_wait(&reader->cond, &reader->lock);
+    }
+
+    int result;
+    int error = reader->error;
+    if (reader->full[reader->current]) {
+        reader->holding = 1;
+        *chunk = &reader->buf[reader->current];
+        result = 1;
+    } else {
+        result = error ? -1 : 0;
+    }
+
+    pthread_mutex_unlock(&reader->lock);
+
+    // The reader thread failed, errno here is not its errno
+    if (result < 0) {
+        fprintf(stderr, "Failed to read fingerprint chunk: %s\n",
+                error == CHUNK_READ_TRUNCATED  ? "the file ends before the last row" :
+                error == CHUNK_READ_BAD_WEIGHT ? "a row weighs more than the width" : strerror(error));
+    }
+    return result;
+}
+
+
+/*
+ * Function: chunkReaderClose
+ * Safe on a reader that failed to open, and mid-stream: the reader thread
+ * finishes the chunk it is loading and stops.
+ */
+void chunkReaderClose(ChunkReader *reader)
+{
+    if (reader->started) {
+        pthread_mutex_lock(&reader->lock);
+        reader->stop = 1;
+        pthread_cond_broadcast(&reader->cond);
+        pthread_mutex_unlock(&reader->lock);
+
+        pthread_join(reader->reader, NULL);
+        pthread_cond_destroy(&reader->cond);
+        pthread_mutex_destroy(&reader->lock);
+        reader->started = 0;
+    }
+
+    for (unsigned int b = 0; b < CHUNK_READER_BUFFERS; b++) {
+        fpStoreFree(&reader->buf[b]);
+    }
+
+    if (reader->fd >= 0) {
+        close(reader->fd);
+        reader->fd = -1;
+    }
+}
+
+
+/*
+ * Function: searchChunks
+ */
+int searchChunks(const FingerprintStore *ref,
+                 ChunkReader *reader,
+                 const SearchConfig *cfg,
+                 HitSink sink, void *ctx,
+                 SearchStats *stats)
+{
+    const FingerprintStore *chunk;
+    SearchConfig chunkCfg = *cfg;
+    SearchStats  total    = { 0, 0, 0, 0 };
+    int          prune    = cfg->mode == MATCH_SIMILAR &&
+                            (reader->header.flags & FP_FILE_SORTED_BY_WEIGHT);
+    int          result;
+
+    while ((result = chunkReaderNext(reader, &chunk)) > 0) {
+        WeightBuckets buckets = { 0, NULL };
+        SearchStats   chunkStats;
+
+        chunkCfg.cmpBuckets = NULL;
+        if (prune) {
+            if (weightBucketsBuild(&buckets, chunk)) {
+                return -1;
+            }
+            chunkCfg.cmpBuckets = &buckets;
+        }
+
+        int error = searchParallel(ref, chunk, &chunkCfg, sink, ctx, &chunkStats);
+        weightBucketsFree(&buckets);
+        if (error) {
+            return -1;
+        }
+
+        total.pairs      += chunkStats.pairs;
+        total.pruned     += chunkStats.pruned;
+        total.terminated += chunkStats.terminated;
+        total.hits       += chunkStats.hits;
+    }
+
+    if (stats) {
+        *stats = total;
+    }
+
+    return result;
+}
@@ -0,0 +1,74 @@
+#ifndef CHUNKREAD_H
+#define CHUNKREAD_H
+
+#include <pthread.h>
+#include "fpstore.h"
+#include "search.h"
+
+/*
+ * Out-of-core chunk reader
+ * Streams the rows of a fingerprint file (see fpstore.h) in chunks of a
+ * fixed number of rows, for comparison sets that do not fit in memory. A
+ * reader thread fills two chunk buffers with pread() in turns: while the
+ * search works on one chunk, the next one is loaded into the other. Memory
+ * use is two chunks, whatever the size of the file.
+ */
+
+#define CHUNK_READER_BUFFERS    2
+
+/* ChunkReader.error besides the errno of a failed pread() */
+#define CHUNK_READ_TRUNCATED    -1      /* The file ends before the chunk */
+#define CHUNK_READ_BAD_WEIGHT   -2      /* A row weighs more than the width */
+
+typedef struct {
+    int                   fd;
+    FingerprintFileHeader header;
+    size_t                next;         /* Next row to read, reader thread only */
+    size_t                end;          /* One past the last row to read */
+    size_t                chunkRows;
+
+    FingerprintStore      buf[CHUNK_READER_BUFFERS];
+    int                   full[CHUNK_READER_BUFFERS];  /* Loaded, not yet released by the consumer */
+    unsigned int          current;      /* Buffer handed out by chunkReaderNext(), if any */
+    int                   holding;      /* The consumer still uses buf[current] */
+
+    pthread_t             reader;
+    pthread_mutex_t       lock;
+    pthread_cond_t        cond;
+    int                   started;      /* Reader thread running, to be joined */
+    int                   done;         /* Reader thread finished, error or not */
+    int                   error;        /* 0, errno of the reader thread or CHUNK_READ_* */
+    int                   stop;         /* Set by chunkReaderClose() */
+} ChunkReader;
+
+/*
+ * Start reading rows [first, first + count) of a fingerprint file, count
+ * may be FP_STORE_ALL. Returns 0 on success.
+ */
+int  chunkReaderOpen(ChunkReader *reader, const char *filename,
+                     size_t first, size_t count, size_t chunkRows);
+
+/*
+ * Release the previous chunk and wait for the next one. Returns 1 with
+ * *chunk set, 0 after the last chunk, -1 on a read error. A chunk stays
+ * valid until the next call.
+ */
+int  chunkReaderNext(ChunkReader *reader, const FingerprintStore **chunk);
+
+/* Stop the reader thread and free the buffers */
+void chunkReaderClose(ChunkReader *reader);
+
+/*
+ * searchParallel() over every chunk of the reader, the hits of each chunk
+ * reach the sink before the next chunk is searched. cfg->cmpBuckets is
+ * ignored: in MATCH_SIMILAR mode the chunks of a file sorted by weight are
+ * pruned with their own buckets. stats sums up all chunks and may be NULL.
+ * Returns 0 on success.
+ */
+int  searchChunks(const FingerprintStore *ref,
+                  ChunkReader *reader,
+                  const SearchConfig *cfg,
+                  HitSink sink, void *ctx,
+                  SearchStats *stats);
+
+#endif // CHUNKREAD_H
@@ -0,0 +1,611 @@
+#include "fpstore.h"
+#include "popcnt.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Rows read per fread() call in fpStoreReadPacked
+#define FP_STORE_IO_ROWS 4096
+
+/*
+ * Function: fpStoreInit
+ * Row stride is the fingerprint rounded up to whole FP_STORE_ALIGN byte
+ * blocks, e.g. 920 bits -> 115 bytes -> 128 bytes (16 words).
+ */
+static uint32_t strideWords(uint32_t width)
+{
+    const size_t wordsPerLine = FP_STORE_ALIGN / sizeof(uint64_t);
+    size_t words = ((size_t)width + 63) / 64;
+
+    return (uint32_t)((words + wordsPerLine - 1) / wordsPerLine * wordsPerLine);
+}
+
+int fpStoreInit(FingerprintStore *store, size_t count, uint32_t width)
+{
+    memset(store, 0, sizeof(*store));
+    store->count  = count;
+    store->width  = width;
+    store->stride = strideWords(width);
+
+    size_t bitsBytes = count * store->stride * sizeof(uint64_t);
+    void  *ptr = NULL;
+
+    if (posix_memalign(&ptr, FP_STORE_ALIGN, bitsBytes ? bitsBytes : FP_STORE_ALIGN)) {
+        fprintf(stderr, "Failed to allocate %zu fingerprint rows\n", count);
+        return -1;
+    }
+    memset(ptr, 0, bitsBytes);
+    store->bits = (uint64_t *)ptr;
+
+    store->ids     = (uint32_t *)calloc(count ? count : 1, sizeof(uint32_t));
+    store->weights = (uint32_t *)calloc(count ? count : 1, sizeof(uint32_t));
+    if (!store->ids || !store->weights) {
+        fprintf(stderr, "Failed to allocate %zu fingerprint IDs/weights\n", count);
+        fpStoreFree(store);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Function: fpStoreFree
+ * Mapped stores only unmap their file.
+ */
+void fpStoreFree(FingerprintStore *store)
+{
+    if (store->map) {
+        munmap(store->map, store->mapSize);
+    } else {
+        free(store->bits);
+        free(store->ids);
+        free(store->weights);
+    }
+
+    store->bits    = NULL;
+    store->ids     = NULL;
+    store->weights = NULL;
+    store->map     = NULL;
+    store->mapSize = 0;
+    store->count   = 0;
+}
+
+
+/*
+ * Function: fpStoreAssignIDs
+ * IDs are consecutive, starting at firstID. (The accelerator numbers vectors
+ * by their position in the dataset, with ID 0 reserved.)
+ */
+void fpStoreAssignIDs(FingerprintStore *store, uint32_t firstID)
+{
+    for (size_t i = 0; i < store->count; i++) {
+        store->ids[i] = firstID + (uint32_t)i;
+    }
+}
+
+
+/*
+ * Function: fpStoreComputeWeights
+ * Padding bits are zero, so the full padded row is counted.
+ */
+void fpStoreComputeWeights(FingerprintStore *store)
+{
+    for (size_t i = 0; i < store->count; i++) {
+        store->weights[i] = popcnt((const uint8_t *)fpStoreRow(store, i),
+                                   fpStoreStrideBytes(store));
+    }
+}
+
+
+/*
+ * Function: fpStoreSetRow
+ * Bits of the last byte past width are cleared as well, so that weights
+ * never depend on garbage in the input.
+ */
+void fpStoreSetRow(FingerprintStore *store, size_t idx, const uint8_t *data)
+{
+    uint8_t *row      = (uint8_t *)fpStoreRow(store, idx);
+    size_t   rowBytes = fpStoreRowBytes(store);
+
+    memcpy(row, data, rowBytes);
+    memset(row + rowBytes, 0, fpStoreStrideBytes(store) - rowBytes);
+
+    if (store->width % 8) {
+        row[rowBytes-1] &= (uint8_t)((1u << (store->width % 8)) - 1);
+    }
+}
+
+
+/*
+ * Function: fpStoreReadPacked
+ * Reads store->count back to back rows of fpStoreRowBytes() bytes (the
+ * format of vectors.bin) in large blocks, then spreads them to the padded
+ * rows.
+ */
+int fpStoreReadPacked(FingerprintStore *store, FILE *fp)
+{
+    size_t   rowBytes = fpStoreRowBytes(store);
+    uint8_t *buf      = (uint8_t *)malloc(FP_STORE_IO_ROWS * rowBytes);
+
+    if (!buf) {
+        fprintf(stderr, "Failed to allocate read buffer\n");
+        return -1;
+    }
+
+    for (size_t i = 0; i < store->count; i += FP_STORE_IO_ROWS) {
+        size_t rows = store->count - i;
+        if (rows > FP_STORE_IO_ROWS) {
+            rows = FP_STORE_IO_ROWS;
+        }
+
+        if (fread(buf, rowBytes, rows, fp) != rows) {
+            perror("Failed to read fingerprint data");
+            free(buf);
+            return -1;
+        }
+
+        for (size_t j = 0; j < rows; j++) {
+            fpStoreSetRow(store, i + j, buf + j * rowBytes);
+        }
+    }
+
+    free(buf);
+    return 0;
+}
+
+
+/*
+ * Function: fpStoreWritePacked
+ * Inverse of fpStoreReadPacked, padding is not written.
+ */
+int fpStoreWritePacked(const FingerprintStore *store, FILE *fp)
+{
+    size_t rowBytes = fpStoreRowBytes(store);
+
+    for (size_t i = 0; i < store->count; i++) {
+        if (fwrite(fpStoreRow(store, i), 1, rowBytes, fp) != rowBytes) {
+            perror("Failed to write fingerprint data");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * Function: fpStorePack
+ * Fill an accelerator input buffer, vectors are stored continuously.
+ */
+void fpStorePack(const FingerprintStore *store, uint8_t *dst)
+{
+    size_t rowBytes = fpStoreRowBytes(store);
+
+    for (size_t i = 0; i < store->count; i++) {
+        memcpy(dst + i * rowBytes, fpStoreRow(store, i), rowBytes);
+    }
+}
+
+
+/*
+ * Function: weightBucketsBuild
+ * Counts rows per weight, prefix sum gives the bucket boundaries.
+ */
+int weightBucketsBuild(WeightBuckets *buckets, const FingerprintStore *store)
+{
+    buckets->width = store->width;
+    buckets->start = (size_t *)calloc((size_t)store->width + 2, sizeof(size_t));
+    if (!buckets->start) {
+        fprintf(stderr, "Failed to allocate weight buckets\n");
+        return -1;
+    }
+
+    for (size_t i = 0; i < store->count; i++) {
+        buckets->start[store->weights[i] + 1]++;
+    }
+    for (uint32_t w = 1; w <= store->width + 1; w++) {
+        buckets->start[w] += buckets->start[w-1];
+    }
+
+    return 0;
+}
+
+
+void weightBucketsFree(WeightBuckets *buckets)
+{
+    free(buckets->start);
+    buckets->start = NULL;
+}
+
+
+/*
+ * Function: fpStoreSortByWeight
+ * Counting sort on the weight into a second store, which then replaces the
+ * original one (memory peaks at two stores).
+ */
+int fpStoreSortByWeight(FingerprintStore *store, WeightBuckets *buckets)
+{
+    FingerprintStore sorted;
+    WeightBuckets    local;
+
+    if (weightBucketsBuild(&local, store)) {
+        return -1;
+    }
+
+    if (fpStoreInit(&sorted, store->count, store->width)) {
+        weightBucketsFree(&local);
+        return -1;
+    }
+
+    size_t *next = (size_t *)malloc(((size_t)store->width + 1) * sizeof(size_t));
+    if (!next) {
+        fprintf(stderr, "Failed to allocate sort buffer\n");
+        fpStoreFree(&sorted);
+        weightBucketsFree(&local);
+        return -1;
+    }
+    memcpy(next, local.start, ((size_t)store->width + 1) * sizeof(size_t));
+
+    for (size_t i = 0; i < store->count; i++) {
+        size_t dst = next[store->weights[i]]++;
+        memcpy(fpStoreRow(&sorted, dst), fpStoreRow(store, i), fpStoreStrideBytes(store));
+        sorted.ids[dst]     = store->ids[i];
+        sorted.weights[dst] = store->weights[i];
+    }
+
+    free(next);
+    fpStoreFree(store);
+    *store = sorted;
+
+    if (buckets) {
+        *buckets = local;
+    } else {
+        weightBucketsFree(&local);
+    }
+
+    return 0;
+}
+
+
+/* ------------------------------------------------------------------------
+ * Fingerprint files
+ */
+
+_Static_assert(sizeof(FingerprintFileHeader) == FP_STORE_ALIGN,
+               "fingerprint file header must fill exactly one aligned block");
+
+static uint64_t alignUp(uint64_t bytes)
+{
+    return (bytes + FP_STORE_ALIGN - 1) / FP_STORE_ALIGN * FP_STORE_ALIGN;
+}
+
+/*
+ * Function: fileLayout
+ * Section offsets of a file of header->count rows. There is exactly one
+ * valid layout per width and count, readers check for it.
+ */
+static void fileLayout(FingerprintFileHeader *header)
+{
+    header->bitsOffset    = alignUp(sizeof(FingerprintFileHeader));
+    header->weightsOffset = alignUp(header->bitsOffset + header->count * header->stride * sizeof(uint64_t));
+    header->idsOffset     = alignUp(header->weightsOffset + header->count * sizeof(uint32_t));
+}
+
+static uint64_t bucketsOffset(const FingerprintFileHeader *header)
+{
+    return alignUp(header->idsOffset + header->count * sizeof(uint32_t));
+}
+
+/* Bytes of a valid file, index included */
+static uint64_t fileSizeOf(const FingerprintFileHeader *header)
+{
+    if (header->flags & FP_FILE_SORTED_BY_WEIGHT) {
+        return bucketsOffset(header) + ((uint64_t)header->width + 2) * sizeof(uint64_t);
+    }
+    return header->idsOffset + header->count * sizeof(uint32_t);
+}
+
+/*
+ * Function: checkHeader
+ * Everything a reader relies on, including that all sections are inside a
+ * file of fileSize bytes (count is bounded first, so nothing overflows).
+ */
+static int checkHeader(const FingerprintFileHeader *header, uint64_t fileSize, const char *filename)
+{
+    FingerprintFileHeader expected;
+
+    if (header->magic != FP_FILE_MAGIC) {
+        fprintf(stderr, "%s is not a fingerprint file\n", filename);
+        return -1;
+    }
+    if (header->version != FP_FILE_VERSION || header->headerSize != sizeof(FingerprintFileHeader)) {
+        fprintf(stderr, "%s: unsupported fingerprint file version %u\n", filename, header->version);
+        return -1;
+    }
+    if (header->flags & ~FP_FILE_SORTED_BY_WEIGHT) {
+        fprintf(stderr, "%s: unknown fingerprint file flags 0x%x\n", filename, header->flags);
+        return -1;
+    }
+    if (header->width == 0 || header->stride != strideWords(header->width) ||
+        header->count > fileSize / (header->stride * sizeof(uint64_t))) {
+        fprintf(stderr, "%s: invalid width, stride or count\n", filename);
+        return -1;
+    }
+
+    expected = *header;
+    fileLayout(&expected);
+    if (header->bitsOffset != expected.bitsOffset ||
+        header->weightsOffset != expected.weightsOffset ||
+        header->idsOffset != expected.idsOffset ||
+        fileSize < fileSizeOf(header)) {
+        fprintf(stderr, "%s: invalid section layout or truncated file\n", filename);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int writeZeros(FILE *fp, uint64_t bytes)
+{
+    static const uint8_t zeros[FP_STORE_ALIGN] = {0};
+
+    return fwrite(zeros, 1, (size_t)bytes, fp) == bytes ? 0 : -1;
+}
+
+/*
+ * Function: writeFile
+ * Sections are written store by store. Rows are written with their padding,
+ * which is zero in every store, so the file can be mapped as is. buckets is
+ * the index of a single sorted store, or NULL.
+ */
+static int writeFile(const char *filename, const FingerprintStore *const *stores,
+                     size_t storeNo, const WeightBuckets *buckets)
+{
+    FingerprintFileHeader header;
+
+    memset(&header, 0, sizeof(header));
+    header.magic      = FP_FILE_MAGIC;
+    header.version    = FP_FILE_VERSION;
+    header.headerSize = sizeof(FingerprintFileHeader);
+    header.flags      = buckets ? FP_FILE_SORTED_BY_WEIGHT : 0;
+
+    for (size_t s = 0; s < storeNo; s++) {
+        if (s > 0 && stores[s]->width != stores[0]->width) {
+            fprintf(stderr, "Stores of different widths cannot share a fingerprint file\n");
+            return -1;
+        }
+        header.count += stores[s]->count;
+    }
+    if (storeNo == 0) {
+        fprintf(stderr, "No fingerprints to write\n");
+        return -1;
+    }
+
+    header.width  = stores[0]->width;
+    header.stride = stores[0]->stride;
+    for (size_t s = 0; s < storeNo && header.count; s++) {
+        if (stores[s]->count) {
+            header.idBase = stores[s]->ids[0];
+            break;
+        }
+    }
+    fileLayout(&header);
+
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        perror("Failed to open fingerprint file");
+        return -1;
+    }
+
+    int      error = fwrite(&header, sizeof(header), 1, fp) != 1;
+    uint64_t pos   = sizeof(header);
+
+    error |= writeZeros(fp, header.bitsOffset - pos);
+    pos    = header.bitsOffset;
+    for (size_t s = 0; s < storeNo && !error; s++) {
+        size_t bytes = stores[s]->count * fpStoreStrideBytes(stores[s]);
+        error |= fwrite(stores[s]->bits, 1, bytes, fp) != bytes;
+        pos   += bytes;
+    }
+
+    error |= writeZeros(fp, header.weightsOffset - pos);
+    pos    = header.weightsOffset;
+    for (size_t s = 0; s < storeNo && !error; s++) {
+        error |= fwrite(stores[s]->weights, sizeof(uint32_t), stores[s]->count, fp) != stores[s]->count;
+        pos   += stores[s]->count * sizeof(uint32_t);
+    }
+
+    error |= writeZeros(fp, header.idsOffset - pos);
+    pos    = header.idsOffset;
+    for (size_t s = 0; s < storeNo && !error; s++) {
+        error |= fwrite(stores[s]->ids, sizeof(uint32_t), stores[s]->count, fp) != stores[s]->count;
+        pos   += stores[s]->count * sizeof(uint32_t);
+    }
+
+    if (buckets) {
+        error |= writeZeros(fp, bucketsOffset(&header) - pos);
+        for (uint32_t w = 0; w <= header.width + 1 && !error; w++) {
+            uint64_t start = buckets->start[w];
+            error |= fwrite(&start, sizeof(start), 1, fp) != 1;
+        }
+    }
+
+    if (error) {
+        perror("Failed to write fingerprint file");
+    }
+    if (fclose(fp) != 0) {
+        perror("Failed to close fingerprint file");
+        error = 1;
+    }
+
+    return error ? -1 : 0;
+}
+
+
+int fpStoreWriteFile(const char *filename, const FingerprintStore *const *stores, size_t storeNo)
+{
+    return writeFile(filename, stores, storeNo, NULL);
+}
+
+
+int fpStoreWriteIndex(const char *filename, const FingerprintStore *store,
+                      const WeightBuckets *buckets)
+{
+    if (buckets->width != store->width || buckets->start[store->width + 1] != store->count) {
+        fprintf(stderr, "Weight buckets do not belong to the store\n");
+        return -1;
+    }
+
+    return writeFile(filename, &store, 1, buckets);
+}
+
+
+/*
+ * Function: fpStoreReadFileHeader
+ */
+int fpStoreReadFileHeader(const char *filename, FingerprintFileHeader *header)
+{
+    struct stat st;
+    FILE       *fp = fopen(filename, "rb");
+
+    if (!fp) {
+        perror("Failed to open fingerprint file");
+        return -1;
+    }
+
+    if (fstat(fileno(fp), &st) != 0 || fread(header, sizeof(*header), 1, fp) != 1) {
+        fprintf(stderr, "%s: failed to read the fingerprint file header\n", filename);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    return checkHeader(header, (uint64_t)st.st_size, filename);
+}
+
+
+/*
+ * Function: fpStoreMapFile
+ * The whole file is mapped, pages are only read when rows are touched.
+ * Mapping the same file twice (e.g. ref and cmp rows) shares the page cache.
+ * The weights of the mapped rows are read once to check their range, 4
+ * bytes per row against a row's stride of bits.
+ */
+int fpStoreMapFile(FingerprintStore *store, const char *filename, size_t first, size_t count)
+{
+    struct stat st;
+    int         fd = open(filename, O_RDONLY);
+
+    memset(store, 0, sizeof(*store));
+    if (fd < 0) {
+        perror("Failed to open fingerprint file");
+        return -1;
+    }
+
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(FingerprintFileHeader)) {
+        fprintf(stderr, "%s: not a fingerprint file\n", filename);
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Failed to map fingerprint file");
+        return -1;
+    }
+
+    const FingerprintFileHeader *header = (const FingerprintFileHeader *)map;
+    if (checkHeader(header, (uint64_t)st.st_size, filename)) {
+        munmap(map, (size_t)st.st_size);
+        return -1;
+    }
+
+    if (first > header->count || (count != FP_STORE_ALL && count > header->count - first)) {
+        fprintf(stderr, "%s: rows [%zu, %zu) are out of the file's %llu rows\n", filename,
+                first, count == FP_STORE_ALL ? (size_t)header->count : first + count,
+                (unsigned long long)header->count);
+        munmap(map, (size_t)st.st_size);
+        return -1;
+    }
+
+    /* Weights index bucket tables and search windows, reject any above the width */
+    const uint32_t *weights = (const uint32_t *)((uint8_t *)map + header->weightsOffset);
+    size_t          end     = count == FP_STORE_ALL ? (size_t)header->count : first + count;
+
+    for (size_t i = first; i < end; i++) {
+        if (weights[i] > header->width) {
+            fprintf(stderr, "%s: row %zu has weight %u, above the width of %u bits\n", filename,
+                    i, weights[i], header->width);
+            munmap(map, (size_t)st.st_size);
+            return -1;
+        }
+    }
+
+    store->count   = end - first;
+    store->width   = header->width;
+    store->stride  = header->stride;
+    store->bits    = (uint64_t *)((uint8_t *)map + header->bitsOffset) + first * header->stride;
+    store->weights = (uint32_t *)((uint8_t *)map + header->weightsOffset) + first;
+    store->ids     = (uint32_t *)((uint8_t *)map + header->idsOffset) + first;
+    store->map     = map;
+    store->mapSize = (size_t)st.st_size;
+
+    return 0;
+}
+
+
+/*
+ * Function: fpStoreMapIndex
+ * The index is copied, it is only width + 2 entries. Its boundaries have
+ * to be ascending, and the first and last row of every bucket have to
+ * weigh the bucket's weight, or a query would skip rows it matches.
+ * fpStoreMapFile() has checked the weights' range already.
+ */
+int fpStoreMapIndex(FingerprintStore *store, WeightBuckets *buckets, const char *filename)
+{
+    if (fpStoreMapFile(store, filename, 0, FP_STORE_ALL)) {
+        return -1;
+    }
+
+    const FingerprintFileHeader *header = (const FingerprintFileHeader *)store->map;
+    if (!(header->flags & FP_FILE_SORTED_BY_WEIGHT)) {
+        fprintf(stderr, "%s has no weight index\n", filename);
+        fpStoreFree(store);
+        return -1;
+    }
+
+    buckets->width = store->width;
+    buckets->start = (size_t *)malloc(((size_t)store->width + 2) * sizeof(size_t));
+    if (!buckets->start) {
+        fprintf(stderr, "Failed to allocate weight buckets\n");
+        fpStoreFree(store);
+        return -1;
+    }
+
+    const uint64_t *index = (const uint64_t *)((const uint8_t *)store->map + bucketsOffset(header));
+    int valid = index[0] == 0 && index[store->width + 1] == store->count;
+
+    for (uint32_t w = 0; w <= store->width + 1; w++) {
+        valid &= w == 0 || index[w] >= index[w-1];
+        buckets->start[w] = (size_t)index[w];
+    }
+    for (uint32_t w = 0; w <= store->width && valid; w++) {
+        if (index[w] < index[w+1]) {
+            valid = store->weights[index[w]] == w && store->weights[index[w+1] - 1] == w;
+        }
+    }
+
+    if (!valid) {
+        fprintf(stderr, "%s: invalid weight index\n", filename);
+        weightBucketsFree(buckets);
+        fpStoreFree(store);
+        return -1;
+    }
+
+    return 0;
+}
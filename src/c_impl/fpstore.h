@@ -0,0 +1,180 @@
+#ifndef FPSTORE_H
+#define FPSTORE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Fingerprint store
+ * Runtime sized set of fingerprints in structure-of-arrays layout:
+ *
+ * bits     - count rows of stride 64-bit words. Every row starts on a
+ *            FP_STORE_ALIGN byte boundary, bits past width are zero, so
+ *            kernels may always process full rows.
+ * ids      - vector ID of every row
+ * weights  - CNT(row), filled by fpStoreComputeWeights()
+ *
+ * In the accelerator's buffers (and in vectors.bin) fingerprints are packed
+ * back to back, fpStoreRowBytes() bytes each (see fpStoreReadPacked and
+ * fpStorePack). Fingerprint files (below) keep the padded in-memory layout,
+ * so a store can point straight into a mapping of the file.
+ */
+
+#define FP_STORE_ALIGN  64      // cache line, also the widest SIMD load
+
+typedef struct {
+    size_t    count;            /* Number of fingerprints */
+    uint32_t  width;            /* Fingerprint width in bits */
+    uint32_t  stride;           /* Row stride in uint64_t words */
+    uint64_t *bits;
+    uint32_t *ids;
+    uint32_t *weights;
+    void     *map;              /* File mapping the arrays point into, NULL if allocated */
+    size_t    mapSize;
+} FingerprintStore;
+
+/* Allocate a zeroed store of count fingerprints, returns 0 on success */
+int  fpStoreInit(FingerprintStore *store, size_t count, uint32_t width);
+
+/* Release all arrays of the store (or its file mapping) */
+void fpStoreFree(FingerprintStore *store);
+
+/* Pointer to the idx-th row */
+static inline uint64_t *fpStoreRow(const FingerprintStore *store, size_t idx)
+{
+    return store->bits + idx * store->stride;
+}
+
+/* Bytes of actual fingerprint data in a row (packed row size) */
+static inline size_t fpStoreRowBytes(const FingerprintStore *store)
+{
+    return ((size_t)store->width + 7) / 8;
+}
+
+/* Bytes of a padded row, multiple of FP_STORE_ALIGN */
+static inline size_t fpStoreStrideBytes(const FingerprintStore *store)
+{
+    return (size_t)store->stride * sizeof(uint64_t);
+}
+
+/* ids[i] = firstID + i */
+void fpStoreAssignIDs(FingerprintStore *store, uint32_t firstID);
+
+/* weights[i] = CNT(row i) */
+void fpStoreComputeWeights(FingerprintStore *store);
+
+/* Copy fpStoreRowBytes() bytes of data into row idx, clearing the padding */
+void fpStoreSetRow(FingerprintStore *store, size_t idx, const uint8_t *data);
+
+/* Read store->count packed rows from fp, returns 0 on success */
+int  fpStoreReadPacked(FingerprintStore *store, FILE *fp);
+
+/* Write all rows packed to fp, returns 0 on success */
+int  fpStoreWritePacked(const FingerprintStore *store, FILE *fp);
+
+/* Copy all rows packed to dst (count * fpStoreRowBytes() bytes) */
+void fpStorePack(const FingerprintStore *store, uint8_t *dst);
+
+/*
+ * Weight buckets of a store sorted by weight: rows with weight w are
+ * [start[w], start[w+1]), for w in [0, width].
+ */
+typedef struct {
+    uint32_t  width;
+    size_t   *start;            /* width + 2 entries */
+} WeightBuckets;
+
+/*
+ * Reorder rows (with their ids and weights) by ascending weight, stable.
+ * Weights must be computed. buckets may be NULL, otherwise it is filled.
+ */
+int  fpStoreSortByWeight(FingerprintStore *store, WeightBuckets *buckets);
+
+/* Fill buckets from a store already sorted by weight */
+int  weightBucketsBuild(WeightBuckets *buckets, const FingerprintStore *store);
+
+void weightBucketsFree(WeightBuckets *buckets);
+
+/*
+ * Fingerprint file, version 1
+ * Self-describing, native byte order (little endian on every supported
+ * target). All sections start on an FP_STORE_ALIGN byte boundary:
+ *
+ * header   - FingerprintFileHeader, FP_STORE_ALIGN bytes
+ * bits     - count rows of stride 64-bit words, padding bits are zero
+ * weights  - count x uint32_t, CNT(row)
+ * ids      - count x uint32_t
+ * buckets  - only if FP_FILE_SORTED_BY_WEIGHT is set: width + 2 x uint64_t,
+ *            the WeightBuckets boundaries of the rows (the weight index)
+ *
+ * The rows are the FingerprintStore layout, a store opened with
+ * fpStoreMapFile() uses the mapped sections directly, nothing is copied or
+ * recomputed, only the weights are read to check them. Sections have no offset of their own past idsOffset,
+ * the next one starts on the next aligned boundary.
+ */
+#define FP_FILE_MAGIC           0x53504646u     // "FFPS"
+#define FP_FILE_VERSION         1
+
+#define FP_FILE_SORTED_BY_WEIGHT    0x1u        // rows in ascending weight order, buckets section present
+
+typedef struct {
+    uint32_t  magic;
+    uint32_t  version;
+    uint32_t  headerSize;       /* sizeof(FingerprintFileHeader) */
+    uint32_t  width;            /* Fingerprint width in bits */
+    uint32_t  stride;           /* Row stride in uint64_t words */
+    uint32_t  flags;            /* FP_FILE_* */
+    uint64_t  count;            /* Number of fingerprints */
+    uint32_t  idBase;           /* ID of the first row */
+    uint32_t  reserved;
+    uint64_t  bitsOffset;       /* Section offsets from the start of the file */
+    uint64_t  weightsOffset;
+    uint64_t  idsOffset;
+} FingerprintFileHeader;
+
+/* Row count for fpStoreMapFile(): every row up to the end of the file */
+#define FP_STORE_ALL            ((size_t)-1)
+
+/*
+ * Write the stores one after the other into a single fingerprint file (e.g.
+ * ref then cmp, as in vectors.bin). All stores must have the same width and
+ * computed weights. Returns 0 on success.
+ */
+int  fpStoreWriteFile(const char *filename, const FingerprintStore *const *stores, size_t storeNo);
+
+/*
+ * Write a store sorted by weight (see fpStoreSortByWeight()) and its buckets
+ * as an indexed fingerprint file. Returns 0 on success.
+ */
+int  fpStoreWriteIndex(const char *filename, const FingerprintStore *store,
+                       const WeightBuckets *buckets);
+
+/*
+ * Map rows [first, first + count) of a fingerprint file into store, count
+ * may be FP_STORE_ALL for every row from first on. The mapping is private,
+ * writes to the store never reach the file. A row weighing more than the
+ * width fails the mapping. Returns 0 on success.
+ */
+int  fpStoreMapFile(FingerprintStore *store, const char *filename, size_t first, size_t count);
+
+/*
+ * Map all rows of an indexed fingerprint file and fill buckets from its
+ * index, as fpStoreSortByWeight() would. A threshold query then only pages
+ * in the bits of the buckets it can match. An index that disagrees with the
+ * rows' weights fails the mapping. Returns 0 on success.
+ */
+int  fpStoreMapIndex(FingerprintStore *store, WeightBuckets *buckets, const char *filename);
+
+/* Read only the header of a fingerprint file, returns 0 if it is valid */
+int  fpStoreReadFileHeader(const char *filename, FingerprintFileHeader *header);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FPSTORE_H
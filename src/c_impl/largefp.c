@@ -0,0 +1,398 @@
+#include "largefp.h"
+#include "popcnt.h"
+#include "worksteal.h"
+#include <string.h>
+
+// Hit of searchLarge, buffered until all tiles are done
+typedef struct {
+    uint32_t refIdx;
+    uint32_t cmpIdx;
+    uint32_t cntC;
+} LargeHit;
+
+// Per thread state, one cache line aligned block per worker
+typedef struct {
+    LargeHit  *hits;
+    size_t     cnt;
+    size_t     cap;
+    uint64_t   pruned;
+    uint64_t   terminated;
+    int        error;
+} __attribute__((aligned(64))) LargeBuffer;
+
+// Where the hits of a tile ended up, (ref, cmp) sorted
+typedef struct {
+    uint32_t   worker;
+    size_t     begin;
+    size_t     cnt;
+} LargeTileHits;
+
+typedef struct {
+    const BlockedStore *ref;
+    const BlockedStore *cmp;
+    const SearchConfig *cfg;
+    size_t              cmpTileNo;
+    LargeBuffer        *buffers;
+    LargeTileHits      *tiles;
+} LargeSearch;
+
+
+/*
+ * Function: blockedStoreInit
+ */
+int blockedStoreInit(BlockedStore *dst, const FingerprintStore *src)
+{
+    const size_t blockBytes = LARGE_FP_BLOCK_WORDS * sizeof(uint64_t);
+
+    memset(dst, 0, sizeof(*dst));
+    dst->count   = src->count;
+    dst->width   = src->width;
+    dst->blockNo = (uint32_t)(((size_t)src->width + LARGE_FP_BLOCK_WORDS * 64 - 1) / (LARGE_FP_BLOCK_WORDS * 64));
+
+    size_t bitsBytes = (size_t)dst->blockNo * src->count * blockBytes;
+    void  *ptr = NULL;
+    if (posix_memalign(&ptr, FP_STORE_ALIGN, bitsBytes ? bitsBytes : FP_STORE_ALIGN)) {
+        fprintf(stderr, "Failed to allocate %zu blocked fingerprint rows\n", src->count);
+        return -1;
+    }
+    dst->bits      = (uint64_t *)ptr;
+    dst->remaining = (uint32_t *)malloc((src->count ? src->count : 1) * ((size_t)dst->blockNo + 1) * sizeof(uint32_t));
+    dst->ids       = (uint32_t *)malloc((src->count ? src->count : 1) * sizeof(uint32_t));
+    dst->weights   = (uint32_t *)malloc((src->count ? src->count : 1) * sizeof(uint32_t));
+    if (!dst->remaining || !dst->ids || !dst->weights) {
+        fprintf(stderr, "Failed to allocate %zu blocked fingerprint weights\n", src->count);
+        blockedStoreFree(dst);
+        return -1;
+    }
+
+    memcpy(dst->ids, src->ids, src->count * sizeof(uint32_t));
+    memcpy(dst->weights, src->weights, src->count * sizeof(uint32_t));
+
+    for (size_t i = 0; i < src->count; i++) {
+        const uint64_t *row = fpStoreRow(src, i);
+        uint32_t       *rem = &dst->remaining[i * (dst->blockNo + 1)];
+
+        rem[dst->blockNo] = 0;
+        for (uint32_t k = dst->blockNo; k-- > 0;) {
+            uint64_t *seg   = (uint64_t *)blockedStoreSegment(dst, k, i);
+            size_t    first = (size_t)k * LARGE_FP_BLOCK_WORDS;
+            size_t    words = src->stride - first < LARGE_FP_BLOCK_WORDS ? src->stride - first : LARGE_FP_BLOCK_WORDS;
+
+            memset(seg, 0, blockBytes);
+            memcpy(seg, row + first, words * sizeof(uint64_t));
+            rem[k] = rem[k + 1] + popcnt((const uint8_t *)seg, blockBytes);
+        }
+    }
+
+    return 0;
+}
+
+
+void blockedStoreFree(BlockedStore *store)
+{
+    free(store->bits);
+    free(store->remaining);
+    free(store->ids);
+    free(store->weights);
+
+    store->bits      = NULL;
+    store->remaining = NULL;
+    store->ids       = NULL;
+    store->weights   = NULL;
+    store->count     = 0;
+}
+
+
+static int reserveHits(LargeBuffer *buf, size_t n)
+{
+    if (buf->cnt + n <= buf->cap) {
+        return 0;
+    }
+
+    size_t cap = buf->cap ? buf->cap : 1024;
+    while (cap < buf->cnt + n) {
+        cap *= 2;
+    }
+
+    LargeHit *hits = (LargeHit *)realloc(buf->hits, cap * sizeof(LargeHit));
+    if (!hits) {
+        return -1;
+    }
+    buf->hits = hits;
+    buf->cap  = cap;
+
+    return 0;
+}
+
+
+/*
+ * Function: prefetchBlock
+ * Request column block k of the tile's rows, a block of a tile is
+ * contiguous in the blocked layout.
+ */
+static inline void prefetchBlock(const BlockedStore *store, uint32_t k, size_t begin, size_t end)
+{
+    const char *p    = (const char *)blockedStoreSegment(store, k, begin);
+    const char *last = (const char *)blockedStoreSegment(store, k, end);
+
+    for (; p < last; p += FP_STORE_ALIGN) {
+        __builtin_prefetch(p, 0, 3);
+    }
+}
+
+
+/*
+ * Function: largeTile
+ * TileFn of searchLarge, tiles are numbered ref block major. The tile's
+ * partial counts live on the stack, column blocks are visited in order and
+ * every POPCNT_BLOCK_REF x POPCNT_BLOCK_CMP block of pairs is counted by
+ * the micro-kernel as long as one of its pairs is alive.
+ */
+static void largeTile(void *ctx, unsigned int worker, size_t tile)
+{
+    LargeSearch        *search = (LargeSearch *)ctx;
+    const BlockedStore *ref    = search->ref;
+    const BlockedStore *cmp    = search->cmp;
+    const SearchConfig *cfg    = search->cfg;
+    LargeBuffer        *buf    = &search->buffers[worker];
+    uint32_t            cntC[LARGE_TILE_REF][LARGE_TILE_CMP];
+    uint32_t            limit[LARGE_TILE_REF][LARGE_TILE_CMP];
+    bool                alive[LARGE_TILE_REF][LARGE_TILE_CMP];
+    uint32_t            cnt[POPCNT_BLOCK_REF * POPCNT_BLOCK_CMP];
+    uint32_t            aliveNo = 0;
+
+    size_t refBegin = (tile / search->cmpTileNo) * LARGE_TILE_REF;
+    size_t cmpBegin = (tile % search->cmpTileNo) * LARGE_TILE_CMP;
+    size_t refRows  = ref->count - refBegin < LARGE_TILE_REF ? ref->count - refBegin : LARGE_TILE_REF;
+    size_t cmpRows  = cmp->count - cmpBegin < LARGE_TILE_CMP ? cmp->count - cmpBegin : LARGE_TILE_CMP;
+
+    // Weights alone (no CNT(A & B) counted yet)
+    for (size_t r = 0; r < refRows; r++) {
+        for (size_t c = 0; c < cmpRows; c++) {
+            uint32_t a = ref->weights[refBegin + r];
+            uint32_t b = cmp->weights[cmpBegin + c];
+
+            cntC[r][c]  = 0;
+            limit[r][c] = searchPairLimit(cfg, a, b);
+            alive[r][c] = searchPairAlive(cfg, limit[r][c], 0, a < b ? a : b);
+            aliveNo    += alive[r][c];
+        }
+    }
+    buf->pruned += (uint64_t)refRows * cmpRows - aliveNo;
+
+    for (uint32_t k = 0; k < ref->blockNo && aliveNo > 0; k++) {
+        if (k + 1 < ref->blockNo) {
+            prefetchBlock(ref, k + 1, refBegin, refBegin + refRows);
+            prefetchBlock(cmp, k + 1, cmpBegin, cmpBegin + cmpRows);
+        }
+
+        for (size_t i = 0; i < refRows; i += POPCNT_BLOCK_REF) {
+            size_t bRef = refRows - i < POPCNT_BLOCK_REF ? refRows - i : POPCNT_BLOCK_REF;
+
+            for (size_t j = 0; j < cmpRows; j += POPCNT_BLOCK_CMP) {
+                size_t bCmp = cmpRows - j < POPCNT_BLOCK_CMP ? cmpRows - j : POPCNT_BLOCK_CMP;
+                bool   any  = false;
+
+                for (size_t r = 0; r < bRef; r++) {
+                    for (size_t c = 0; c < bCmp; c++) {
+                        any |= alive[i + r][j + c];
+                    }
+                }
+                if (!any) {
+                    continue;
+                }
+
+                if (bRef == POPCNT_BLOCK_REF && bCmp == POPCNT_BLOCK_CMP) {
+                    popcntAndBlock(blockedStoreSegment(ref, k, refBegin + i),
+                                  blockedStoreSegment(cmp, k, cmpBegin + j),
+                                  LARGE_FP_BLOCK_WORDS, cnt);
+                } else {
+                    for (size_t r = 0; r < bRef; r++) {
+                        for (size_t c = 0; c < bCmp; c++) {
+                            cnt[r * POPCNT_BLOCK_CMP + c] =
+                                popcntAnd((const uint8_t *)blockedStoreSegment(ref, k, refBegin + i + r),
+                                          (const uint8_t *)blockedStoreSegment(cmp, k, cmpBegin + j + c),
+                                          LARGE_FP_BLOCK_WORDS * sizeof(uint64_t));
+                        }
+                    }
+                }
+
+                for (size_t r = 0; r < bRef; r++) {
+                    for (size_t c = 0; c < bCmp; c++) {
+                        cntC[i + r][j + c] += cnt[r * POPCNT_BLOCK_CMP + c];
+                    }
+                }
+            }
+        }
+
+        if (k + 1 == ref->blockNo) {
+            break;
+        }
+
+        // Running bound, before the next block is counted
+        for (size_t r = 0; r < refRows; r++) {
+            const uint32_t *remA = &ref->remaining[(refBegin + r) * (ref->blockNo + 1)];
+
+            for (size_t c = 0; c < cmpRows; c++) {
+                if (!alive[r][c]) {
+                    continue;
+                }
+
+                const uint32_t *remB   = &cmp->remaining[(cmpBegin + c) * (cmp->blockNo + 1)];
+                uint32_t        rest   = remA[k + 1] < remB[k + 1] ? remA[k + 1] : remB[k + 1];
+
+                if (!searchPairAlive(cfg, limit[r][c], cntC[r][c], rest)) {
+                    alive[r][c] = false;
+                    aliveNo--;
+                    buf->terminated++;
+                }
+            }
+        }
+    }
+
+    search->tiles[tile].worker = worker;
+    search->tiles[tile].begin  = buf->cnt;
+    search->tiles[tile].cnt    = 0;
+
+    if (buf->error || reserveHits(buf, aliveNo)) {
+        buf->error = 1;
+        return;
+    }
+
+    for (size_t r = 0; r < refRows; r++) {
+        for (size_t c = 0; c < cmpRows; c++) {
+            if (alive[r][c] &&
+                searchMatch(cfg, ref->weights[refBegin + r], cmp->weights[cmpBegin + c], cntC[r][c])) {
+                LargeHit *hit = &buf->hits[buf->cnt++];
+                hit->refIdx = (uint32_t)(refBegin + r);
+                hit->cmpIdx = (uint32_t)(cmpBegin + c);
+                hit->cntC   = cntC[r][c];
+                search->tiles[tile].cnt++;
+            }
+        }
+    }
+}
+
+
+/*
+ * Function: searchLarge
+ * Same hit handling as searchParallel(): every tile leaves a (ref, cmp)
+ * sorted segment in its worker's buffer, the segments of a tile row are
+ * merged ref by ref.
+ */
+int searchLarge(const BlockedStore *ref,
+                const BlockedStore *cmp,
+                const SearchConfig *cfg,
+                HitSink sink, void *ctx,
+                SearchStats *stats)
+{
+    LargeSearch  search;
+    unsigned int threadNo = cfg->threadNo ? cfg->threadNo : 1;
+    int          error = 0;
+
+    if (ref->blockNo != cmp->blockNo) {
+        fprintf(stderr, "Ref and cmp fingerprints are of different widths\n");
+        return -1;
+    }
+
+    size_t refTileNo = (ref->count + LARGE_TILE_REF - 1) / LARGE_TILE_REF;
+    size_t cmpTileNo = (cmp->count + LARGE_TILE_CMP - 1) / LARGE_TILE_CMP;
+
+    search.ref       = ref;
+    search.cmp       = cmp;
+    search.cfg       = cfg;
+    search.cmpTileNo = cmpTileNo;
+    search.buffers   = NULL;
+    search.tiles     = (LargeTileHits *)calloc(refTileNo * cmpTileNo + 1, sizeof(LargeTileHits));
+    size_t *cursors  = (size_t *)calloc(cmpTileNo + 1, sizeof(size_t));
+
+    if (!search.tiles || !cursors ||
+        posix_memalign((void **)&search.buffers, 64, threadNo * sizeof(LargeBuffer))) {
+        fprintf(stderr, "Failed to allocate search state\n");
+        free(search.tiles);
+        free(cursors);
+        return -1;
+    }
+    memset(search.buffers, 0, threadNo * sizeof(LargeBuffer));
+
+    workStealRun(refTileNo * cmpTileNo, threadNo, largeTile, &search);
+
+    uint64_t pruned     = 0;
+    uint64_t terminated = 0;
+    uint64_t hits       = 0;
+
+    for (unsigned int w = 0; w < threadNo; w++) {
+        pruned     += search.buffers[w].pruned;
+        terminated += search.buffers[w].terminated;
+        error      |= search.buffers[w].error;
+    }
+
+    /* Merge, tile row by tile row */
+    for (size_t rt = 0; rt < refTileNo; rt++) {
+        const LargeTileHits *row = &search.tiles[rt * cmpTileNo];
+        size_t refEnd = (rt + 1) * LARGE_TILE_REF < ref->count ? (rt + 1) * LARGE_TILE_REF : ref->count;
+
+        for (size_t ct = 0; ct < cmpTileNo; ct++) {
+            cursors[ct] = row[ct].begin;
+        }
+
+        for (size_t i = rt * LARGE_TILE_REF; i < refEnd; i++) {
+            for (size_t ct = 0; ct < cmpTileNo; ct++) {
+                const LargeHit *seg = search.buffers[row[ct].worker].hits;
+                size_t          end = row[ct].begin + row[ct].cnt;
+
+                for (; cursors[ct] < end && seg[cursors[ct]].refIdx == i; cursors[ct]++) {
+                    const LargeHit *hit = &seg[cursors[ct]];
+                    sink(ctx, ref->ids[hit->refIdx], cmp->ids[hit->cmpIdx],
+                         searchCoeff(cfg, ref->weights[hit->refIdx],
+                                     cmp->weights[hit->cmpIdx], hit->cntC));
+                    hits++;
+                }
+            }
+        }
+    }
+
+    for (unsigned int w = 0; w < threadNo; w++) {
+        free(search.buffers[w].hits);
+    }
+    free(search.buffers);
+    free(search.tiles);
+    free(cursors);
+
+    if (error) {
+        fprintf(stderr, "Hit buffer allocation failed, results are incomplete\n");
+    }
+
+    if (stats) {
+        stats->pairs      = (uint64_t)ref->count * cmp->count;
+        stats->pruned     = pruned;
+        stats->terminated = terminated;
+        stats->hits       = hits;
+    }
+
+    return error ? -1 : 0;
+}
+
+
+int searchLargeStores(const FingerprintStore *ref,
+                      const FingerprintStore *cmp,
+                      const SearchConfig *cfg,
+                      HitSink sink, void *ctx,
+                      SearchStats *stats)
+{
+    BlockedStore blockedRef, blockedCmp;
+
+    if (blockedStoreInit(&blockedRef, ref)) {
+        return -1;
+    }
+    if (blockedStoreInit(&blockedCmp, cmp)) {
+        blockedStoreFree(&blockedRef);
+        return -1;
+    }
+
+    int error = searchLarge(&blockedRef, &blockedCmp, cfg, sink, ctx, stats);
+
+    blockedStoreFree(&blockedRef);
+    blockedStoreFree(&blockedCmp);
+    return error;
+}
@@ -0,0 +1,70 @@
+#ifndef LARGEFP_H
+#define LARGEFP_H
+
+#include "search.h"
+
+/*
+ * Large fingerprint search
+ * For fingerprints of many thousand bits (e.g. 320 x 320 bitmaps, 102400
+ * bits) a pair touches tens of KiB and the row-wise search is bound by
+ * memory bandwidth. BlockedStore cuts every row into column blocks of
+ * LARGE_FP_BLOCK_WORDS words and stores block k of all rows together, so
+ * a tile of ref and cmp rows walks the fingerprints block by block with
+ * its working set in L1/L2, while the next block is prefetched.
+ *
+ * Partial CNT(A & B) counts are kept per pair across the blocks. With the
+ * weight of every row per block known, the remaining CNT(A & B) of a pair
+ * is at most min(remaining |A|, remaining |B|), and the pair is abandoned
+ * as soon as even that cannot make it match.
+ */
+
+#define LARGE_FP_BLOCK_WORDS    256     // 16384-bit column blocks, 2 KiB per row
+#define LARGE_FP_MIN_WIDTH      32768   // main uses searchLarge() from this width on
+#define LARGE_TILE_REF          16      // 16 ref segments: 32 KiB
+#define LARGE_TILE_CMP          64      // 64 cmp segments: 128 KiB, with the refs in L2
+
+typedef struct {
+    size_t    count;
+    uint32_t  width;
+    uint32_t  blockNo;          /* Column blocks per row */
+    uint64_t *bits;             /* blockNo x count x LARGE_FP_BLOCK_WORDS, padding bits zero */
+    uint32_t *remaining;        /* count x (blockNo + 1): weight of blocks [k, blockNo) of a row */
+    uint32_t *ids;
+    uint32_t *weights;
+} BlockedStore;
+
+/* Copy a store (weights computed) into the blocked layout, returns 0 on success */
+int  blockedStoreInit(BlockedStore *dst, const FingerprintStore *src);
+
+void blockedStoreFree(BlockedStore *store);
+
+/* Column block of a row */
+static inline const uint64_t *blockedStoreSegment(const BlockedStore *store, uint32_t block, size_t row)
+{
+    return store->bits + ((size_t)block * store->count + row) * LARGE_FP_BLOCK_WORDS;
+}
+
+/*
+ * searchParallel() for blocked stores: same hits, in the same order
+ * (ref-major). Pairs whose weights alone rule them out are counted in
+ * stats->pruned, pairs abandoned after some blocks in stats->terminated.
+ * The running bound is used in MATCH_SIMILAR mode (remaining counts) and
+ * MATCH_DISSIMILAR mode (CNT(A & B) only grows, the dissimilarity only
+ * falls), MATCH_TABLE pairs are always counted in full, the table need not
+ * be monotone. cfg->cmpBuckets, cfg->foldBits and cfg->sparse are not used.
+ * Returns 0 on success.
+ */
+int  searchLarge(const BlockedStore *ref,
+                 const BlockedStore *cmp,
+                 const SearchConfig *cfg,
+                 HitSink sink, void *ctx,
+                 SearchStats *stats);
+
+/* searchLarge() on blocked copies of two stores, freed afterwards */
+int  searchLargeStores(const FingerprintStore *ref,
+                       const FingerprintStore *cmp,
+                       const SearchConfig *cfg,
+                       HitSink sink, void *ctx,
+                       SearchStats *stats);
+
+#endif // LARGEFP_H
@@ -1,5 +1,93 @@
 #include "tanimoto.h"
+#include "search.h"
+#include "worksteal.h"
+#include "topk.h"
+#include "chunkread.h"
+#include "largefp.h"
+#include "resultfile.h"
+#include "butina.h"
 #include <stdbool.h>
+#include <errno.h>
+#include <limits.h>
+
+// Streaming mode output: raw or compact results file, optionally echoed to
+// the console
+typedef struct {
+    IDFileSink   file;
+    ResultWriter compact;
+    bool         useCompact;
+    bool         print;
+} StreamSink;
+
+static void streamSinkPush(void *ctx, uint32_t refID, uint32_t cmpID, double coeff)
+{
+    StreamSink *sink = (StreamSink *)ctx;
+
+    if (sink->useCompact) {
+        resultWriterPush(&sink->compact, refID, cmpID, coeff);
+    } else {
+        idFileSinkPush(&sink->file, refID, cmpID, coeff);
+    }
+    if (sink->print) {
+        printSink(NULL, refID, cmpID, coeff);
+    }
+}
+
+// Sort the vectors by weight for pruning. A mapped index is sorted already
+// and brings its buckets, sorting it would copy the library into memory.
+static const WeightBuckets *sortByWeight(WeightBuckets *buckets)
+{
+    if (fpStoreSortByWeight(&referenceVectors, NULL) != 0) {
+        return NULL;
+    }
+    if (comparisonIndex.start) {
+        return &comparisonIndex;
+    }
+    return fpStoreSortByWeight(&comparisonVectors, buckets) != 0 ? NULL : buckets;
+}
+
+static void printUsage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [--vectors file] [--results file] [--results-txt file] [--print] [--generate] [--stream]"
+            " [--ref-no N] [--cmp-no N] [--width BITS] [--threads N] [--threshold T] [--similar] [--hw-table] [--top-k K]"
+            " [--library file] [--save-library file] [--index file] [--save-index file]"
+            " [--chunk-rows N] [--compact] [--compact-coeff] [--fold 64|128] [--self] [--butina]\n",
+            prog);
+}
+
+// A count option: a whole number from 1 to max, nothing after it
+static bool parseCount(const char *arg, size_t max, size_t *value)
+{
+    char *end;
+    unsigned long long n;
+
+    if (*arg == '-' || *arg == '\0') {
+        return false;
+    }
+    errno = 0;
+    n = strtoull(arg, &end, 0);
+    if (errno || *end != '\0' || n == 0 || n > max) {
+        return false;
+    }
+    *value = (size_t)n;
+    return true;
+}
+
+// A threshold: a number in [0, 1), the range thresholdTableInit() takes, nothing after it
+static bool parseThreshold(const char *arg, double *value)
+{
+    char *end;
+    double t;
+
+    errno = 0;
+    t = strtod(arg, &end);
+    if (errno || end == arg || *end != '\0' || !(t >= 0.0 && t < 1.0)) {
+        return false;
+    }
+    *value = t;
+    return true;
+}
 
 int main(int argc, char *argv[])
 {
@@ -7,8 +95,28 @@ int main(int argc, char *argv[])
     char* fnameVectors = "vectors.bin";
     char* fnameResults = "results.bin";
     char* fnameResultsTxt = "results.txt";
+    char* fnameLibrary = NULL;
+    char* fnameSaveLibrary = NULL;
+    char* fnameIndex = NULL;
+    char* fnameSaveIndex = NULL;
     bool printResults = false;
     bool generate = false;
+    bool stream = false;
+    bool similar = false;
+    bool hwTable = false;
+    bool compact = false;
+    uint32_t compactFlags = 0;
+    double threshold = THRESHOLD;
+    bool thresholdSet = false;
+    size_t topK = 0;
+    size_t chunkRows = 0;
+    unsigned int foldBits = 0;
+    bool self = false;
+    bool butina = false;
+    size_t refNo = DEFAULT_REF_VECTOR_NO;
+    size_t cmpNo = DEFAULT_CMP_VECTOR_NO;
+    uint32_t width = VECTOR_WIDTH;
+    unsigned int threadNo = workStealDefaultThreads();
 
     static struct option long_opts[] = {
         // name             has_arg               flag  short-val
@@ -17,11 +125,31 @@ int main(int argc, char *argv[])
         { "results-txt",    required_argument   , NULL, 't' },
         { "print",          no_argument         , NULL, 'p' },
         { "generate",       no_argument         , NULL, 'g' },
+        { "stream",         no_argument         , NULL, 's' },
+        { "ref-no",         required_argument   , NULL, 'R' },
+        { "cmp-no",         required_argument   , NULL, 'C' },
+        { "width",          required_argument   , NULL, 'w' },
+        { "threads",        required_argument   , NULL, 'j' },
+        { "threshold",      required_argument   , NULL, 'T' },
+        { "similar",        no_argument         , NULL, 'S' },
+        { "hw-table",       no_argument         , NULL, 'H' },
+        { "top-k",          required_argument   , NULL, 'k' },
+        { "library",        required_argument   , NULL, 'L' },
+        { "save-library",   required_argument   , NULL, 'l' },
+        { "index",          required_argument   , NULL, 'I' },
+        { "save-index",     required_argument   , NULL, 'i' },
+        { "chunk-rows",     required_argument   , NULL, 'c' },
+        { "compact",        no_argument         , NULL, 'z' },
+        { "compact-coeff",  no_argument         , NULL, 'Z' },
+        { "fold",           required_argument   , NULL, 'f' },
+        { "self",           no_argument         , NULL, 'e' },
+        { "butina",         no_argument         , NULL, 'b' },
         { NULL,             0                   , NULL,  0  }
     };
 
     int opt;
-    while ((opt = getopt_long(argc, argv, "v:r:t:pg", long_opts, NULL)) != -1) {
+    size_t count;
+    while ((opt = getopt_long(argc, argv, "v:r:t:pgsR:C:w:j:T:SHk:L:l:I:i:c:zZf:eb", long_opts, NULL)) != -1) {
         switch (opt) {
             case 'v':
                 fnameVectors = optarg;
@@ -38,51 +166,379 @@ int main(int argc, char *argv[])
             case 'g':
                 generate = true;
                 break;
+            case 's':
+                stream = true;
+                break;
+            case 'R':
+                if (!parseCount(optarg, SIZE_MAX, &refNo)) {
+                    printUsage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'C':
+                if (!parseCount(optarg, SIZE_MAX, &cmpNo)) {
+                    printUsage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'w':
+                if (!parseCount(optarg, UINT32_MAX, &count)) {
+                    printUsage(argv[0]);
+                    return -1;
+                }
+                width = (uint32_t)count;
+                break;
+            case 'j':
+                if (!parseCount(optarg, UINT_MAX, &count)) {
+                    printUsage(argv[0]);
+                    return -1;
+                }
+                threadNo = (unsigned int)count;
+                break;
+            case 'T':
+                if (!parseThreshold(optarg, &threshold)) {
+                    printUsage(argv[0]);
+                    return -1;
+                }
+                thresholdSet = true;
+                break;
+            case 'S':
+                similar = true;
+                break;
+            case 'H':
+                hwTable = true;
+                break;
+            case 'k':
+                if (!parseCount(optarg, SIZE_MAX, &topK)) {
+                    printUsage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'L':
+                fnameLibrary = optarg;
+                break;
+            case 'l':
+                fnameSaveLibrary = optarg;
+                break;
+            case 'I':
+                fnameIndex = optarg;
+                break;
+            case 'i':
+                fnameSaveIndex = optarg;
+                break;
+            case 'c':
+                if (!parseCount(optarg, SIZE_MAX, &chunkRows)) {
+                    printUsage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'Z':
+                compactFlags |= RESULT_FILE_COEFF;
+                // fall through
+            case 'z':
+                compact = true;
+                break;
+            case 'f':
+                if (!parseCount(optarg, UINT_MAX, &count)) {
+                    printUsage(argv[0]);
+                    return -1;
+                }
+                foldBits = (unsigned int)count;
+                break;
+            case 'e':
+                self = true;
+                break;
+            case 'b':
+                butina = true;
+                break;
             default:
-                fprintf(stderr,
-                        "Usage: %s [--vectors file] [--results file] [--results-txt file] [--print] [--generate]\n",
-                        argv[0]);
+                printUsage(argv[0]);
                 return -1;
         }
     }
 
-    // Create random vectors
-    initVectors(generate);
+    // The accelerator and the all-pairs export only know the dissimilarity criterion
+    if ((similar || hwTable) && !stream) {
+        fprintf(stderr, "--similar and --hw-table are only supported in --stream mode.\n");
+        return -1;
+    }
+    if (chunkRows && (!stream || topK || (!fnameLibrary && !fnameIndex))) {
+        fprintf(stderr, "--chunk-rows streams the cmp vectors of a --library or --index file in --stream mode.\n");
+        return -1;
+    }
+    if (compact && (!stream || topK)) {
+        fprintf(stderr, "--compact and --compact-coeff only apply to the --stream results file.\n");
+        return -1;
+    }
+    if (foldBits && ((!similar && !butina) || topK || (foldBits != 64 && foldBits != 128))) {
+        fprintf(stderr, "--fold prefilters --similar --stream and --butina searches through 64 or 128-bit folds.\n");
+        return -1;
+    }
+    if (self && (!stream || topK || chunkRows)) {
+        fprintf(stderr, "--self joins the cmp vectors with themselves in --stream mode, not in chunks.\n");
+        return -1;
+    }
+    if (butina && (stream || topK || hwTable || chunkRows || compact)) {
+        fprintf(stderr, "--butina clusters the cmp vectors on its own, with --threshold as the similarity.\n");
+        return -1;
+    }
+    if (similar && hwTable) {
+        fprintf(stderr, "--hw-table implements the accelerator's dissimilarity criterion, not --similar.\n");
+        return -1;
+    }
 
-    // Export random vectors to binary file, to be read by the accelerator OCL kernel
-    if (writeVectorsToFile(fnameVectors) != 0) {
-        fprintf(stderr, "Error writing vectors to file.\n");
+    // Map a fingerprint library (first --ref-no rows are the ref vectors,
+    // weights included), or create random vectors
+    if (fnameLibrary) {
+        if (mapVectors(fnameLibrary, refNo) != 0) {
+            return 1;
+        }
+        width = referenceVectors.width;
+    } else if (initVectors(refNo, cmpNo, width, generate) != 0) {
+        return 1;
+    }
+
+    // Query an indexed library: it replaces the cmp vectors. Only --similar
+    // and --top-k use its weight index, everything else scans all of it.
+    if (fnameIndex && mapComparisonIndex(fnameIndex) != 0) {
+        freeVectors();
         return 1;
     }
+    cmpNo = comparisonVectors.count;
 
-    // Calculate C = A & B vectors
-    createIntermediaryVectors();
+    // Export random vectors to binary file, to be read by the accelerator OCL
+    // kernel. Not for an index or chunks, packing would read the whole library.
+    if (!fnameIndex && !chunkRows && writeVectorsToFile(fnameVectors) != 0) {
+        fprintf(stderr, "Error writing vectors to file.\n");
+        freeVectors();
+        return 1;
+    }
 
     // Calculate CNT(1) for each vector
-    for (int i = 0; i < REF_VECTOR_NO; i++) {
-        calculateBinaryWeight(&referenceVectors[i]);
+    calculateBinaryWeights();
+
+    if ((fnameSaveLibrary && writeVectorsToLibrary(fnameSaveLibrary) != 0) ||
+        (fnameSaveIndex && writeComparisonIndex(fnameSaveIndex) != 0)) {
+        fprintf(stderr, "Error writing vectors to library.\n");
+        freeVectors();
+        return 1;
     }
-    for (int i = 0; i < CMP_VECTOR_NO; i++) {
-        calculateBinaryWeight(&comparisonVectors[i]);
+
+    // Top-k mode: ranked lists of the k most similar cmp vectors of every
+    // ref, with --threshold as the minimum similarity (none by default).
+    // Vectors are sorted by weight for pruning, as in similarity mode.
+    if (topK > 0) {
+        WeightBuckets buckets = { 0, NULL };
+        TopKResults results;
+        SearchStats stats;
+        SearchConfig cfg = { thresholdSet ? threshold : 0.0, MATCH_SIMILAR, threadNo, NULL, NULL, 0, SPARSE_AUTO };
+
+        cfg.cmpBuckets = sortByWeight(&buckets);
+        if (!cfg.cmpBuckets) {
+            freeVectors();
+            return 1;
+        }
+
+        int searchError = searchTopK(&referenceVectors, &comparisonVectors, &cfg, topK, &results, &stats);
+
+        weightBucketsFree(&buckets);
+        freeVectors();
+        if (searchError) {
+            return 1;
+        }
+
+        if (printResults) {
+            printTopK(&results);
+        }
+
+        int writeError = writeTopKToTxtFile(&results, fnameResultsTxt) |
+                         writeTopKIDsToFile(&results, fnameResults);
+        topKResultsFree(&results);
+
+        if (writeError) {
+            fprintf(stderr, "Error writing results to file.\n");
+            return 1;
+        }
+
+        printf("Compared %llu pairs, %llu pruned by weight, %llu neighbours found.\n",
+               (unsigned long long)stats.pairs, (unsigned long long)stats.pruned,
+               (unsigned long long)stats.hits);
+        return 0;
     }
-    for (int i = 0; i < REF_VECTOR_NO * CMP_VECTOR_NO; i++) {
-        calculateBinaryWeight(&intermediaryVectors[i]);
+
+    // Butina mode: cluster the cmp vectors, two vectors are neighbours if
+    // their similarity is at least --threshold. The neighbour graph comes
+    // from the self-join, sorted by weight as in similarity mode. Writes the
+    // cluster of every vector to the TXT results file.
+    if (butina) {
+        WeightBuckets buckets = { 0, NULL };
+        NeighbourGraph graph;
+        ButinaClusters clusters;
+        SearchStats stats;
+        SearchConfig cfg = { threshold, MATCH_SIMILAR, threadNo, NULL, NULL, foldBits, SPARSE_AUTO };
+
+        cfg.cmpBuckets = sortByWeight(&buckets);
+        if (!cfg.cmpBuckets) {
+            freeVectors();
+            return 1;
+        }
+
+        int clusterError = neighbourGraphBuild(&graph, &comparisonVectors, &cfg, &stats);
+        weightBucketsFree(&buckets);
+        if (!clusterError) {
+            clusterError = butinaCluster(&clusters, &graph);
+            neighbourGraphFree(&graph);
+        }
+        if (clusterError) {
+            freeVectors();
+            return 1;
+        }
+
+        int writeError = writeButinaToTxtFile(&clusters, &comparisonVectors, fnameResultsTxt);
+        freeVectors();
+        if (writeError) {
+            butinaClustersFree(&clusters);
+            fprintf(stderr, "Error writing results to file.\n");
+            return 1;
+        }
+
+        uint32_t largest = 0;
+        size_t singletons = 0;
+        for (size_t c = 0; c < clusters.clusterNo; c++) {
+            largest = clusters.sizes[c] > largest ? clusters.sizes[c] : largest;
+            singletons += clusters.sizes[c] == 1;
+        }
+
+        printf("Compared %llu pairs, %llu pruned by weight%s, %llu neighbour pairs at or above the threshold.\n",
+               (unsigned long long)stats.pairs, (unsigned long long)stats.pruned,
+               foldBits ? " or fold" : "", (unsigned long long)stats.hits);
+        printf("%zu clusters, largest %u, %zu singletons.\n", clusters.clusterNo, largest, singletons);
+        butinaClustersFree(&clusters);
+        return 0;
+    }
+
+    // Streaming mode: threshold every pair as it is computed and only write
+    // the passing ID pairs, no intermediary vectors, no per-pair results.
+    // The all-pairs TXT export is skipped, as it is O(ref x cmp) by nature.
+    // In similarity mode the vectors are sorted by weight, so that every ref
+    // can skip the cmp weights that cannot reach the threshold. In hardware
+    // table mode pairs are thresholded by the accelerator's integer table.
+    // With --chunk-rows the cmp vectors are read from the file chunk by
+    // chunk while the previous chunk is searched, instead of being mapped.
+    // Large fingerprints are searched column block by column block, with a
+    // running bound per pair instead of sorting and weight buckets. Sparse
+    // ones (sparse.h) are counted from set bit positions, at any width.
+    // --compact writes the hits grouped by ref, delta coded (resultfile.h).
+    // --fold rejects most pairs of a similarity search from OR-folded rows.
+    // --self joins the cmp vectors with themselves, every pair once.
+    if (stream) {
+        bool sparse = !chunkRows && sparseRowsPreferred(&comparisonVectors);
+        bool large = width >= LARGE_FP_MIN_WIDTH && !chunkRows && !self && !sparse;
+        static StreamSink sink;
+        SearchStats stats;
+        WeightBuckets buckets = { 0, NULL };
+        ThresholdTable table = { 0, 0, 0.0f, 0, NULL };
+        SearchConfig cfg = { threshold, similar ? MATCH_SIMILAR : MATCH_DISSIMILAR, threadNo, NULL, NULL, foldBits, SPARSE_AUTO };
+
+        if (hwTable) {
+            if (thresholdTableInit(&table, width, (float)threshold) != 0) {
+                freeVectors();
+                return 1;
+            }
+            if (table.wrapFrom <= width) {
+                fprintf(stderr, "Warning: threshold table entries wrap from CNT(A & B) = %u on, "
+                        "as in the accelerator's %u-bit RAM.\n", table.wrapFrom, table.ramBits);
+            }
+            cfg.mode  = MATCH_TABLE;
+            cfg.table = &table;
+        }
+
+        if (similar && chunkRows) {
+            if (fpStoreSortByWeight(&referenceVectors, NULL) != 0) {
+                freeVectors();
+                return 1;
+            }
+        } else if (similar && !large) {
+            cfg.cmpBuckets = sortByWeight(&buckets);
+            if (!cfg.cmpBuckets) {
+                thresholdTableFree(&table);
+                freeVectors();
+                return 1;
+            }
+        }
+
+        sink.print      = printResults;
+        sink.useCompact = compact;
+        if ((compact ? resultWriterOpen(&sink.compact, fnameResults, compactFlags)
+                     : idFileSinkOpen(&sink.file, fnameResults)) != 0) {
+            thresholdTableFree(&table);
+            weightBucketsFree(&buckets);
+            freeVectors();
+            return 1;
+        }
+
+        int searchError;
+        if (chunkRows) {
+            ChunkReader reader;
+
+            searchError = fnameIndex ? chunkReaderOpen(&reader, fnameIndex, 0, FP_STORE_ALL, chunkRows)
+                                     : chunkReaderOpen(&reader, fnameLibrary, refNo, FP_STORE_ALL, chunkRows);
+            if (!searchError) {
+                searchError = searchChunks(&referenceVectors, &reader, &cfg, streamSinkPush, &sink, &stats);
+                chunkReaderClose(&reader);
+            }
+        } else if (self) {
+            searchError = searchSelf(&comparisonVectors, &cfg, streamSinkPush, &sink, &stats);
+        } else if (large) {
+            searchError = searchLargeStores(&referenceVectors, &comparisonVectors,
+                                            &cfg, streamSinkPush, &sink, &stats);
+        } else {
+            searchError = searchParallel(&referenceVectors, &comparisonVectors,
+                                         &cfg, streamSinkPush, &sink, &stats);
+        }
+
+        thresholdTableFree(&table);
+        weightBucketsFree(&buckets);
+        freeVectors();
+
+        int writeError = compact ? resultWriterClose(&sink.compact) : idFileSinkClose(&sink.file);
+        if (writeError || searchError) {
+            fprintf(stderr, "Error writing results to file.\n");
+            return 1;
+        }
+
+        printf("Compared %llu pairs, %llu pruned by weight%s, %llu %s the threshold.\n",
+               (unsigned long long)stats.pairs, (unsigned long long)stats.pruned,
+               foldBits ? " or fold" : "", (unsigned long long)stats.hits, similar ? "at or above" : "over");
+        if (sparse) {
+            printf("Counted from sparse cmp rows (%s).\n", sparseKernelName());
+        }
+        if (stats.terminated) {
+            printf("%llu pairs abandoned early by the running bound.\n",
+                   (unsigned long long)stats.terminated);
+        }
+        return 0;
     }
 
     // Calculate all Tanimoto similarity coefficients for each ref-cmp pair,
-    // save results in the tanimotoResults[] array
-    computeAllTanimotoSimilarities();
+    // save results in the tanimotoResults[] array. CNT(A & B) is counted by
+    // the fused kernel, intermediary vectors are never created.
+    if (computeAllTanimotoSimilarities() != 0) {
+        freeVectors();
+        return 1;
+    }
 
     // Take a look at some of the results locally
     if (printResults) {
-        for(int i = 0; i < REF_VECTOR_NO * CMP_VECTOR_NO; i++) {
-            printResult(tanimotoResults[i], THRESHOLD);
+        for(size_t i = 0; i < refNo * cmpNo; i++) {
+            printResult(tanimotoResults[i], threshold);
         }
     }
 
     printAllResultsToTxtFile(fnameResultsTxt);
 
-    writeIDsToFile(fnameResults, THRESHOLD);
+    writeIDsToFile(fnameResults, threshold);
 
+    freeVectors();
     return 0;
 }
\ No newline at end of file
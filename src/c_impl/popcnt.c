@@ -0,0 +1,473 @@
+#include "popcnt.h"
+#include <string.h>
+#include <stdbool.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define POPCNT_X86
+#endif
+
+/*
+ * All kernels share one body for popcnt() and popcntAnd(). The useB flag is a
+ * compile time constant at every call site, so the compiler emits two
+ * specialized loops without a branch in the inner loop.
+ */
+
+/* ------------------------------------------------------------------------
+ * Scalar kernel
+ */
+
+static inline __attribute__((always_inline))
+uint32_t scalarCount(const uint8_t *a, const uint8_t *b, size_t nbytes, bool useB)
+{
+    uint32_t cnt = 0;
+    size_t   i   = 0;
+
+    for (; i + sizeof(uint64_t) <= nbytes; i += sizeof(uint64_t)) {
+        uint64_t x, y;
+        memcpy(&x, a + i, sizeof(x));
+        if (useB) {
+            memcpy(&y, b + i, sizeof(y));
+            x &= y;
+        }
+        cnt += __builtin_popcountll(x);
+    }
+
+    for (; i < nbytes; i++) {
+        cnt += __builtin_popcount(useB ? (a[i] & b[i]) : a[i]);
+    }
+
+    return cnt;
+}
+
+static uint32_t popcntScalar(const uint8_t *a, size_t nbytes)
+{
+    return scalarCount(a, NULL, nbytes, false);
+}
+
+static uint32_t popcntAndScalar(const uint8_t *a, const uint8_t *b, size_t nbytes)
+{
+    return scalarCount(a, b, nbytes, true);
+}
+
+/*
+ * Block kernel on 64-bit words. The R x C accumulators and the R + C words
+ * of one column live in registers, every word is loaded once per block.
+ */
+static inline __attribute__((always_inline))
+void scalarBlock(const uint64_t *a, const uint64_t *b, size_t stride, size_t words, uint32_t *cnt)
+{
+    uint64_t acc[POPCNT_BLOCK_REF][POPCNT_BLOCK_CMP] = {{0}};
+
+    for (size_t k = 0; k < words; k++) {
+        uint64_t wa[POPCNT_BLOCK_REF];
+        uint64_t wb[POPCNT_BLOCK_CMP];
+
+        for (int r = 0; r < POPCNT_BLOCK_REF; r++) wa[r] = a[r * stride + k];
+        for (int c = 0; c < POPCNT_BLOCK_CMP; c++) wb[c] = b[c * stride + k];
+
+        for (int r = 0; r < POPCNT_BLOCK_REF; r++) {
+            for (int c = 0; c < POPCNT_BLOCK_CMP; c++) {
+                acc[r][c] += (uint64_t)__builtin_popcountll(wa[r] & wb[c]);
+            }
+        }
+    }
+
+    for (int r = 0; r < POPCNT_BLOCK_REF; r++) {
+        for (int c = 0; c < POPCNT_BLOCK_CMP; c++) {
+            cnt[r * POPCNT_BLOCK_CMP + c] = (uint32_t)acc[r][c];
+        }
+    }
+}
+
+static void popcntAndBlockScalar(const uint64_t *a, const uint64_t *b, size_t stride, uint32_t *cnt)
+{
+    scalarBlock(a, b, stride, stride, cnt);
+}
+
+static void popcntAndBlockWordsScalar(const uint64_t *a, const uint64_t *b, size_t stride,
+                                      size_t words, uint32_t *cnt)
+{
+    scalarBlock(a, b, stride, words, cnt);
+}
+
+#ifdef POPCNT_X86
+
+/* Same loop with the POPCNT instruction, used on AVX2 machines */
+static __attribute__((target("popcnt")))
+void popcntAndBlockPopcnt(const uint64_t *a, const uint64_t *b, size_t stride, uint32_t *cnt)
+{
+    scalarBlock(a, b, stride, stride, cnt);
+}
+
+static __attribute__((target("popcnt")))
+void popcntAndBlockWordsPopcnt(const uint64_t *a, const uint64_t *b, size_t stride,
+                               size_t words, uint32_t *cnt)
+{
+    scalarBlock(a, b, stride, words, cnt);
+}
+
+/* ------------------------------------------------------------------------
+ * AVX2 kernel
+ * Nibble LUT popcount of 32 byte blocks (vpshufb + vpsadbw), with
+ * Harley-Seal carry-save adders in front of it for inputs of at least
+ * 16 blocks, so that the LUT is only evaluated once per 16 blocks.
+ */
+
+#define AVX2_TARGET __attribute__((target("avx2,popcnt")))
+
+static inline AVX2_TARGET __attribute__((always_inline))
+__m256i avx2Load(const uint8_t *a, const uint8_t *b, size_t off, bool useB)
+{
+    __m256i v = _mm256_loadu_si256((const __m256i *)(a + off));
+    if (useB) {
+        v = _mm256_and_si256(v, _mm256_loadu_si256((const __m256i *)(b + off)));
+    }
+    return v;
+}
+
+/* Per 64-bit lane bit counts of v */
+static inline AVX2_TARGET __attribute__((always_inline))
+__m256i avx2Popcnt256(__m256i v)
+{
+    const __m256i lookup = _mm256_setr_epi8(
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i lowMask = _mm256_set1_epi8(0x0f);
+
+    __m256i lo  = _mm256_and_si256(v, lowMask);
+    __m256i hi  = _mm256_and_si256(_mm256_srli_epi16(v, 4), lowMask);
+    __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo),
+                                  _mm256_shuffle_epi8(lookup, hi));
+
+    return _mm256_sad_epu8(cnt, _mm256_setzero_si256());
+}
+
+/* Carry-save adder: h:l = a + b + c */
+static inline AVX2_TARGET __attribute__((always_inline))
+void avx2Csa(__m256i *h, __m256i *l, __m256i a, __m256i b, __m256i c)
+{
+    __m256i u = _mm256_xor_si256(a, b);
+    *h = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(u, c));
+    *l = _mm256_xor_si256(u, c);
+}
+
+static inline AVX2_TARGET __attribute__((always_inline))
+uint32_t avx2Count(const uint8_t *a, const uint8_t *b, size_t nbytes, bool useB)
+{
+    const size_t blockNo = nbytes / 32;
+    size_t  i     = 0;
+    __m256i total = _mm256_setzero_si256();
+
+    if (blockNo >= 16) {
+        __m256i ones   = _mm256_setzero_si256();
+        __m256i twos   = _mm256_setzero_si256();
+        __m256i fours  = _mm256_setzero_si256();
+        __m256i eights = _mm256_setzero_si256();
+        __m256i sixteens, twosA, twosB, foursA, foursB, eightsA, eightsB;
+
+        for (; i + 16 <= blockNo; i += 16) {
+#define HS_LD(k) avx2Load(a, b, (i + (k)) * 32, useB)
+            avx2Csa(&twosA,   &ones,   ones,   HS_LD(0),  HS_LD(1));
+            avx2Csa(&twosB,   &ones,   ones,   HS_LD(2),  HS_LD(3));
+            avx2Csa(&foursA,  &twos,   twos,   twosA,     twosB);
+            avx2Csa(&twosA,   &ones,   ones,   HS_LD(4),  HS_LD(5));
+            avx2Csa(&twosB,   &ones,   ones,   HS_LD(6),  HS_LD(7));
+            avx2Csa(&foursB,  &twos,   twos,   twosA,     twosB);
+            avx2Csa(&eightsA, &fours,  fours,  foursA,    foursB);
+            avx2Csa(&twosA,   &ones,   ones,   HS_LD(8),  HS_LD(9));
+            avx2Csa(&twosB,   &ones,   ones,   HS_LD(10), HS_LD(11));
+            avx2Csa(&foursA,  &twos,   twos,   twosA,     twosB);
+            avx2Csa(&twosA,   &ones,   ones,   HS_LD(12), HS_LD(13));
+            avx2Csa(&twosB,   &ones,   ones,   HS_LD(14), HS_LD(15));
+            avx2Csa(&foursB,  &twos,   twos,   twosA,     twosB);
+            avx2Csa(&eightsB, &fours,  fours,  foursA,    foursB);
+            avx2Csa(&sixteens, &eights, eights, eightsA,  eightsB);
+#undef HS_LD
+            total = _mm256_add_epi64(total, avx2Popcnt256(sixteens));
+        }
+
+        total = _mm256_slli_epi64(total, 4);
+        total = _mm256_add_epi64(total, _mm256_slli_epi64(avx2Popcnt256(eights), 3));
+        total = _mm256_add_epi64(total, _mm256_slli_epi64(avx2Popcnt256(fours), 2));
+        total = _mm256_add_epi64(total, _mm256_slli_epi64(avx2Popcnt256(twos), 1));
+        total = _mm256_add_epi64(total, avx2Popcnt256(ones));
+    }
+
+    for (; i < blockNo; i++) {
+        total = _mm256_add_epi64(total, avx2Popcnt256(avx2Load(a, b, i * 32, useB)));
+    }
+
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, total);
+    uint32_t cnt = (uint32_t)(lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+
+    /* Remaining < 32 bytes: 64-bit words, then single bytes */
+    size_t off = blockNo * 32;
+    for (; off + sizeof(uint64_t) <= nbytes; off += sizeof(uint64_t)) {
+        uint64_t x, y;
+        memcpy(&x, a + off, sizeof(x));
+        if (useB) {
+            memcpy(&y, b + off, sizeof(y));
+            x &= y;
+        }
+        cnt += (uint32_t)_mm_popcnt_u64(x);
+    }
+    for (; off < nbytes; off++) {
+        cnt += (uint32_t)_mm_popcnt_u32(useB ? (a[off] & b[off]) : a[off]);
+    }
+
+    return cnt;
+}
+
+static AVX2_TARGET uint32_t popcntAvx2(const uint8_t *a, size_t nbytes)
+{
+    return avx2Count(a, NULL, nbytes, false);
+}
+
+static AVX2_TARGET uint32_t popcntAndAvx2(const uint8_t *a, const uint8_t *b, size_t nbytes)
+{
+    return avx2Count(a, b, nbytes, true);
+}
+
+/* ------------------------------------------------------------------------
+ * AVX-512 kernel
+ * VPOPCNTQ on 64 byte blocks, the tail is loaded with a byte mask, so no
+ * scalar epilogue is needed and no byte past the end of a is read.
+ */
+
+#define AVX512_TARGET __attribute__((target("avx512f,avx512bw,avx512vpopcntdq")))
+
+static inline AVX512_TARGET __attribute__((always_inline))
+uint32_t avx512Count(const uint8_t *a, const uint8_t *b, size_t nbytes, bool useB)
+{
+    __m512i acc = _mm512_setzero_si512();
+    size_t  i   = 0;
+
+    for (; i + 64 <= nbytes; i += 64) {
+        __m512i v = _mm512_loadu_si512((const void *)(a + i));
+        if (useB) {
+            v = _mm512_and_si512(v, _mm512_loadu_si512((const void *)(b + i)));
+        }
+        acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(v));
+    }
+
+    if (i < nbytes) {
+        __mmask64 mask = (1ULL << (nbytes - i)) - 1;
+        __m512i v = _mm512_maskz_loadu_epi8(mask, (const void *)(a + i));
+        if (useB) {
+            v = _mm512_and_si512(v, _mm512_maskz_loadu_epi8(mask, (const void *)(b + i)));
+        }
+        acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(v));
+    }
+
+    return (uint32_t)_mm512_reduce_add_epi64(acc);
+}
+
+static AVX512_TARGET uint32_t popcntAvx512(const uint8_t *a, size_t nbytes)
+{
+    return avx512Count(a, NULL, nbytes, false);
+}
+
+static AVX512_TARGET uint32_t popcntAndAvx512(const uint8_t *a, const uint8_t *b, size_t nbytes)
+{
+    return avx512Count(a, b, nbytes, true);
+}
+
+/*
+ * 4 x 4 block on 512-bit columns: 16 accumulators + 8 operands out of the
+ * 32 zmm registers. Rows are 64 byte aligned and padded, no tail handling.
+ */
+static inline AVX512_TARGET __attribute__((always_inline))
+void avx512Block(const uint64_t *a, const uint64_t *b, size_t stride, size_t words, uint32_t *cnt)
+{
+    __m512i acc[POPCNT_BLOCK_REF][POPCNT_BLOCK_CMP];
+
+    for (int r = 0; r < POPCNT_BLOCK_REF; r++) {
+        for (int c = 0; c < POPCNT_BLOCK_CMP; c++) {
+            acc[r][c] = _mm512_setzero_si512();
+        }
+    }
+
+    for (size_t k = 0; k < words; k += 8) {
+        __m512i va[POPCNT_BLOCK_REF];
+        __m512i vb[POPCNT_BLOCK_CMP];
+
+        for (int r = 0; r < POPCNT_BLOCK_REF; r++) va[r] = _mm512_load_si512((const void *)(a + r * stride + k));
+        for (int c = 0; c < POPCNT_BLOCK_CMP; c++) vb[c] = _mm512_load_si512((const void *)(b + c * stride + k));
+
+        for (int r = 0; r < POPCNT_BLOCK_REF; r++) {
+            for (int c = 0; c < POPCNT_BLOCK_CMP; c++) {
+                acc[r][c] = _mm512_add_epi64(acc[r][c],
+                                             _mm512_popcnt_epi64(_mm512_and_si512(va[r], vb[c])));
+            }
+        }
+    }
+
+    for (int r = 0; r < POPCNT_BLOCK_REF; r++) {
+        for (int c = 0; c < POPCNT_BLOCK_CMP; c++) {
+            cnt[r * POPCNT_BLOCK_CMP + c] = (uint32_t)_mm512_reduce_add_epi64(acc[r][c]);
+        }
+    }
+}
+
+static AVX512_TARGET
+void popcntAndBlockAvx512(const uint64_t *a, const uint64_t *b, size_t stride, uint32_t *cnt)
+{
+    avx512Block(a, b, stride, stride, cnt);
+}
+
+static AVX512_TARGET
+void popcntAndBlockWordsAvx512(const uint64_t *a, const uint64_t *b, size_t stride,
+                               size_t words, uint32_t *cnt)
+{
+    avx512Block(a, b, stride, words, cnt);
+}
+
+#endif // POPCNT_X86
+
+/* ------------------------------------------------------------------------
+ * Width specialized block kernels
+ * One instance of every block kernel per POPCNT_WIDTHS entry. The word count
+ * is a compile time constant, so the column loop is fully unrolled. The
+ * scalar kernels stop at the last data word, the AVX-512 ones at the last
+ * 512-bit column, padding words are zero and never need a tail mask.
+ */
+#define WIDTH_WORDS(bits)   (((bits) + 63) / 64)
+
+#define DEFINE_SCALAR_BLOCK(bits)                                                           \
+static void popcntAndBlockScalar##bits(const uint64_t *a, const uint64_t *b,               \
+                                       size_t stride, uint32_t *cnt)                        \
+{                                                                                           \
+    scalarBlock(a, b, stride, WIDTH_WORDS(bits), cnt);                                      \
+}
+POPCNT_WIDTHS(DEFINE_SCALAR_BLOCK)
+#undef DEFINE_SCALAR_BLOCK
+
+#ifdef POPCNT_X86
+
+#define DEFINE_X86_BLOCKS(bits)                                                             \
+static __attribute__((target("popcnt")))                                                    \
+void popcntAndBlockPopcnt##bits(const uint64_t *a, const uint64_t *b,                       \
+                                size_t stride, uint32_t *cnt)                               \
+{                                                                                           \
+    scalarBlock(a, b, stride, WIDTH_WORDS(bits), cnt);                                      \
+}                                                                                           \
+static AVX512_TARGET                                                                        \
+void popcntAndBlockAvx512##bits(const uint64_t *a, const uint64_t *b,                       \
+                                size_t stride, uint32_t *cnt)                               \
+{                                                                                           \
+    avx512Block(a, b, stride, WIDTH_WORDS(bits), cnt);                                      \
+}
+POPCNT_WIDTHS(DEFINE_X86_BLOCKS)
+#undef DEFINE_X86_BLOCKS
+
+#define WIDTH_KERNELS(bits) \
+    { bits, { popcntAndBlockScalar##bits, popcntAndBlockPopcnt##bits, popcntAndBlockAvx512##bits } },
+#else
+#define WIDTH_KERNELS(bits) \
+    { bits, { popcntAndBlockScalar##bits, popcntAndBlockScalar##bits, popcntAndBlockScalar##bits } },
+#endif
+
+typedef struct {
+    uint32_t         width;
+    PopcntAndBlockFn kernel[3];     /* Indexed by PopcntKernel */
+} WidthKernels;
+
+static const WidthKernels widthKernels[] = { POPCNT_WIDTHS(WIDTH_KERNELS) };
+#undef WIDTH_KERNELS
+
+/* ------------------------------------------------------------------------
+ * Runtime dispatch
+ */
+
+typedef uint32_t (*PopcntFn)(const uint8_t *a, size_t nbytes);
+typedef uint32_t (*PopcntAndFn)(const uint8_t *a, const uint8_t *b, size_t nbytes);
+typedef void     (*PopcntAndBlockWordsFn)(const uint64_t *a, const uint64_t *b, size_t stride,
+                                          size_t words, uint32_t *cnt);
+
+static PopcntKernel     selectedKernel     = POPCNT_KERNEL_SCALAR;
+static PopcntFn         popcntImpl         = popcntScalar;
+static PopcntAndFn      popcntAndImpl      = popcntAndScalar;
+static PopcntAndBlockFn popcntAndBlockImpl = popcntAndBlockScalar;
+static PopcntAndBlockWordsFn popcntAndBlockWordsImpl = popcntAndBlockWordsScalar;
+
+/*
+ * Function: selectPopcntKernel
+ * Runs before main(), picks the widest kernel the CPU supports. The function
+ * pointers are never written afterwards, so worker threads may call the
+ * kernels without synchronization.
+ */
+__attribute__((constructor))
+static void selectPopcntKernel(void)
+{
+#ifdef POPCNT_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx512vpopcntdq") &&
+        __builtin_cpu_supports("avx512bw")) {
+        selectedKernel = POPCNT_KERNEL_AVX512;
+        popcntImpl     = popcntAvx512;
+        popcntAndImpl  = popcntAndAvx512;
+        popcntAndBlockImpl = popcntAndBlockAvx512;
+        popcntAndBlockWordsImpl = popcntAndBlockWordsAvx512;
+    } else if (__builtin_cpu_supports("avx2") &&
+               __builtin_cpu_supports("popcnt")) {
+        selectedKernel = POPCNT_KERNEL_AVX2;
+        popcntImpl     = popcntAvx2;
+        popcntAndImpl  = popcntAndAvx2;
+        popcntAndBlockImpl = popcntAndBlockPopcnt;
+        popcntAndBlockWordsImpl = popcntAndBlockWordsPopcnt;
+    }
+#endif
+}
+
+uint32_t popcnt(const uint8_t *a, size_t nbytes)
+{
+    return popcntImpl(a, nbytes);
+}
+
+uint32_t popcntAnd(const uint8_t *a, const uint8_t *b, size_t nbytes)
+{
+    return popcntAndImpl(a, b, nbytes);
+}
+
+void popcntAndBlock(const uint64_t *a, const uint64_t *b, size_t stride, uint32_t *cnt)
+{
+    popcntAndBlockImpl(a, b, stride, cnt);
+}
+
+void popcntAndBlockWords(const uint64_t *a, const uint64_t *b, size_t stride, size_t words, uint32_t *cnt)
+{
+    popcntAndBlockWordsImpl(a, b, stride, words, cnt);
+}
+
+/*
+ * Function: popcntAndBlockForWidth
+ * Looks up the instance of the selected kernel for width, falls back to the
+ * generic (stride driven) kernel for other widths.
+ */
+PopcntAndBlockFn popcntAndBlockForWidth(uint32_t width)
+{
+    for (size_t i = 0; i < sizeof(widthKernels) / sizeof(widthKernels[0]); i++) {
+        if (widthKernels[i].width == width) {
+            return widthKernels[i].kernel[selectedKernel];
+        }
+    }
+
+    return popcntAndBlockImpl;
+}
+
+PopcntKernel popcntKernel(void)
+{
+    return selectedKernel;
+}
+
+const char *popcntKernelName(PopcntKernel kernel)
+{
+    switch (kernel) {
+        case POPCNT_KERNEL_AVX2:    return "avx2";
+        case POPCNT_KERNEL_AVX512:  return "avx512-vpopcntdq";
+        default:                    return "scalar";
+    }
+}
@@ -0,0 +1,74 @@
+#ifndef POPCNT_H
+#define POPCNT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Population count kernels. Every kernel returns the same result, the
+ * fastest one supported by the CPU is selected at startup through CPUID.
+ *
+ * POPCNT_KERNEL_SCALAR     - 64-bit words, __builtin_popcountll
+ * POPCNT_KERNEL_AVX2       - Harley-Seal carry-save adders + nibble LUT (vpshufb)
+ * POPCNT_KERNEL_AVX512     - AVX-512 VPOPCNTDQ, masked loads for the tail
+ */
+typedef enum {
+    POPCNT_KERNEL_SCALAR = 0,
+    POPCNT_KERNEL_AVX2,
+    POPCNT_KERNEL_AVX512
+} PopcntKernel;
+
+/* Number of set bits in the first nbytes bytes of a */
+uint32_t popcnt(const uint8_t *a, size_t nbytes);
+
+/* Number of set bits in a & b, without writing out the AND vector */
+uint32_t popcntAnd(const uint8_t *a, const uint8_t *b, size_t nbytes);
+
+/*
+ * Register-blocked intersection counts ("popcount GEMM" micro-kernel):
+ * cnt[r * POPCNT_BLOCK_CMP + c] = CNT(a_r & b_c) for the POPCNT_BLOCK_REF
+ * rows starting at a and the POPCNT_BLOCK_CMP rows starting at b. Rows are
+ * stride 64-bit words apart, stride is a multiple of 8 and rows are 64 byte
+ * aligned (FingerprintStore layout). Every loaded word is reused for
+ * POPCNT_BLOCK_REF or POPCNT_BLOCK_CMP pairs.
+ */
+#define POPCNT_BLOCK_REF    4
+#define POPCNT_BLOCK_CMP    4
+
+void popcntAndBlock(const uint64_t *a, const uint64_t *b, size_t stride, uint32_t *cnt);
+
+typedef void (*PopcntAndBlockFn)(const uint64_t *a, const uint64_t *b, size_t stride, uint32_t *cnt);
+
+/*
+ * popcntAndBlock() over the first words words of the rows only, words is a
+ * multiple of 8. Counts a block column segment by column segment, e.g. to
+ * check a bound in between.
+ */
+void popcntAndBlockWords(const uint64_t *a, const uint64_t *b, size_t stride, size_t words, uint32_t *cnt);
+
+/*
+ * Fingerprint widths with their own popcntAndBlock() instances: 166-bit
+ * MACCS, 881-bit PubChem, the 920-bit accelerator width and 1024/2048-bit
+ * ECFP. The word count of an instance is a compile time constant, so its
+ * loops are fully unrolled.
+ */
+#define POPCNT_WIDTHS(X)    X(166) X(881) X(920) X(1024) X(2048)
+
+/* Block kernel for fingerprints of width bits, popcntAndBlock() semantics */
+PopcntAndBlockFn popcntAndBlockForWidth(uint32_t width);
+
+/* Kernel currently used by popcnt() and popcntAnd() */
+PopcntKernel popcntKernel(void);
+
+/* Human readable kernel name, for logs */
+const char *popcntKernelName(PopcntKernel kernel);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // POPCNT_H
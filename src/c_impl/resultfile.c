@@ -0,0 +1,354 @@
+#include "resultfile.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define VARINT_MAX_BYTES    5       // 32-bit values
+
+
+/*
+ * Function: zigzag
+ * Signed delta b - a (mod 2^32) as an unsigned value, small in magnitude
+ * means small.
+ */
+static inline uint32_t zigzag(uint32_t a, uint32_t b)
+{
+    int32_t d = (int32_t)(b - a);
+    return ((uint32_t)d << 1) ^ (uint32_t)(d >> 31);
+}
+
+static inline uint32_t unzigzag(uint32_t a, uint32_t z)
+{
+    return a + ((z >> 1) ^ (0u - (z & 1)));
+}
+
+
+static inline size_t putVarint(uint8_t *dst, uint64_t v)
+{
+    size_t n = 0;
+
+    while (v >= 0x80) {
+        dst[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    dst[n++] = (uint8_t)v;
+
+    return n;
+}
+
+
+/*
+ * Function: getVarint
+ * Decode a varint of at most maxBytes bytes from [*pos, end), returns -1 if
+ * it runs past end or is too long.
+ */
+static inline int getVarint(const uint8_t **pos, const uint8_t *end, unsigned int maxBytes, uint64_t *v)
+{
+    const uint8_t *p     = *pos;
+    uint64_t       value = 0;
+
+    for (unsigned int n = 0; n < maxBytes && p < end; n++) {
+        uint8_t byte = *p++;
+
+        value |= (uint64_t)(byte & 0x7f) << (7 * n);
+        if (!(byte & 0x80)) {
+            *pos = p;
+            *v   = value;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+
+/*
+ * Function: writerEmit
+ * Append n bytes to the output buffer, writing it out whenever it is full.
+ */
+static void writerEmit(ResultWriter *writer, const uint8_t *data, size_t n)
+{
+    while (n > 0 && !writer->error) {
+        size_t room = RESULT_WRITER_BUFFER - writer->len;
+        size_t take = n < room ? n : room;
+
+        memcpy(writer->buf + writer->len, data, take);
+        writer->len += take;
+        data        += take;
+        n           -= take;
+
+        if (writer->len == RESULT_WRITER_BUFFER) {
+            if (fwrite(writer->buf, 1, writer->len, writer->fp) != writer->len) {
+                perror("Failed to write results");
+                writer->error = 1;
+            }
+            writer->len = 0;
+        }
+    }
+}
+
+
+/*
+ * Function: finishGroup
+ * The hit count heads the group, so a group is encoded aside and only
+ * emitted once the next reference (or the end) shows up.
+ */
+static void finishGroup(ResultWriter *writer)
+{
+    uint8_t head[2 * 10];
+    size_t  n = 0;
+
+    if (writer->groupHits == 0) {
+        return;
+    }
+
+    n += putVarint(head + n, zigzag(writer->prevRef, writer->groupRef));
+    n += putVarint(head + n, writer->groupHits);
+    writerEmit(writer, head, n);
+    writerEmit(writer, writer->group, writer->groupLen);
+
+    writer->header.groupNo++;
+    writer->prevRef   = writer->groupRef;
+    writer->groupHits = 0;
+    writer->groupLen  = 0;
+}
+
+
+/*
+ * Function: resultWriterOpen
+ * The header is written with zero counts, resultWriterClose() rewrites it.
+ */
+int resultWriterOpen(ResultWriter *writer, const char *filename, uint32_t flags)
+{
+    memset(writer, 0, sizeof(*writer));
+    writer->header.magic      = RESULT_FILE_MAGIC;
+    writer->header.version    = RESULT_FILE_VERSION;
+    writer->header.headerSize = sizeof(ResultFileHeader);
+    writer->header.flags      = flags;
+
+    writer->buf = (uint8_t *)malloc(RESULT_WRITER_BUFFER);
+    if (!writer->buf) {
+        fprintf(stderr, "Failed to allocate the result buffer\n");
+        return -1;
+    }
+
+    writer->fp = fopen(filename, "wb");
+    if (!writer->fp) {
+        perror("Failed to open output file");
+        free(writer->buf);
+        writer->buf = NULL;
+        return -1;
+    }
+
+    if (fwrite(&writer->header, sizeof(writer->header), 1, writer->fp) != 1) {
+        perror("Failed to write results");
+        writer->error = 1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Function: resultWriterPush
+ * HitSink callback. Hits of one reference are expected back to back (as
+ * every search delivers them), a reference that comes back starts a new
+ * group.
+ */
+void resultWriterPush(void *ctx, uint32_t refID, uint32_t cmpID, double coeff)
+{
+    ResultWriter *writer = (ResultWriter *)ctx;
+
+    if (writer->error) {
+        return;
+    }
+
+    if (writer->groupHits > 0 && refID != writer->groupRef) {
+        finishGroup(writer);
+    }
+    if (writer->groupHits == 0) {
+        writer->groupRef = refID;
+        writer->prevCmp  = 0;
+    }
+
+    if (writer->groupLen + VARINT_MAX_BYTES + 1 > writer->groupCap) {
+        size_t   cap   = writer->groupCap ? writer->groupCap * 2 : 4096;
+        uint8_t *group = (uint8_t *)realloc(writer->group, cap);
+        if (!group) {
+            fprintf(stderr, "Failed to allocate the result group buffer\n");
+            writer->error = 1;
+            return;
+        }
+        writer->group    = group;
+        writer->groupCap = cap;
+    }
+
+    writer->groupLen += putVarint(writer->group + writer->groupLen, zigzag(writer->prevCmp, cmpID));
+    if (writer->header.flags & RESULT_FILE_COEFF) {
+        double q = coeff < 0.0 ? 0.0 : coeff > 1.0 ? 1.0 : coeff;
+        writer->group[writer->groupLen++] = (uint8_t)(q * 255.0 + 0.5);
+    }
+
+    writer->prevCmp = cmpID;
+    writer->groupHits++;
+    writer->header.pairNo++;
+}
+
+
+/*
+ * Function: resultWriterClose
+ */
+int resultWriterClose(ResultWriter *writer)
+{
+    finishGroup(writer);
+
+    if (!writer->error && writer->len > 0 &&
+        fwrite(writer->buf, 1, writer->len, writer->fp) != writer->len) {
+        perror("Failed to write results");
+        writer->error = 1;
+    }
+
+    if (!writer->error &&
+        (fseek(writer->fp, 0, SEEK_SET) != 0 ||
+         fwrite(&writer->header, sizeof(writer->header), 1, writer->fp) != 1)) {
+        perror("Failed to write the result file header");
+        writer->error = 1;
+    }
+
+    if (fclose(writer->fp) != 0) {
+        perror("Failed to close output file");
+        writer->error = 1;
+    }
+    writer->fp = NULL;
+
+    free(writer->buf);
+    free(writer->group);
+    writer->buf   = NULL;
+    writer->group = NULL;
+
+    return writer->error ? -1 : 0;
+}
+
+
+/*
+ * Function: resultFileIsCompact
+ */
+int resultFileIsCompact(const char *filename)
+{
+    uint32_t magic = 0;
+    FILE    *fp    = fopen(filename, "rb");
+
+    if (!fp) {
+        return 0;
+    }
+    size_t read = fread(&magic, sizeof(magic), 1, fp);
+    fclose(fp);
+
+    return read == 1 && magic == RESULT_FILE_MAGIC;
+}
+
+
+/*
+ * Function: resultReaderOpen
+ */
+int resultReaderOpen(ResultReader *reader, const char *filename)
+{
+    struct stat st;
+    int         fd = open(filename, O_RDONLY);
+
+    memset(reader, 0, sizeof(*reader));
+    if (fd < 0) {
+        perror("Failed to open result file");
+        return -1;
+    }
+
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ResultFileHeader)) {
+        fprintf(stderr, "%s: not a compact result file\n", filename);
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Failed to map result file");
+        return -1;
+    }
+
+    memcpy(&reader->header, map, sizeof(reader->header));
+    if (reader->header.magic != RESULT_FILE_MAGIC ||
+        reader->header.version != RESULT_FILE_VERSION ||
+        reader->header.headerSize < sizeof(ResultFileHeader) ||
+        reader->header.headerSize > (uint64_t)st.st_size ||
+        (reader->header.flags & ~RESULT_FILE_COEFF)) {
+        fprintf(stderr, "%s: not a compact result file of version %u\n", filename, RESULT_FILE_VERSION);
+        munmap(map, (size_t)st.st_size);
+        return -1;
+    }
+
+    madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+    reader->map     = map;
+    reader->mapSize = (size_t)st.st_size;
+    reader->pos     = (const uint8_t *)map + reader->header.headerSize;
+    reader->end     = (const uint8_t *)map + st.st_size;
+
+    return 0;
+}
+
+
+/*
+ * Function: resultReaderNext
+ */
+int resultReaderNext(ResultReader *reader, uint32_t *refID, uint32_t *cmpID, double *coeff)
+{
+    bool     coeffs = reader->header.flags & RESULT_FILE_COEFF;
+    uint64_t v;
+
+    if (reader->left == 0) {
+        if (reader->pos == reader->end) {
+            return 0;
+        }
+
+        if (getVarint(&reader->pos, reader->end, VARINT_MAX_BYTES, &v) || v > UINT32_MAX) {
+            return -1;
+        }
+        reader->refID = unzigzag(reader->refID, (uint32_t)v);
+
+        if (getVarint(&reader->pos, reader->end, 10, &reader->left) || reader->left == 0) {
+            return -1;
+        }
+        reader->cmpID = 0;
+    }
+
+    if (getVarint(&reader->pos, reader->end, VARINT_MAX_BYTES, &v) || v > UINT32_MAX ||
+        (coeffs && reader->pos == reader->end)) {
+        return -1;
+    }
+    reader->cmpID = unzigzag(reader->cmpID, (uint32_t)v);
+    reader->left--;
+
+    *refID = reader->refID;
+    *cmpID = reader->cmpID;
+    if (coeff) {
+        *coeff = coeffs ? *reader->pos / 255.0 : -1.0;
+    }
+    if (coeffs) {
+        reader->pos++;
+    }
+
+    return 1;
+}
+
+
+void resultReaderClose(ResultReader *reader)
+{
+    if (reader->map) {
+        munmap(reader->map, reader->mapSize);
+    }
+    reader->map = NULL;
+}
@@ -0,0 +1,115 @@
+#ifndef RESULTFILE_H
+#define RESULTFILE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Compact result file, version 1
+ * The raw results.bin format spends 8 bytes on every hit, at production
+ * scale it outgrows the fingerprints. Here hits are grouped by reference
+ * vector and the IDs are delta coded as LEB128 varints (7 bits per byte,
+ * low group first, high bit set on all but the last byte). Deltas are
+ * zigzag mapped, so a store sorted by weight (IDs out of order) still
+ * decodes, only less compactly.
+ *
+ * header   - ResultFileHeader
+ * groups   - back to back until the end of the file:
+ *            varint  zigzag(refID - refID of the previous group, 0 before the first)
+ *            varint  number of hits in the group, at least 1
+ *            per hit:
+ *            varint  zigzag(cmpID - previous cmpID of the group, 0 before the first)
+ *            uint8   coefficient quantized to [0, 255], only with RESULT_FILE_COEFF
+ *
+ * The same reference may head more than one group (e.g. once per chunk).
+ * The coefficient is the value the hit was compared against the threshold
+ * (see HitSink), coeff * 255 rounded.
+ */
+#define RESULT_FILE_MAGIC       0x53524646u     // "FFRS"
+#define RESULT_FILE_VERSION     1
+
+#define RESULT_FILE_COEFF       0x1u            // quantized coefficient after every cmp ID
+
+typedef struct {
+    uint32_t  magic;
+    uint32_t  version;
+    uint32_t  headerSize;       /* sizeof(ResultFileHeader) */
+    uint32_t  flags;            /* RESULT_FILE_* */
+    uint64_t  pairNo;           /* Number of hits */
+    uint64_t  groupNo;          /* Number of groups */
+} ResultFileHeader;
+
+/*
+ * Streaming writer, a HitSink. Encoded groups collect in a buffer of
+ * RESULT_WRITER_BUFFER bytes that is written out whenever it fills up, so
+ * the file is produced in large sequential writes. The counts of the
+ * header are filled in by resultWriterClose().
+ */
+#define RESULT_WRITER_BUFFER    (1u << 20)
+
+typedef struct {
+    FILE             *fp;
+    ResultFileHeader  header;
+    int               error;        /* Set when a write or allocation failed */
+
+    uint8_t          *buf;          /* RESULT_WRITER_BUFFER bytes, encoded groups */
+    size_t            len;
+
+    uint8_t          *group;        /* Hits of the open group, encoded */
+    size_t            groupLen;
+    size_t            groupCap;
+    uint64_t          groupHits;
+    uint32_t          groupRef;
+    uint32_t          prevRef;      /* refID of the last finished group */
+    uint32_t          prevCmp;
+} ResultWriter;
+
+/* Create filename, flags are RESULT_FILE_*. Returns 0 on success. */
+int  resultWriterOpen(ResultWriter *writer, const char *filename, uint32_t flags);
+
+/* HitSink callback, ctx is a ResultWriter opened with resultWriterOpen() */
+void resultWriterPush(void *ctx, uint32_t refID, uint32_t cmpID, double coeff);
+
+/* Write the last group and the header, close the file. Returns 0 if every write succeeded. */
+int  resultWriterClose(ResultWriter *writer);
+
+/*
+ * Zero-copy reader. The file is mapped read-only and the hits are decoded
+ * straight from the mapping, one at a time, nothing is read into a buffer.
+ */
+typedef struct {
+    void             *map;
+    size_t            mapSize;
+    ResultFileHeader  header;
+    const uint8_t    *pos;
+    const uint8_t    *end;
+    uint64_t          left;         /* Hits left in the current group */
+    uint32_t          refID;
+    uint32_t          cmpID;
+} ResultReader;
+
+/* Whether filename starts with RESULT_FILE_MAGIC (raw ID files never do in practice) */
+int  resultFileIsCompact(const char *filename);
+
+/* Map filename and check its header, returns 0 on success */
+int  resultReaderOpen(ResultReader *reader, const char *filename);
+
+/*
+ * Decode the next hit. coeff may be NULL, it is -1.0 if the file has no
+ * coefficients. Returns 1 with the hit set, 0 at the end of the file, -1 if
+ * the file is truncated or corrupt.
+ */
+int  resultReaderNext(ResultReader *reader, uint32_t *refID, uint32_t *cmpID, double *coeff);
+
+void resultReaderClose(ResultReader *reader);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // RESULTFILE_H
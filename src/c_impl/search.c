@@ -0,0 +1,961 @@
+#include "search.h"
+#include "worksteal.h"
+#include "popcnt.h"
+#include <string.h>
+
+// Hit of searchParallel, buffered until all tiles are done
+typedef struct {
+    uint32_t refIdx;
+    uint32_t cmpIdx;
+    uint32_t cntC;
+} SearchHit;
+
+// CNT(A & B) of a pair given up by boundedCount(), never a real count
+#define SEARCH_ABANDONED    UINT32_MAX
+
+// Growable hit array
+typedef struct {
+    SearchHit *hits;
+    size_t     cnt;
+    size_t     cap;
+} HitArray;
+
+// Per thread state, one cache line aligned block per worker
+typedef struct {
+    HitArray   sorted;      /* Hits of every finished tile, ref-major per tile */
+    HitArray   tile;        /* Hits of the current tile, in compute order */
+    uint64_t   pairs;
+    uint64_t   pruned;
+    uint64_t   terminated;
+    int        error;
+} __attribute__((aligned(64))) HitBuffer;
+
+// Where the hits of a tile ended up
+typedef struct {
+    uint32_t   worker;
+    size_t     begin;
+    size_t     cnt;
+} TileHits;
+
+// Cmp weights a ref of weight w can match: [lo[w], hi[w]], empty if lo > hi
+typedef struct {
+    uint32_t  *lo;
+    uint32_t  *hi;
+} WeightWindows;
+
+// OR-fold of a row next to its weight, two rows per cache line
+typedef struct {
+    uint64_t  fold[2];      /* foldBits / 64 words used */
+    uint32_t  hidden;       /* weight - CNT(fold): bits the fold cannot tell apart */
+    uint32_t  reserved;
+    double    share;        /* weight * t / (1 + t), the row's part of the pair's limit */
+} FoldSketch;
+
+typedef struct {
+    FoldSketch   *ref;
+    FoldSketch   *cmp;
+    unsigned int  words;
+} FoldedRows;
+
+// Weight of every row from each SEARCH_BOUND_WORDS segment on: row r,
+// segment k at [r * (segNo + 1) + k], the last entry of a row is 0
+typedef struct {
+    uint32_t  *ref;
+    uint32_t  *cmp;
+    size_t     segNo;
+} SuffixWeights;
+
+typedef struct {
+    const FingerprintStore *ref;
+    const FingerprintStore *cmp;
+    const SearchConfig     *cfg;
+    const WeightWindows    *windows;    /* NULL if not pruning */
+    const SuffixWeights    *suffix;     /* NULL if not bounding */
+    const FoldedRows       *folds;      /* NULL if not prefiltering */
+    const SparseRows       *sparse;     /* Positions of the cmp rows, NULL if counting dense */
+    bool                    self;       /* ref == cmp, upper triangle only */
+    const size_t           *schedule;   /* Tiles to run, NULL for all of them */
+    PopcntAndBlockFn        block;      /* Instance for the fingerprint width */
+    size_t                  cmpTileNo;
+    HitBuffer              *buffers;
+    TileHits               *tiles;
+} ParallelSearch;
+
+/*
+ * Function: searchStreaming
+ * Double loop over ref x cmp. CNT(A & B) is counted by the fused kernel and
+ * thresholded right away, the intermediary vector and the TanimotoResult of
+ * a pair never exist in memory.
+ */
+void searchStreaming(const FingerprintStore *ref,
+                     const FingerprintStore *cmp,
+                     const SearchConfig *cfg,
+                     HitSink sink, void *ctx,
+                     SearchStats *stats)
+{
+    uint64_t hits = 0;
+
+    for (size_t i = 0; i < ref->count; i++) {
+        for (size_t j = 0; j < cmp->count; j++) {
+            uint32_t cntC = calculateIntersectionWeight(ref, i, cmp, j);
+
+            if (searchMatch(cfg, ref->weights[i], cmp->weights[j], cntC)) {
+                sink(ctx, ref->ids[i], cmp->ids[j],
+                     searchCoeff(cfg, ref->weights[i], cmp->weights[j], cntC));
+                hits++;
+            }
+        }
+    }
+
+    if (stats) {
+        stats->pairs      = (uint64_t)ref->count * cmp->count;
+        stats->pruned     = 0;
+        stats->terminated = 0;
+        stats->hits       = hits;
+    }
+}
+
+
+/*
+ * Function: weightFeasible
+ * Whether a pair of weights a, b can match at all: evaluates the criterion
+ * at the largest possible CNT(A & B) = min(a, b). Similarity grows with
+ * CNT(A & B), and the same floating point expression is used as for the
+ * real pairs, so the bound is exact, no pair that would match is pruned.
+ */
+static bool weightFeasible(const SearchConfig *cfg, uint32_t a, uint32_t b)
+{
+    return searchMatch(cfg, a, b, a < b ? a : b);
+}
+
+
+/*
+ * Function: buildWeightWindows
+ * For every ref weight a, the bound min(a, b) / max(a, b) is b / a below a
+ * and a / b above it, monotone on both sides, so the matching b form an
+ * interval around a, found by two binary searches.
+ */
+static int buildWeightWindows(WeightWindows *win, const SearchConfig *cfg, uint32_t width)
+{
+    win->lo = (uint32_t *)malloc(((size_t)width + 1) * sizeof(uint32_t));
+    win->hi = (uint32_t *)malloc(((size_t)width + 1) * sizeof(uint32_t));
+    if (!win->lo || !win->hi) {
+        free(win->lo);
+        free(win->hi);
+        return -1;
+    }
+
+    for (uint32_t a = 0; a <= width; a++) {
+        if (!weightFeasible(cfg, a, a)) {
+            win->lo[a] = 1;
+            win->hi[a] = 0;
+            continue;
+        }
+
+        uint32_t lo = 0, hi = a;            // smallest feasible b in [0, a]
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (weightFeasible(cfg, a, mid)) {
+                hi = mid;
+            } else {
+                lo = mid + 1;
+            }
+        }
+        win->lo[a] = lo;
+
+        lo = a, hi = width;                 // largest feasible b in [a, width]
+        while (lo < hi) {
+            uint32_t mid = hi - (hi - lo) / 2;
+            if (weightFeasible(cfg, a, mid)) {
+                lo = mid;
+            } else {
+                hi = mid - 1;
+            }
+        }
+        win->hi[a] = lo;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Function: buildFolds
+ * Sketch of every row of store: fold bit k is set if any bit k (mod
+ * 64 * words) of the row is.
+ */
+static FoldSketch *buildFolds(const FingerprintStore *store, unsigned int words, double threshold)
+{
+    FoldSketch *folds = (FoldSketch *)calloc(store->count, sizeof(FoldSketch));
+    if (!folds) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < store->count; i++) {
+        const uint64_t *row    = fpStoreRow(store, i);
+        FoldSketch     *sketch = &folds[i];
+        uint32_t        cnt    = 0;
+
+        for (size_t k = 0; k < store->stride; k++) {
+            sketch->fold[k % words] |= row[k];
+        }
+        for (unsigned int w = 0; w < words; w++) {
+            cnt += (uint32_t)__builtin_popcountll(sketch->fold[w]);
+        }
+        sketch->hidden = store->weights[i] - cnt;
+        sketch->share  = store->weights[i] * (threshold / (1.0 + threshold));
+    }
+
+    return folds;
+}
+
+
+/*
+ * Function: foldFilter
+ * Every set bit of A & B sits on a fold bit set in both F(A) and F(B), and
+ * every fold bit set in F(A) stands for at least one bit of A. The bits of
+ * A on fold bits that F(B) lacks cannot be shared, so
+ *     CNT(A & B) <= CNT(F(A) & F(B)) + min(|A| - CNT(F(A)), |B| - CNT(F(B)))
+ * A pair is kept while bound + 2 > t(|A| + |B|) / (1 + t), the same margin
+ * as searchPairLimit(). Rejected pairs of the block are set to
+ * SEARCH_ABANDONED, the others to 0. Only the sketches are read. Returns
+ * the number of surviving pairs.
+ */
+static inline __attribute__((always_inline))
+size_t foldFilterWords(const FoldedRows *folds, unsigned int words, size_t i, size_t refRows,
+                       size_t j, size_t cmpRows, uint32_t *cnt)
+{
+    size_t survivors = 0;
+
+    for (size_t r = 0; r < refRows; r++) {
+        const FoldSketch *sa = &folds->ref[i + r];
+
+        for (size_t c = 0; c < cmpRows; c++) {
+            const FoldSketch *sb     = &folds->cmp[j + c];
+            uint32_t          common = 0;
+
+            for (unsigned int w = 0; w < words; w++) {
+                common += (uint32_t)__builtin_popcountll(sa->fold[w] & sb->fold[w]);
+            }
+
+            uint32_t bound = common + (sa->hidden < sb->hidden ? sa->hidden : sb->hidden);
+            bool     alive = (double)(bound + 2) > sa->share + sb->share;
+
+            cnt[r * POPCNT_BLOCK_CMP + c] = alive ? 0 : SEARCH_ABANDONED;
+            survivors += alive;
+        }
+    }
+
+    return survivors;
+}
+
+static size_t foldFilter(const ParallelSearch *search, size_t i, size_t refRows,
+                         size_t j, size_t cmpRows, uint32_t *cnt)
+{
+    return search->folds->words == 1 ? foldFilterWords(search->folds, 1, i, refRows, j, cmpRows, cnt)
+                                     : foldFilterWords(search->folds, 2, i, refRows, j, cmpRows, cnt);
+}
+
+
+/*
+ * Function: buildSuffixWeights
+ * Suffix sums of the segment weights of every row of store.
+ */
+static uint32_t *buildSuffixWeights(const FingerprintStore *store, size_t segNo)
+{
+    uint32_t *suffix = (uint32_t *)malloc(store->count * (segNo + 1) * sizeof(uint32_t));
+    if (!suffix) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < store->count; i++) {
+        const uint64_t *row  = fpStoreRow(store, i);
+        uint32_t       *rest = &suffix[i * (segNo + 1)];
+
+        rest[segNo] = 0;
+        for (size_t k = segNo; k-- > 0;) {
+            size_t words = store->stride - k * SEARCH_BOUND_WORDS;
+            words   = words < SEARCH_BOUND_WORDS ? words : SEARCH_BOUND_WORDS;
+            rest[k] = rest[k + 1] + popcnt((const uint8_t *)(row + k * SEARCH_BOUND_WORDS),
+                                           words * sizeof(uint64_t));
+        }
+    }
+
+    return suffix;
+}
+
+
+/*
+ * Function: boundedCount
+ * CNT(A & B) of one pair, one segment at a time, checking the running bound
+ * after every segment. Returns false if the pair was abandoned, *cntC is
+ * only set otherwise.
+ */
+static bool boundedCount(const ParallelSearch *search, size_t i, size_t j, uint32_t *cntC)
+{
+    const SuffixWeights *suffix = search->suffix;
+    const uint32_t      *restA  = &suffix->ref[i * (suffix->segNo + 1)];
+    const uint32_t      *restB  = &suffix->cmp[j * (suffix->segNo + 1)];
+    const uint64_t      *a      = fpStoreRow(search->ref, i);
+    const uint64_t      *b      = fpStoreRow(search->cmp, j);
+    size_t               stride = search->ref->stride;
+    uint32_t             limit  = searchPairLimit(search->cfg, restA[0], restB[0]);
+    uint32_t             cnt    = 0;
+
+    for (size_t k = 0; k < suffix->segNo; k++) {
+        size_t   off   = k * SEARCH_BOUND_WORDS;
+        size_t   words = stride - off < SEARCH_BOUND_WORDS ? stride - off : SEARCH_BOUND_WORDS;
+        uint32_t rest  = restA[k + 1] < restB[k + 1] ? restA[k + 1] : restB[k + 1];
+
+        cnt += popcntAnd((const uint8_t *)(a + off), (const uint8_t *)(b + off), words * sizeof(uint64_t));
+        if (!searchPairAlive(search->cfg, limit, cnt, rest)) {
+            return false;
+        }
+    }
+
+    *cntC = cnt;
+    return true;
+}
+
+
+/*
+ * Function: boundedBlock
+ * boundedCount() for a full POPCNT_BLOCK_REF x POPCNT_BLOCK_CMP block,
+ * through popcntAndBlockWords() so the micro-kernel's register reuse is
+ * kept. The block stops after the first segment that leaves none of its
+ * pairs alive, pairs abandoned on the way are set to SEARCH_ABANDONED.
+ * Returns the number of abandoned pairs.
+ */
+static unsigned int boundedBlock(const ParallelSearch *search, size_t i, size_t j, uint32_t *cnt)
+{
+    const SuffixWeights *suffix = search->suffix;
+    const uint64_t      *a      = fpStoreRow(search->ref, i);
+    const uint64_t      *b      = fpStoreRow(search->cmp, j);
+    size_t               stride = search->ref->stride;
+    uint32_t             part[POPCNT_BLOCK_REF * POPCNT_BLOCK_CMP];
+    uint32_t             limit[POPCNT_BLOCK_REF * POPCNT_BLOCK_CMP];
+    bool                 alive[POPCNT_BLOCK_REF * POPCNT_BLOCK_CMP];
+    unsigned int         aliveNo = POPCNT_BLOCK_REF * POPCNT_BLOCK_CMP;
+
+    for (size_t r = 0; r < POPCNT_BLOCK_REF; r++) {
+        for (size_t c = 0; c < POPCNT_BLOCK_CMP; c++) {
+            size_t p = r * POPCNT_BLOCK_CMP + c;
+            limit[p] = searchPairLimit(search->cfg, suffix->ref[(i + r) * (suffix->segNo + 1)],
+                                       suffix->cmp[(j + c) * (suffix->segNo + 1)]);
+            alive[p] = true;
+            cnt[p]   = 0;
+        }
+    }
+
+    for (size_t k = 0; k < suffix->segNo && aliveNo > 0; k++) {
+        size_t off   = k * SEARCH_BOUND_WORDS;
+        size_t words = stride - off < SEARCH_BOUND_WORDS ? stride - off : SEARCH_BOUND_WORDS;
+
+        popcntAndBlockWords(a + off, b + off, stride, words, part);
+
+        for (size_t r = 0; r < POPCNT_BLOCK_REF; r++) {
+            uint32_t restA = suffix->ref[(i + r) * (suffix->segNo + 1) + k + 1];
+
+            for (size_t c = 0; c < POPCNT_BLOCK_CMP; c++) {
+                size_t   p     = r * POPCNT_BLOCK_CMP + c;
+                uint32_t restB = suffix->cmp[(j + c) * (suffix->segNo + 1) + k + 1];
+
+                if (!alive[p]) {
+                    continue;
+                }
+                cnt[p] += part[p];
+                if (!searchPairAlive(search->cfg, limit[p], cnt[p], restA < restB ? restA : restB)) {
+                    alive[p] = false;
+                    aliveNo--;
+                }
+            }
+        }
+    }
+
+    for (size_t p = 0; p < POPCNT_BLOCK_REF * POPCNT_BLOCK_CMP; p++) {
+        if (!alive[p]) {
+            cnt[p] = SEARCH_ABANDONED;
+        }
+    }
+
+    return POPCNT_BLOCK_REF * POPCNT_BLOCK_CMP - aliveNo;
+}
+
+
+/*
+ * Function: reserveHits
+ * Make room for n more hits, growing the array geometrically.
+ */
+static int reserveHits(HitArray *arr, size_t n)
+{
+    if (arr->cnt + n <= arr->cap) {
+        return 0;
+    }
+
+    size_t cap = arr->cap ? arr->cap : 1024;
+    while (cap < arr->cnt + n) {
+        cap *= 2;
+    }
+
+    SearchHit *hits = (SearchHit *)realloc(arr->hits, cap * sizeof(SearchHit));
+    if (!hits) {
+        return -1;
+    }
+    arr->hits = hits;
+    arr->cap  = cap;
+
+    return 0;
+}
+
+
+/*
+ * Function: finishTile
+ * Move the hits of a tile from compute order (cmp block major) to ref-major
+ * order with a counting sort on the ref row. Within a ref row the hits are
+ * already in ascending cmp order, the sort is stable, so the segment ends up
+ * sorted by (ref, cmp).
+ */
+static void finishTile(ParallelSearch *search, HitBuffer *buf, unsigned int worker,
+                       size_t tile, size_t refBegin)
+{
+    size_t    offsets[SEARCH_TILE_REF + 1] = {0};
+    HitArray *in  = &buf->tile;
+    HitArray *out = &buf->sorted;
+
+    search->tiles[tile].worker = worker;
+    search->tiles[tile].begin  = out->cnt;
+    search->tiles[tile].cnt    = 0;
+
+    if (buf->error || reserveHits(out, in->cnt)) {
+        buf->error = 1;
+        in->cnt    = 0;
+        return;
+    }
+
+    for (size_t k = 0; k < in->cnt; k++) {
+        offsets[in->hits[k].refIdx - refBegin + 1]++;
+    }
+    for (size_t r = 1; r <= SEARCH_TILE_REF; r++) {
+        offsets[r] += offsets[r-1];
+    }
+    for (size_t k = 0; k < in->cnt; k++) {
+        out->hits[out->cnt + offsets[in->hits[k].refIdx - refBegin]++] = in->hits[k];
+    }
+
+    out->cnt += in->cnt;
+    search->tiles[tile].cnt = in->cnt;
+    in->cnt = 0;
+}
+
+
+/*
+ * Function: selfPairs
+ * Number of pairs (i, j), j > i, in rows [iBegin, iEnd) x [jBegin, jEnd).
+ */
+static uint64_t selfPairs(size_t iBegin, size_t iEnd, size_t jBegin, size_t jEnd)
+{
+    uint64_t pairs = 0;
+
+    for (size_t i = iBegin; i < iEnd; i++) {
+        size_t lo = i + 1 > jBegin ? i + 1 : jBegin;
+        pairs += jEnd > lo ? jEnd - lo : 0;
+    }
+
+    return pairs;
+}
+
+
+/*
+ * Function: searchTile
+ * TileFn of searchParallel, tiles are numbered ref block major.
+ * Cache blocking: the tile's ref rows (SEARCH_TILE_REF rows, a few KiB)
+ * stay in L1 while cmp rows stream past, POPCNT_BLOCK_CMP rows at a time.
+ * Every cmp block is combined with all ref blocks of the tile through the
+ * register-blocked micro-kernel, so a cmp row is read from memory once per
+ * tile. Rows that do not fill a whole block fall back to single pairs.
+ * When pruning, every ref block gets the union of its refs' cmp row windows,
+ * blocks outside of it are skipped, the cmp loop only covers the union of
+ * all of them. When bounding, blocks are counted by boundedBlock() (single
+ * pairs by boundedCount()), abandoned pairs are marked with SEARCH_ABANDONED.
+ * With folded rows every block goes through foldFilter() first: a block
+ * without survivors never touches its rows, a full block with survivors is
+ * counted whole (the micro-kernel costs little more than a single pair),
+ * a partial one only counts its survivors. In a self-join, blocks on or
+ * below the diagonal are skipped, blocks across it only count the pairs
+ * above it.
+ */
+static void searchTile(void *ctx, unsigned int worker, size_t tile)
+{
+    ParallelSearch         *search = (ParallelSearch *)ctx;
+    const FingerprintStore *ref    = search->ref;
+    const FingerprintStore *cmp    = search->cmp;
+    const SearchConfig     *cfg    = search->cfg;
+    HitBuffer              *buf    = &search->buffers[worker];
+    uint32_t                cnt[POPCNT_BLOCK_REF * POPCNT_BLOCK_CMP];
+    size_t                  rowLo[SEARCH_TILE_REF / POPCNT_BLOCK_REF];
+    size_t                  rowHi[SEARCH_TILE_REF / POPCNT_BLOCK_REF];
+
+    if (search->schedule) {
+        tile = search->schedule[tile];
+    }
+
+    size_t refBegin = (tile / search->cmpTileNo) * SEARCH_TILE_REF;
+    size_t cmpBegin = (tile % search->cmpTileNo) * SEARCH_TILE_CMP;
+    size_t refEnd   = refBegin + SEARCH_TILE_REF < ref->count ? refBegin + SEARCH_TILE_REF : ref->count;
+    size_t cmpEnd   = cmpBegin + SEARCH_TILE_CMP < cmp->count ? cmpBegin + SEARCH_TILE_CMP : cmp->count;
+    size_t jBegin   = cmpBegin;
+    size_t jEnd     = cmpEnd;
+    uint64_t counted = 0;
+
+    for (size_t b = 0; b < SEARCH_TILE_REF / POPCNT_BLOCK_REF; b++) {
+        rowLo[b] = cmpBegin;
+        rowHi[b] = cmpEnd;
+    }
+
+    if (search->windows) {
+        const size_t *start = cfg->cmpBuckets->start;
+
+        jBegin = cmpEnd;
+        jEnd   = cmpBegin;
+        for (size_t i = refBegin; i < refEnd; i += POPCNT_BLOCK_REF) {
+            size_t b  = (i - refBegin) / POPCNT_BLOCK_REF;
+            size_t lo = cmpEnd, hi = cmpBegin;
+
+            for (size_t r = i; r < refEnd && r < i + POPCNT_BLOCK_REF; r++) {
+                uint32_t wLo = search->windows->lo[ref->weights[r]];
+                uint32_t wHi = search->windows->hi[ref->weights[r]];
+                if (wLo > wHi) {
+                    continue;
+                }
+                lo = start[wLo]     < lo ? start[wLo]     : lo;
+                hi = start[wHi + 1] > hi ? start[wHi + 1] : hi;
+            }
+
+            rowLo[b] = lo > cmpBegin ? lo : cmpBegin;
+            rowHi[b] = hi < cmpEnd   ? hi : cmpEnd;
+            if (rowLo[b] < rowHi[b]) {
+                jBegin = rowLo[b] < jBegin ? rowLo[b] : jBegin;
+                jEnd   = rowHi[b] > jEnd   ? rowHi[b] : jEnd;
+            }
+        }
+    }
+
+    for (size_t j = jBegin; j < jEnd; j += POPCNT_BLOCK_CMP) {
+        size_t cmpRows = jEnd - j < POPCNT_BLOCK_CMP ? jEnd - j : POPCNT_BLOCK_CMP;
+
+        for (size_t i = refBegin; i < refEnd; i += POPCNT_BLOCK_REF) {
+            size_t refRows = refEnd - i < POPCNT_BLOCK_REF ? refEnd - i : POPCNT_BLOCK_REF;
+            size_t b       = (i - refBegin) / POPCNT_BLOCK_REF;
+
+            if (j >= rowHi[b] || j + cmpRows <= rowLo[b]) {
+                continue;
+            }
+
+            bool     full  = refRows == POPCNT_BLOCK_REF && cmpRows == POPCNT_BLOCK_CMP;
+            bool     some  = search->folds && !full;    // only count the pairs not marked abandoned
+            uint64_t block = refRows * cmpRows;
+
+            if (search->self && j + cmpRows <= i + 1) {
+                continue;                               // on or below the diagonal
+            }
+            if (search->folds && foldFilter(search, i, refRows, j, cmpRows, cnt) == 0) {
+                continue;
+            }
+            if (search->self && j < i + refRows) {      // straddles the diagonal
+                for (size_t r = 0; r < refRows; r++) {
+                    for (size_t c = 0; c < cmpRows; c++) {
+                        if (j + c <= i + r) {
+                            cnt[r * POPCNT_BLOCK_CMP + c] = SEARCH_ABANDONED;
+                        } else if (!search->folds) {
+                            cnt[r * POPCNT_BLOCK_CMP + c] = 0;
+                        }
+                    }
+                }
+                full  = false;
+                some  = true;
+                block = selfPairs(i, i + refRows, j, j + cmpRows);
+            }
+
+            if (search->sparse && refRows == POPCNT_BLOCK_REF && !some) {
+                for (size_t c = 0; c < cmpRows; c++) {
+                    uint32_t        col[POPCNT_BLOCK_REF];
+                    size_t          n;
+                    const uint16_t *bits = sparseRow(search->sparse, j + c, &n);
+
+                    sparseProbeBlock(fpStoreRow(ref, i), ref->stride, bits, n, col);
+                    for (size_t r = 0; r < POPCNT_BLOCK_REF; r++) {
+                        cnt[r * POPCNT_BLOCK_CMP + c] = col[r];
+                    }
+                }
+            } else if (search->sparse) {
+                for (size_t r = 0; r < refRows; r++) {
+                    for (size_t c = 0; c < cmpRows; c++) {
+                        uint32_t       *cntC = &cnt[r * POPCNT_BLOCK_CMP + c];
+                        const uint16_t *bits;
+                        size_t          n;
+                        if (some && *cntC == SEARCH_ABANDONED) {
+                            continue;
+                        }
+                        bits  = sparseRow(search->sparse, j + c, &n);
+                        *cntC = sparseProbe(fpStoreRow(ref, i + r), bits, n);
+                    }
+                }
+            } else if (search->suffix && full) {
+                buf->terminated += boundedBlock(search, i, j, cnt);
+            } else if (search->suffix) {
+                for (size_t r = 0; r < refRows; r++) {
+                    for (size_t c = 0; c < cmpRows; c++) {
+                        uint32_t *cntC = &cnt[r * POPCNT_BLOCK_CMP + c];
+                        if (some && *cntC == SEARCH_ABANDONED) {
+                            continue;
+                        }
+                        if (!boundedCount(search, i + r, j + c, cntC)) {
+                            *cntC = SEARCH_ABANDONED;
+                            buf->terminated++;
+                        }
+                    }
+                }
+            } else if (full) {
+                search->block(fpStoreRow(ref, i), fpStoreRow(cmp, j), ref->stride, cnt);
+            } else {
+                for (size_t r = 0; r < refRows; r++) {
+                    for (size_t c = 0; c < cmpRows; c++) {
+                        uint32_t *cntC = &cnt[r * POPCNT_BLOCK_CMP + c];
+                        if (some && *cntC == SEARCH_ABANDONED) {
+                            continue;
+                        }
+                        *cntC = calculateIntersectionWeight(ref, i + r, cmp, j + c);
+                    }
+                }
+            }
+            counted += block;
+
+            if (reserveHits(&buf->tile, POPCNT_BLOCK_REF * POPCNT_BLOCK_CMP)) {
+                buf->error = 1;
+                continue;
+            }
+
+            for (size_t r = 0; r < refRows; r++) {
+                for (size_t c = 0; c < cmpRows; c++) {
+                    uint32_t cntC = cnt[r * POPCNT_BLOCK_CMP + c];
+
+                    if (cntC != SEARCH_ABANDONED &&
+                        searchMatch(cfg, ref->weights[i + r], cmp->weights[j + c], cntC)) {
+                        SearchHit *hit = &buf->tile.hits[buf->tile.cnt++];
+                        hit->refIdx = (uint32_t)(i + r);
+                        hit->cmpIdx = (uint32_t)(j + c);
+                        hit->cntC   = cntC;
+                    }
+                }
+            }
+        }
+    }
+
+    uint64_t pairs = search->self ? selfPairs(refBegin, refEnd, cmpBegin, cmpEnd)
+                                  : (uint64_t)(refEnd - refBegin) * (cmpEnd - cmpBegin);
+    buf->pairs  += pairs;
+    buf->pruned += pairs - counted;
+    finishTile(search, buf, worker, tile, refBegin);
+}
+
+
+/*
+ * Function: runParallel
+ * Hit buffers are only touched by their owner thread during the search.
+ * Every tile leaves a (ref, cmp) sorted segment in its worker's buffer, the
+ * merge walks the segments of a tile row ref by ref, so the sink sees hits
+ * in ref-major order without any global sort or lock. A self-join only
+ * schedules the tiles that reach above the diagonal, the others stay empty.
+ */
+static int runParallel(const FingerprintStore *ref,
+                       const FingerprintStore *cmp,
+                       const SearchConfig *cfg,
+                       bool self,
+                       HitSink sink, void *ctx,
+                       SearchStats *stats)
+{
+    ParallelSearch search;
+    WeightWindows  windows;
+    SuffixWeights  suffix;
+    FoldedRows     folds;
+    SparseRows     sparse;
+    unsigned int   threadNo = cfg->threadNo ? cfg->threadNo : 1;
+    int            error = 0;
+
+    size_t refTileNo = (ref->count + SEARCH_TILE_REF - 1) / SEARCH_TILE_REF;
+    size_t cmpTileNo = (cmp->count + SEARCH_TILE_CMP - 1) / SEARCH_TILE_CMP;
+
+    search.ref       = ref;
+    search.cmp       = cmp;
+    search.cfg       = cfg;
+    search.windows   = NULL;
+    search.suffix    = NULL;
+    search.folds     = NULL;
+    search.sparse    = NULL;
+    search.self      = self;
+    search.schedule  = NULL;
+    search.block     = popcntAndBlockForWidth(ref->width);
+    search.cmpTileNo = cmpTileNo;
+    search.buffers   = NULL;
+    search.tiles     = (TileHits *)calloc(refTileNo * cmpTileNo + 1, sizeof(TileHits));
+    size_t *cursors  = (size_t *)calloc(cmpTileNo + 1, sizeof(size_t));
+    size_t *schedule = self ? (size_t *)malloc((refTileNo * cmpTileNo + 1) * sizeof(size_t)) : NULL;
+    size_t  tileNo   = refTileNo * cmpTileNo;
+
+    if (!search.tiles || !cursors || (self && !schedule) ||
+        posix_memalign((void **)&search.buffers, 64, threadNo * sizeof(HitBuffer))) {
+        fprintf(stderr, "Failed to allocate search state\n");
+        free(search.tiles);
+        free(cursors);
+        free(schedule);
+        return -1;
+    }
+    memset(search.buffers, 0, threadNo * sizeof(HitBuffer));
+
+    // Upper triangle: tiles whose last cmp row lies past their first ref row
+    if (self) {
+        tileNo = 0;
+        for (size_t t = 0; t < refTileNo * cmpTileNo; t++) {
+            size_t refBegin = (t / cmpTileNo) * SEARCH_TILE_REF;
+            size_t cmpEnd   = (t % cmpTileNo + 1) * SEARCH_TILE_CMP;
+            cmpEnd = cmpEnd < cmp->count ? cmpEnd : cmp->count;
+            if (cmpEnd > refBegin + 1) {
+                schedule[tileNo++] = t;
+            }
+        }
+        search.schedule = schedule;
+    }
+
+    if (cfg->mode == MATCH_SIMILAR && cfg->cmpBuckets) {
+        if (buildWeightWindows(&windows, cfg, cmp->width) == 0) {
+            search.windows = &windows;
+        } else {
+            fprintf(stderr, "Failed to allocate weight windows, searching without pruning\n");
+        }
+    }
+
+    if (cfg->sparse == SPARSE_ON || (cfg->sparse == SPARSE_AUTO && sparseRowsPreferred(cmp))) {
+        if (sparseRowsBuild(&sparse, cmp) == 0) {
+            search.sparse = &sparse;
+        } else {
+            fprintf(stderr, "Searching with dense rows\n");
+        }
+    }
+
+    if (cfg->mode == MATCH_SIMILAR && ref->width >= SEARCH_BOUND_MIN_WIDTH && !search.sparse) {
+        suffix.segNo = (ref->stride + SEARCH_BOUND_WORDS - 1) / SEARCH_BOUND_WORDS;
+        suffix.ref   = buildSuffixWeights(ref, suffix.segNo);
+        suffix.cmp   = self ? suffix.ref : buildSuffixWeights(cmp, suffix.segNo);
+        if (suffix.ref && suffix.cmp) {
+            search.suffix = &suffix;
+        } else {
+            fprintf(stderr, "Failed to allocate suffix weights, searching without early termination\n");
+            free(suffix.ref);
+            if (!self) {
+                free(suffix.cmp);
+            }
+        }
+    }
+
+    if (cfg->mode == MATCH_SIMILAR && (cfg->foldBits == 64 || cfg->foldBits == 128)) {
+        folds.words = cfg->foldBits / 64;
+        folds.ref   = buildFolds(ref, folds.words, cfg->threshold);
+        folds.cmp   = self ? folds.ref : buildFolds(cmp, folds.words, cfg->threshold);
+        if (folds.ref && folds.cmp) {
+            search.folds = &folds;
+        } else {
+            fprintf(stderr, "Failed to allocate folded rows, searching without prefilter\n");
+            free(folds.ref);
+            if (!self) {
+                free(folds.cmp);
+            }
+        }
+    }
+
+    workStealRun(tileNo, threadNo, searchTile, &search);
+
+    uint64_t pairs      = 0;
+    uint64_t pruned     = 0;
+    uint64_t terminated = 0;
+    uint64_t hits       = 0;
+
+    for (unsigned int w = 0; w < threadNo; w++) {
+        pairs      += search.buffers[w].pairs;
+        pruned     += search.buffers[w].pruned;
+        terminated += search.buffers[w].terminated;
+        error  |= search.buffers[w].error;
+    }
+
+    /* Merge, tile row by tile row */
+    for (size_t rt = 0; rt < refTileNo; rt++) {
+        const TileHits *row = &search.tiles[rt * cmpTileNo];
+        size_t refEnd = (rt + 1) * SEARCH_TILE_REF < ref->count ? (rt + 1) * SEARCH_TILE_REF : ref->count;
+
+        for (size_t ct = 0; ct < cmpTileNo; ct++) {
+            cursors[ct] = row[ct].begin;
+        }
+
+        for (size_t i = rt * SEARCH_TILE_REF; i < refEnd; i++) {
+            for (size_t ct = 0; ct < cmpTileNo; ct++) {
+                const SearchHit *seg = search.buffers[row[ct].worker].sorted.hits;
+                size_t           end = row[ct].begin + row[ct].cnt;
+
+                for (; cursors[ct] < end && seg[cursors[ct]].refIdx == i; cursors[ct]++) {
+                    const SearchHit *hit = &seg[cursors[ct]];
+                    sink(ctx, ref->ids[hit->refIdx], cmp->ids[hit->cmpIdx],
+                         searchCoeff(cfg, ref->weights[hit->refIdx],
+                                     cmp->weights[hit->cmpIdx], hit->cntC));
+                    hits++;
+                }
+            }
+        }
+    }
+
+    for (unsigned int w = 0; w < threadNo; w++) {
+        free(search.buffers[w].sorted.hits);
+        free(search.buffers[w].tile.hits);
+    }
+    free(search.buffers);
+    free(search.tiles);
+    free(cursors);
+    free(schedule);
+    if (search.windows) {
+        free(windows.lo);
+        free(windows.hi);
+    }
+    if (search.suffix) {
+        free(suffix.ref);
+        if (!self) {
+            free(suffix.cmp);
+        }
+    }
+    if (search.sparse) {
+        sparseRowsFree(&sparse);
+    }
+    if (search.folds) {
+        free(folds.ref);
+        if (!self) {
+            free(folds.cmp);
+        }
+    }
+
+    if (error) {
+        fprintf(stderr, "Hit buffer allocation failed, results are incomplete\n");
+    }
+
+    if (stats) {
+        stats->pairs      = pairs;
+        stats->pruned     = pruned;
+        stats->terminated = terminated;
+        stats->hits       = hits;
+    }
+
+    return error ? -1 : 0;
+}
+
+
+int searchParallel(const FingerprintStore *ref,
+                   const FingerprintStore *cmp,
+                   const SearchConfig *cfg,
+                   HitSink sink, void *ctx,
+                   SearchStats *stats)
+{
+    return runParallel(ref, cmp, cfg, false, sink, ctx, stats);
+}
+
+
+int searchSelf(const FingerprintStore *store,
+               const SearchConfig *cfg,
+               HitSink sink, void *ctx,
+               SearchStats *stats)
+{
+    return runParallel(store, store, cfg, true, sink, ctx, stats);
+}
+
+
+/*
+ * Function: idFileSinkFlush
+ * Write buffered ID pairs to the output file.
+ */
+static void idFileSinkFlush(IDFileSink *sink)
+{
+    if (sink->cnt == 0 || sink->error) {
+        sink->cnt = 0;
+        return;
+    }
+
+    size_t written = fwrite(sink->buf, sizeof(uint32_t), sink->cnt * 2, sink->fp);
+    if (written != sink->cnt * 2) {
+        perror("Failed to write ID pairs");
+        sink->error = 1;
+    }
+
+    sink->cnt = 0;
+}
+
+
+/*
+ * Function: idFileSinkOpen
+ * Open filename for writing, returns 0 on success.
+ */
+int idFileSinkOpen(IDFileSink *sink, const char *filename)
+{
+    sink->cnt   = 0;
+    sink->error = 0;
+    sink->fp    = fopen(filename, "wb");
+    if (!sink->fp) {
+        perror("Failed to open output file");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Function: idFileSinkPush
+ * HitSink callback, ctx is an IDFileSink opened with idFileSinkOpen().
+ */
+void idFileSinkPush(void *ctx, uint32_t refID, uint32_t cmpID, double coeff)
+{
+    IDFileSink *sink = (IDFileSink *)ctx;
+    (void)coeff;
+
+    sink->buf[2*sink->cnt]   = refID;
+    sink->buf[2*sink->cnt+1] = cmpID;
+    sink->cnt++;
+
+    if (sink->cnt == ID_FILE_SINK_PAIRS) {
+        idFileSinkFlush(sink);
+    }
+}
+
+
+/*
+ * Function: idFileSinkClose
+ * Flush remaining pairs and close the file, returns 0 if every write
+ * succeeded.
+ */
+int idFileSinkClose(IDFileSink *sink)
+{
+    idFileSinkFlush(sink);
+
+    if (fclose(sink->fp) != 0) {
+        perror("Failed to close output file");
+        sink->error = 1;
+    }
+    sink->fp = NULL;
+
+    return sink->error ? -1 : 0;
+}
+
+
+/*
+ * Function: printSink
+ * HitSink callback, prints the ID pair and the coefficient of a hit.
+ */
+void printSink(void *ctx, uint32_t refID, uint32_t cmpID, double coeff)
+{
+    (void)ctx;
+    printf("refID:\t0x%08x\tcmpID:\t0x%08x\tcoeff:\t%f\n", refID, cmpID, coeff);
+}
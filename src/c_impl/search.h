@@ -0,0 +1,225 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include "tanimoto.h"
+#include "threshold.h"
+#include "sparse.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Streaming all-pairs search. CNT(A & B) is computed on the fly for every
+ * ref-cmp pair, the threshold is applied immediately and only the passing
+ * ID pairs are handed to a sink. Nothing is stored per pair, memory use is
+ * O(ref + cmp) plus whatever the sink keeps.
+ */
+
+/*
+ * Match criterion. MATCH_DISSIMILAR is what the accelerator reports (and
+ * computeTanimotoSimilarity() returns): 1 - Tanimoto > threshold.
+ * MATCH_SIMILAR is the usual similarity search: Tanimoto >= threshold.
+ * MATCH_TABLE is MATCH_DISSIMILAR evaluated the way the accelerator does it,
+ * through the integer threshold table (see threshold.h), without division
+ * and bit exact with the hardware. threshold is ignored, table is used.
+ */
+typedef enum {
+    MATCH_DISSIMILAR = 0,
+    MATCH_SIMILAR,
+    MATCH_TABLE
+} MatchMode;
+
+typedef struct {
+    double                threshold;
+    MatchMode             mode;
+    unsigned int          threadNo;     /* searchParallel() only */
+    const WeightBuckets  *cmpBuckets;   /* cmp is sorted by weight, see below */
+    const ThresholdTable *table;        /* MATCH_TABLE only */
+    unsigned int          foldBits;     /* 64 or 128: folded prefilter, see searchParallel(), 0: off */
+    SparseMode            sparse;       /* Sparse cmp rows, see searchParallel() */
+} SearchConfig;
+
+/* Called once for every matching pair, coeff is the value compared against
+ * the threshold (dissimilarity or similarity, depending on the mode) */
+typedef void (*HitSink)(void *ctx, uint32_t refID, uint32_t cmpID, double coeff);
+
+typedef struct {
+    uint64_t pairs;         /* Number of ref-cmp pairs searched */
+    uint64_t pruned;        /* Pairs skipped by the weight or fold bound, never counted */
+    uint64_t terminated;    /* Pairs abandoned part way by a running bound */
+    uint64_t hits;          /* Number of pairs passed to the sink */
+} SearchStats;
+
+/* Value of a pair in the unit of the threshold */
+static inline double searchCoeff(const SearchConfig *cfg, uint32_t cntA, uint32_t cntB, uint32_t cntC)
+{
+    double coeff = computeTanimotoSimilarity(cntA, cntB, cntC);
+    return cfg->mode == MATCH_SIMILAR ? 1.0 - coeff : coeff;
+}
+
+/*
+ * Whether a pair matches cfg. Only MATCH_TABLE avoids the division, the
+ * coefficient of its hits is computed once, when they reach the sink.
+ */
+static inline bool searchMatch(const SearchConfig *cfg, uint32_t cntA, uint32_t cntB, uint32_t cntC)
+{
+    switch (cfg->mode) {
+        case MATCH_TABLE:
+            return thresholdTableMatch(cfg->table, cntA, cntB, cntC);
+        case MATCH_SIMILAR:
+            return searchCoeff(cfg, cntA, cntB, cntC) >= cfg->threshold;
+        default:
+            return searchCoeff(cfg, cntA, cntB, cntC) > cfg->threshold;
+    }
+}
+
+/*
+ * Running bound on CNT(A & B). While a pair is being counted, with cntC
+ * bits of A & B found so far and at most rest more to come (the smaller of
+ * the weights of A and B left to count), its outcome may already be fixed.
+ * searchPairLimit() turns the criterion into an integer limit for weights
+ * a, b. The limit is conservative, a pair it keeps alive may still fail
+ * searchMatch() on its full count, but no hit is ever dropped:
+ * MATCH_SIMILAR    - CNT(A & B) needed for a match, the pair is alive while
+ *                    cntC + rest >= limit
+ * MATCH_DISSIMILAR - CNT(A & B) from which it never matches, the pair is
+ *                    alive while cntC < limit
+ * MATCH_TABLE      - no bound, the table need not be monotone
+ */
+static inline uint32_t searchPairLimit(const SearchConfig *cfg, uint32_t a, uint32_t b)
+{
+    double t = cfg->threshold;
+    double x;
+
+    // Real solutions of the criteria, kept one count (two when rounding up)
+    // on the safe side, far more than the rounding error of either
+    switch (cfg->mode) {
+        case MATCH_SIMILAR:     // c / (a + b - c) >= t
+            x = ((double)a + b) * (t / (1.0 + t));
+            return x >= 1.0 ? (uint32_t)x - 1 : 0;
+        case MATCH_DISSIMILAR:  // c / (a + b - c) < 1 - t
+            x = ((double)a + b) * ((1.0 - t) / (2.0 - t));
+            return x >= 0.0 ? (uint32_t)x + 2 : 2;
+        default:
+            return 0;
+    }
+}
+
+static inline bool searchPairAlive(const SearchConfig *cfg, uint32_t limit, uint32_t cntC, uint32_t rest)
+{
+    switch (cfg->mode) {
+        case MATCH_SIMILAR:
+            return cntC + rest >= limit;
+        case MATCH_DISSIMILAR:
+            return cntC < limit;
+        default:
+            return true;
+    }
+}
+
+/*
+ * Compare every ref vector against every cmp vector, in the same order as
+ * computeAllTanimotoSimilarities(). Weights must already be computed.
+ * Every pair is evaluated (cfg->threadNo and cfg->cmpBuckets are ignored),
+ * this is the reference for searchParallel(). stats may be NULL.
+ */
+void searchStreaming(const FingerprintStore *ref,
+                     const FingerprintStore *cmp,
+                     const SearchConfig *cfg,
+                     HitSink sink, void *ctx,
+                     SearchStats *stats);
+
+/*
+ * Bulk version of searchStreaming(). The ref x cmp space is cut into
+ * SEARCH_TILE_REF x SEARCH_TILE_CMP cache blocked tiles, which are scheduled
+ * on cfg->threadNo threads by the work-stealing pool (see worksteal.h).
+ * Inside a tile CNT(A & B) is computed by the register-blocked
+ * popcntAndBlock() micro-kernel instead of pair by pair, specialized for the
+ * fingerprint width when possible (popcntAndBlockForWidth()). Every
+ * thread collects its hits in its own buffer, the buffers are merged after
+ * all tiles are done, and hits reach the sink in the same order as with
+ * searchStreaming(). Returns 0 on success, -1 if a hit buffer could not be
+ * allocated.
+ *
+ * Weight bound pruning (Swamidass-Baldi): CNT(A & B) <= min(|A|, |B|), so
+ * Tanimoto(A, B) <= min(|A|, |B|) / max(|A|, |B|). In MATCH_SIMILAR mode,
+ * if cmp is sorted by weight (fpStoreSortByWeight()) and cfg->cmpBuckets
+ * holds its buckets, every ref only visits the cmp rows in its window of
+ * possible weights, the rest are counted in stats->pruned. The result is
+ * the same as searchStreaming() over the sorted cmp store. Windows are
+ * applied per POPCNT_BLOCK_REF refs, sorting ref by weight as well keeps
+ * them tight. In MATCH_DISSIMILAR mode a bound can only prove a hit, not rule one out, so
+ * nothing is pruned (same for MATCH_TABLE).
+ *
+ * Early termination: in MATCH_SIMILAR mode, for fingerprints of at least
+ * SEARCH_BOUND_MIN_WIDTH bits, pairs are counted SEARCH_BOUND_WORDS words
+ * at a time instead of through the micro-kernel. The weight of every row
+ * from each such segment on is computed once per search, after every
+ * segment the running bound above is checked and pairs that can no longer
+ * reach the threshold are abandoned (stats->terminated). Hits are the same.
+ *
+ * Folded prefilter: in MATCH_SIMILAR mode, with cfg->foldBits set, every row
+ * is OR-folded to 64 or 128 bits once per search. Before a block of pairs is
+ * counted, an upper bound on CNT(A & B) of each pair is derived from the
+ * folds and the weights alone. Pairs that cannot reach the threshold are
+ * skipped without reading their rows (stats->pruned), the exact count only
+ * runs on the survivors. The bound is weak for dense fingerprints, whose
+ * folds are all ones, it pays off for sparse ones (e.g. ECFP).
+ *
+ * Sparse rows: with cfg->sparse SPARSE_ON, or SPARSE_AUTO and a cmp store
+ * sparse enough for sparseRowsPreferred(), the set bit positions of every
+ * cmp row are listed once per search (sparse.h) and pairs are counted by
+ * probing them in the dense ref row, instead of the micro-kernel. Any
+ * mode, any width up to SPARSE_MAX_WIDTH, early termination is off then.
+ */
+#define SEARCH_TILE_REF     64      // 64 padded 920-bit refs: 8 KiB, stay in L1
+#define SEARCH_TILE_CMP     1024
+#define SEARCH_BOUND_WORDS      32      // 4 cache lines between two checks of the bound
+#define SEARCH_BOUND_MIN_WIDTH  4096
+
+int searchParallel(const FingerprintStore *ref,
+                   const FingerprintStore *cmp,
+                   const SearchConfig *cfg,
+                   HitSink sink, void *ctx,
+                   SearchStats *stats);
+
+/*
+ * Self-join of one store: searchParallel(store, store) restricted to the
+ * pairs (i, j) with j > i, so every pair is evaluated once and the diagonal
+ * never. Only the tiles reaching above the diagonal are scheduled, the
+ * work-stealing pool balances the smaller tiles along it. Hits come in
+ * ref-major order, refID is always the row before cmpID. cfg->cmpBuckets,
+ * if set, are the buckets of store itself. stats->pairs counts the
+ * triangle. Returns 0 on success.
+ */
+int searchSelf(const FingerprintStore *store,
+               const SearchConfig *cfg,
+               HitSink sink, void *ctx,
+               SearchStats *stats);
+
+/*
+ * Buffered sink writing ID pairs in the writeIDsToFile() format:
+ * {refID[0], cmpID[0]} {refID[1], cmpID[1]} ... as raw uint32_t.
+ */
+#define ID_FILE_SINK_PAIRS 4096
+
+typedef struct {
+    FILE     *fp;
+    size_t    cnt;                          /* Pairs currently buffered */
+    int       error;                        /* Set when a write failed */
+    uint32_t  buf[ID_FILE_SINK_PAIRS * 2];
+} IDFileSink;
+
+int  idFileSinkOpen(IDFileSink *sink, const char *filename);
+void idFileSinkPush(void *ctx, uint32_t refID, uint32_t cmpID, double coeff);
+int  idFileSinkClose(IDFileSink *sink);
+
+/* Sink printing every hit to stdout, in the printResult() format */
+void printSink(void *ctx, uint32_t refID, uint32_t cmpID, double coeff);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SEARCH_H
@@ -0,0 +1,470 @@
+#include "tanimoto.h"
+#include "search.h"
+#include "threshold.h"
+#include "worksteal.h"
+#include "topk.h"
+#include "largefp.h"
+#include "sparse.h"
+#include "chunkread.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+ * Consistency test of the software search: every search path against
+ * searchStreaming(), which evaluates every pair, and searchTopK() against a
+ * brute-force ranking. Random fingerprints at widths around the kernel
+ * specializations and the early termination, sparse and large fingerprint
+ * limits, several densities, thresholds and all MatchModes. Half of the
+ * cmp rows are noisy copies of ref rows, so every threshold has hits.
+ * Fingerprint files and indexes with corrupt weights have to fail to map.
+ * Prints one line per failed check and a summary, returns 1 on failure.
+ */
+
+#define TEST_REF_NO         37      // not a multiple of the tile or micro-kernel blocks
+#define TEST_CMP_NO         301
+#define TEST_LARGE_CMP_NO   61      // cmp rows from SEARCH_BOUND_MIN_WIDTH bits on
+#define TEST_TOPK           5
+#define TEST_COEFF_EPS      1e-12
+
+static const uint32_t testWidths[]     = { 64, 920, 2048, 4100, 8192, 40000 };
+static const double   testDensities[]  = { 0.02, 0.1, 0.5 };
+static const double   testThresholds[] = { 0.3, 0.7 };
+
+typedef struct {
+    uint32_t refID;
+    uint32_t cmpID;
+    double   coeff;
+} Hit;
+
+typedef struct {
+    Hit    *hits;
+    size_t  count;
+    size_t  capacity;
+    int     error;
+} HitList;
+
+static unsigned int checkNo;
+static unsigned int failNo;
+
+
+/*
+ * Function: nextRandom
+ * xorshift64*, fixed seed: every run tests the same data.
+ */
+static uint64_t nextRandom(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static bool randomBit(uint64_t *state, double p)
+{
+    return (nextRandom(state) >> 11) < (uint64_t)(p * 9007199254740992.0);   // 2^53
+}
+
+
+/*
+ * Function: fillStores
+ * Every ref bit is set with probability density. Even cmp rows are random
+ * the same way, odd ones copies of a ref row with bits flipped at a rate
+ * growing along the rows, from identical to unrelated.
+ */
+static void fillStores(FingerprintStore *ref, FingerprintStore *cmp, double density, uint64_t *state)
+{
+    for (size_t i = 0; i < ref->count; i++) {
+        uint64_t *row = fpStoreRow(ref, i);
+        for (uint32_t bit = 0; bit < ref->width; bit++) {
+            if (randomBit(state, density)) {
+                row[bit / 64] |= 1ULL << (bit % 64);
+            }
+        }
+    }
+    for (size_t j = 0; j < cmp->count; j++) {
+        uint64_t       *row = fpStoreRow(cmp, j);
+        const uint64_t *src = fpStoreRow(ref, nextRandom(state) % ref->count);
+        double          flip = density * (double)j / (double)cmp->count;
+
+        for (uint32_t bit = 0; bit < cmp->width; bit++) {
+            bool set = j % 2 ? ((src[bit / 64] >> (bit % 64)) & 1) != randomBit(state, flip)
+                             : randomBit(state, density);
+            if (set) {
+                row[bit / 64] |= 1ULL << (bit % 64);
+            }
+        }
+    }
+
+    fpStoreAssignIDs(ref, 0);
+    fpStoreAssignIDs(cmp, 0);
+    fpStoreComputeWeights(ref);
+    fpStoreComputeWeights(cmp);
+}
+
+
+static void hitListPush(void *ctx, uint32_t refID, uint32_t cmpID, double coeff)
+{
+    HitList *list = (HitList *)ctx;
+
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? 2 * list->capacity : 1024;
+        Hit   *hits = (Hit *)realloc(list->hits, capacity * sizeof(Hit));
+        if (!hits) {
+            list->error = 1;
+            return;
+        }
+        list->hits = hits;
+        list->capacity = capacity;
+    }
+    list->hits[list->count++] = (Hit){ refID, cmpID, coeff };
+}
+
+static void hitListClear(HitList *list)
+{
+    list->count = 0;
+    list->error = 0;
+}
+
+static void hitListFree(HitList *list)
+{
+    free(list->hits);
+    memset(list, 0, sizeof(*list));
+}
+
+
+/*
+ * Function: check
+ * Count a check, report it if it failed.
+ */
+static void check(bool ok, const char *what, const char *path, uint32_t width, double density,
+                  const SearchConfig *cfg)
+{
+    checkNo++;
+    if (!ok) {
+        failNo++;
+        printf("FAIL %s %s: width %u, density %.2f, mode %d, threshold %.2f, fold %u, sparse %d\n",
+               path, what, width, density, (int)cfg->mode, cfg->threshold, cfg->foldBits, (int)cfg->sparse);
+    }
+}
+
+/*
+ * Function: sameHits
+ * Whether got holds the hits of expect in the same order, coefficients
+ * equal up to rounding.
+ */
+static bool sameHits(const HitList *expect, const HitList *got)
+{
+    if (expect->error || got->error || expect->count != got->count) {
+        return false;
+    }
+    for (size_t i = 0; i < expect->count; i++) {
+        const Hit *e = &expect->hits[i];
+        const Hit *g = &got->hits[i];
+        if (e->refID != g->refID || e->cmpID != g->cmpID || fabs(e->coeff - g->coeff) > TEST_COEFF_EPS) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/*
+ * Function: checkSearches
+ * searchParallel() with every option the mode takes, searchLargeStores()
+ * and searchSelf() against searchStreaming() over the same stores.
+ */
+static void checkSearches(const FingerprintStore *ref, const FingerprintStore *cmp, SearchConfig cfg,
+                          const WeightBuckets *buckets, double density)
+{
+    static const SparseMode sparseModes[] = { SPARSE_AUTO, SPARSE_OFF, SPARSE_ON };
+    static const unsigned int foldBits[]  = { 0, 64, 128 };
+    HitList expect = { 0 };
+    HitList got = { 0 };
+    uint32_t width = ref->width;
+
+    searchStreaming(ref, cmp, &cfg, hitListPush, &expect, NULL);
+
+    for (size_t s = 0; s < sizeof(sparseModes) / sizeof(sparseModes[0]); s++) {
+        for (size_t f = 0; f < sizeof(foldBits) / sizeof(foldBits[0]); f++) {
+            SearchConfig run = cfg;
+
+            if (foldBits[f] && cfg.mode != MATCH_SIMILAR) {
+                continue;       // the fold bound only rules out similar pairs
+            }
+            if (sparseModes[s] == SPARSE_ON && width > SPARSE_MAX_WIDTH) {
+                continue;
+            }
+            run.sparse   = sparseModes[s];
+            run.foldBits = foldBits[f];
+            run.cmpBuckets = cfg.mode == MATCH_SIMILAR ? buckets : NULL;
+
+            hitListClear(&got);
+            int error = searchParallel(ref, cmp, &run, hitListPush, &got, NULL);
+            check(!error && sameHits(&expect, &got), "hits", "searchParallel", width, density, &run);
+        }
+    }
+
+    if (!buckets) {
+        hitListClear(&got);
+        int error = searchLargeStores(ref, cmp, &cfg, hitListPush, &got, NULL);
+        check(!error && sameHits(&expect, &got), "hits", "searchLargeStores", width, density, &cfg);
+
+        // Self-join: the pairs of cmp x cmp above the diagonal
+        hitListClear(&expect);
+        searchStreaming(cmp, cmp, &cfg, hitListPush, &expect, NULL);
+        size_t above = 0;
+        for (size_t i = 0; i < expect.count; i++) {
+            if (expect.hits[i].refID < expect.hits[i].cmpID) {
+                expect.hits[above++] = expect.hits[i];
+            }
+        }
+        expect.count = above;
+
+        hitListClear(&got);
+        error = searchSelf(cmp, &cfg, hitListPush, &got, NULL);
+        check(!error && sameHits(&expect, &got), "hits", "searchSelf", width, density, &cfg);
+    }
+
+    hitListFree(&expect);
+    hitListFree(&got);
+}
+
+
+static int compareNeighbours(const void *a, const void *b)
+{
+    const Neighbour *x = (const Neighbour *)a;
+    const Neighbour *y = (const Neighbour *)b;
+
+    if (x->similarity != y->similarity) {
+        return x->similarity < y->similarity ? 1 : -1;
+    }
+    return x->id < y->id ? -1 : x->id > y->id;
+}
+
+/*
+ * Function: checkTopK
+ * searchTopK() against every pair counted bit by bit, ranked by similarity
+ * and ID, cut at TEST_TOPK and the threshold.
+ */
+static void checkTopK(const FingerprintStore *ref, const FingerprintStore *cmp, SearchConfig cfg,
+                      const WeightBuckets *buckets, double density)
+{
+    TopKResults results;
+    Neighbour  *all = (Neighbour *)malloc(cmp->count * sizeof(Neighbour));
+    bool        ok;
+
+    cfg.cmpBuckets = buckets;
+    ok = all && searchTopK(ref, cmp, &cfg, TEST_TOPK, &results, NULL) == 0;
+    if (!ok) {
+        check(false, "run", "searchTopK", ref->width, density, &cfg);
+        free(all);
+        return;
+    }
+
+    for (size_t i = 0; i < ref->count && ok; i++) {
+        const uint64_t *a = fpStoreRow(ref, i);
+        size_t          n = 0;
+
+        for (size_t j = 0; j < cmp->count; j++) {
+            const uint64_t *b = fpStoreRow(cmp, j);
+            uint32_t        cntC = 0;
+
+            for (uint32_t w = 0; w < ref->stride; w++) {
+                cntC += (uint32_t)__builtin_popcountll(a[w] & b[w]);
+            }
+            double similarity = 1.0 - computeTanimotoSimilarity(ref->weights[i], cmp->weights[j], cntC);
+            if (similarity >= cfg.threshold) {
+                all[n++] = (Neighbour){ cmp->ids[j], similarity };
+            }
+        }
+        qsort(all, n, sizeof(Neighbour), compareNeighbours);
+        if (n > TEST_TOPK) {
+            n = TEST_TOPK;
+        }
+
+        ok = results.refIDs[i] == ref->ids[i] && results.counts[i] == n;
+        for (size_t r = 0; r < n && ok; r++) {
+            const Neighbour *got = &results.neighbours[i * TEST_TOPK + r];
+            ok = got->id == all[r].id && fabs(got->similarity - all[r].similarity) <= TEST_COEFF_EPS;
+        }
+    }
+    check(ok, "neighbours", "searchTopK", ref->width, density, &cfg);
+
+    topKResultsFree(&results);
+    free(all);
+}
+
+
+/*
+ * Function: checkStores
+ * All searches on one pair of stores, every mode and threshold, first in
+ * row order, then sorted by weight with the cmp buckets for pruning.
+ */
+static void checkStores(FingerprintStore *ref, FingerprintStore *cmp, double density)
+{
+    static const MatchMode modes[] = { MATCH_DISSIMILAR, MATCH_SIMILAR, MATCH_TABLE };
+    WeightBuckets buckets;
+
+    for (int sorted = 0; sorted < 2; sorted++) {
+        if (sorted) {
+            if (fpStoreSortByWeight(ref, NULL) != 0 || fpStoreSortByWeight(cmp, &buckets) != 0) {
+                check(false, "sort", "fpStoreSortByWeight", ref->width, density, &(SearchConfig){ 0 });
+                return;
+            }
+        }
+
+        for (size_t t = 0; t < sizeof(testThresholds) / sizeof(testThresholds[0]); t++) {
+            for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+                SearchConfig   cfg = { testThresholds[t], modes[m], workStealDefaultThreads(), NULL, NULL, 0, SPARSE_AUTO };
+                ThresholdTable table;
+
+                if (modes[m] == MATCH_TABLE) {
+                    if (thresholdTableInit(&table, ref->width, (float)testThresholds[t]) != 0) {
+                        check(false, "init", "thresholdTableInit", ref->width, density, &cfg);
+                        continue;
+                    }
+                    cfg.table = &table;
+                }
+
+                checkSearches(ref, cmp, cfg, sorted ? &buckets : NULL, density);
+                if (modes[m] == MATCH_SIMILAR) {
+                    checkTopK(ref, cmp, cfg, sorted ? &buckets : NULL, density);
+                }
+
+                if (modes[m] == MATCH_TABLE) {
+                    thresholdTableFree(&table);
+                }
+            }
+        }
+    }
+    weightBucketsFree(&buckets);
+}
+
+
+/*
+ * Function: patchWeight
+ * Overwrite the weight of one row of a fingerprint file in place.
+ */
+static int patchWeight(const char *filename, size_t row, uint32_t weight)
+{
+    FingerprintFileHeader header;
+    int                   fd;
+    int                   error;
+
+    if (fpStoreReadFileHeader(filename, &header) != 0 || (fd = open(filename, O_WRONLY)) < 0) {
+        return -1;
+    }
+    error = pwrite(fd, &weight, sizeof(weight), (off_t)(header.weightsOffset + row * sizeof(uint32_t)))
+            != (ssize_t)sizeof(weight);
+    close(fd);
+    return error ? -1 : 0;
+}
+
+/*
+ * Function: checkFiles
+ * A written file maps, the same file with a weight above the width does
+ * not, whether the weight is in the mapped rows or not decides. An index
+ * maps, the same index with a row outside its bucket's weight does not.
+ */
+static void checkFiles(uint64_t *state)
+{
+    char                    filename[] = "/tmp/search_test_XXXXXX";
+    const SearchConfig      cfg = { 0 };
+    FingerprintStore        ref, cmp, mapped;
+    const FingerprintStore *stores[2] = { &ref, &cmp };
+    int                     fd = mkstemp(filename);
+
+    if (fd < 0 || fpStoreInit(&ref, TEST_REF_NO, 920) != 0 || fpStoreInit(&cmp, TEST_CMP_NO, 920) != 0) {
+        check(false, "setup", "fpStoreMapFile", 920, 0.1, &cfg);
+        return;
+    }
+    close(fd);
+    fillStores(&ref, &cmp, 0.1, state);
+
+    check(fpStoreWriteFile(filename, stores, 2) == 0, "write", "fpStoreWriteFile", 920, 0.1, &cfg);
+    check(fpStoreMapFile(&mapped, filename, 0, FP_STORE_ALL) == 0, "valid file", "fpStoreMapFile", 920, 0.1, &cfg);
+    fpStoreFree(&mapped);
+
+    // One weight past the width in a cmp row: the cmp rows fail, the refs still map
+    check(patchWeight(filename, TEST_REF_NO + 3, 5000000) == 0, "patch", "fpStoreMapFile", 920, 0.1, &cfg);
+    check(fpStoreMapFile(&mapped, filename, TEST_REF_NO, FP_STORE_ALL) != 0, "corrupt weight", "fpStoreMapFile",
+          920, 0.1, &cfg);
+    check(fpStoreMapFile(&mapped, filename, 0, TEST_REF_NO) == 0, "rows before a corrupt weight", "fpStoreMapFile",
+          920, 0.1, &cfg);
+    fpStoreFree(&mapped);
+
+    // Streamed in chunks the chunks before it still come, then the reader fails
+    ChunkReader             reader;
+    const FingerprintStore *chunk;
+    int                     result;
+
+    check(chunkReaderOpen(&reader, filename, TEST_REF_NO, FP_STORE_ALL, 2) == 0, "open", "chunkReaderOpen",
+          920, 0.1, &cfg);
+    check((result = chunkReaderNext(&reader, &chunk)) == 1, "chunk before a corrupt weight", "chunkReaderNext",
+          920, 0.1, &cfg);
+    while (result > 0) {
+        result = chunkReaderNext(&reader, &chunk);
+    }
+    check(result < 0, "corrupt weight", "chunkReaderNext", 920, 0.1, &cfg);
+    chunkReaderClose(&reader);
+
+    // The width is the largest valid weight, one above it fails
+    check(patchWeight(filename, TEST_REF_NO + 3, 920) == 0, "patch", "fpStoreMapFile", 920, 0.1, &cfg);
+    check(fpStoreMapFile(&mapped, filename, 0, FP_STORE_ALL) == 0, "weight width", "fpStoreMapFile",
+          920, 0.1, &cfg);
+    fpStoreFree(&mapped);
+    check(patchWeight(filename, TEST_REF_NO + 3, 921) == 0, "patch", "fpStoreMapFile", 920, 0.1, &cfg);
+    check(fpStoreMapFile(&mapped, filename, 0, FP_STORE_ALL) != 0, "weight width + 1", "fpStoreMapFile",
+          920, 0.1, &cfg);
+
+    // An index whose buckets disagree with the weights of their rows
+    WeightBuckets buckets, mappedBuckets;
+
+    check(fpStoreSortByWeight(&cmp, &buckets) == 0 && fpStoreWriteIndex(filename, &cmp, &buckets) == 0,
+          "write index", "fpStoreWriteIndex", 920, 0.1, &cfg);
+    check(fpStoreMapIndex(&mapped, &mappedBuckets, filename) == 0, "valid index", "fpStoreMapIndex",
+          920, 0.1, &cfg);
+    weightBucketsFree(&mappedBuckets);
+    fpStoreFree(&mapped);
+
+    check(patchWeight(filename, 0, cmp.weights[0] + 1) == 0, "patch", "fpStoreMapIndex", 920, 0.1, &cfg);
+    check(fpStoreMapIndex(&mapped, &mappedBuckets, filename) != 0, "bucket weight", "fpStoreMapIndex",
+          920, 0.1, &cfg);
+    weightBucketsFree(&buckets);
+
+    unlink(filename);
+    fpStoreFree(&ref);
+    fpStoreFree(&cmp);
+}
+
+
+int main(void)
+{
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+
+    for (size_t w = 0; w < sizeof(testWidths) / sizeof(testWidths[0]); w++) {
+        for (size_t d = 0; d < sizeof(testDensities) / sizeof(testDensities[0]); d++) {
+            FingerprintStore ref, cmp;
+            size_t           cmpNo = testWidths[w] >= SEARCH_BOUND_MIN_WIDTH ? TEST_LARGE_CMP_NO : TEST_CMP_NO;
+
+            if (fpStoreInit(&ref, TEST_REF_NO, testWidths[w]) != 0 || fpStoreInit(&cmp, cmpNo, testWidths[w]) != 0) {
+                fprintf(stderr, "Failed to allocate the test stores.\n");
+                return 1;
+            }
+            fillStores(&ref, &cmp, testDensities[d], &state);
+            checkStores(&ref, &cmp, testDensities[d]);
+            fpStoreFree(&ref);
+            fpStoreFree(&cmp);
+        }
+        printf("width %5u: %u checks, %u failed\n", testWidths[w], checkNo, failNo);
+    }
+
+    checkFiles(&state);
+    printf("fingerprint files: %u checks, %u failed\n", checkNo, failNo);
+
+    printf("%s: %u checks, %u failed\n", failNo ? "FAILED" : "PASSED", checkNo, failNo);
+    return failNo ? 1 : 0;
+}
@@ -0,0 +1,223 @@
+#include "sparse.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SPARSE_X86
+#endif
+
+static uint32_t sparseProbeScalar(const uint64_t *a, const uint16_t *bits, size_t n)
+{
+    uint32_t cnt = 0;
+
+    for (size_t k = 0; k < n; k++) {
+        cnt += (uint32_t)(a[bits[k] >> 6] >> (bits[k] & 63)) & 1;
+    }
+
+    return cnt;
+}
+
+static void sparseProbeBlockScalar(const uint64_t *a, size_t stride, const uint16_t *bits, size_t n,
+                                   uint32_t *cnt)
+{
+    uint32_t c0 = 0, c1 = 0, c2 = 0, c3 = 0;
+
+    for (size_t k = 0; k < n; k++) {
+        size_t   word  = bits[k] >> 6;
+        unsigned shift = bits[k] & 63;
+
+        c0 += (uint32_t)(a[word] >> shift) & 1;
+        c1 += (uint32_t)(a[stride + word] >> shift) & 1;
+        c2 += (uint32_t)(a[2 * stride + word] >> shift) & 1;
+        c3 += (uint32_t)(a[3 * stride + word] >> shift) & 1;
+    }
+
+    cnt[0] = c0;
+    cnt[1] = c1;
+    cnt[2] = c2;
+    cnt[3] = c3;
+}
+
+#ifdef SPARSE_X86
+
+/*
+ * Function: sparseProbeAvx512
+ * 16 positions per step: widened to 32 bits, the 32-bit word of a holding
+ * each one is gathered and shifted down to the bit. The tail is masked, so
+ * nothing past the list or the row is read.
+ */
+static __attribute__((target("avx512f,avx512bw,avx512vl")))
+uint32_t sparseProbeAvx512(const uint64_t *a, const uint16_t *bits, size_t n)
+{
+    const int *words = (const int *)a;
+    __m512i    one   = _mm512_set1_epi32(1);
+    __m512i    low   = _mm512_set1_epi32(31);
+    __m512i    acc   = _mm512_setzero_si512();
+
+    for (size_t k = 0; k < n; k += 16) {
+        __mmask16 mask = n - k >= 16 ? (__mmask16)0xffff : (__mmask16)((1u << (n - k)) - 1);
+        __m512i   pos  = _mm512_cvtepu16_epi32(_mm256_maskz_loadu_epi16(mask, bits + k));
+        __m512i   word = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), mask,
+                                                     _mm512_srli_epi32(pos, 5), words, 4);
+
+        word = _mm512_srlv_epi32(word, _mm512_and_si512(pos, low));
+        acc  = _mm512_add_epi32(acc, _mm512_and_si512(word, one));
+    }
+
+    return (uint32_t)_mm512_reduce_add_epi32(acc);
+}
+
+/*
+ * Function: sparseProbeBlockAvx512
+ * The positions are loaded and split into word index and shift once, then
+ * gathered from all four rows.
+ */
+static __attribute__((target("avx512f,avx512bw,avx512vl")))
+void sparseProbeBlockAvx512(const uint64_t *a, size_t stride, const uint16_t *bits, size_t n,
+                            uint32_t *cnt)
+{
+    const int *words = (const int *)a;
+    __m512i    one   = _mm512_set1_epi32(1);
+    __m512i    low   = _mm512_set1_epi32(31);
+    __m512i    acc[4];
+
+    for (int r = 0; r < 4; r++) {
+        acc[r] = _mm512_setzero_si512();
+    }
+
+    for (size_t k = 0; k < n; k += 16) {
+        __mmask16 mask  = n - k >= 16 ? (__mmask16)0xffff : (__mmask16)((1u << (n - k)) - 1);
+        __m512i   pos   = _mm512_cvtepu16_epi32(_mm256_maskz_loadu_epi16(mask, bits + k));
+        __m512i   index = _mm512_srli_epi32(pos, 5);
+        __m512i   shift = _mm512_and_si512(pos, low);
+
+        for (int r = 0; r < 4; r++) {
+            __m512i word = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), mask, index,
+                                                       words + 2 * r * stride, 4);
+            acc[r] = _mm512_add_epi32(acc[r], _mm512_and_si512(_mm512_srlv_epi32(word, shift), one));
+        }
+    }
+
+    for (int r = 0; r < 4; r++) {
+        cnt[r] = (uint32_t)_mm512_reduce_add_epi32(acc[r]);
+    }
+}
+
+#endif // SPARSE_X86
+
+typedef uint32_t (*SparseProbeFn)(const uint64_t *a, const uint16_t *bits, size_t n);
+typedef void     (*SparseProbeBlockFn)(const uint64_t *a, size_t stride, const uint16_t *bits, size_t n,
+                                       uint32_t *cnt);
+
+static SparseProbeFn       sparseProbeImpl      = sparseProbeScalar;
+static SparseProbeBlockFn  sparseProbeBlockImpl = sparseProbeBlockScalar;
+static const char         *sparseKernel         = "scalar";
+
+/*
+ * Function: selectSparseKernel
+ * Runs before main(), as selectPopcntKernel() does.
+ */
+__attribute__((constructor))
+static void selectSparseKernel(void)
+{
+#ifdef SPARSE_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+        __builtin_cpu_supports("avx512vl")) {
+        sparseProbeImpl      = sparseProbeAvx512;
+        sparseProbeBlockImpl = sparseProbeBlockAvx512;
+        sparseKernel         = "avx512-gather";
+    }
+#endif
+}
+
+uint32_t sparseProbe(const uint64_t *a, const uint16_t *bits, size_t n)
+{
+    return sparseProbeImpl(a, bits, n);
+}
+
+void sparseProbeBlock(const uint64_t *a, size_t stride, const uint16_t *bits, size_t n, uint32_t *cnt)
+{
+    sparseProbeBlockImpl(a, stride, bits, n, cnt);
+}
+
+const char *sparseKernelName(void)
+{
+    return sparseKernel;
+}
+
+
+/*
+ * Function: sparseRowsPreferred
+ */
+bool sparseRowsPreferred(const FingerprintStore *store)
+{
+    uint64_t weight = 0;
+
+    if (store->count == 0 || store->width < SPARSE_MIN_WIDTH || store->width > SPARSE_MAX_WIDTH) {
+        return false;
+    }
+    for (size_t i = 0; i < store->count; i++) {
+        weight += store->weights[i];
+    }
+
+    return weight * SPARSE_DENSITY_DIV <= (uint64_t)store->count * store->width;
+}
+
+
+/*
+ * Function: sparseRowsBuild
+ * The weights size the lists, the positions are then read off the words
+ * lowest bit first, which leaves them ascending.
+ */
+int sparseRowsBuild(SparseRows *rows, const FingerprintStore *store)
+{
+    memset(rows, 0, sizeof(*rows));
+    if (store->width > SPARSE_MAX_WIDTH) {
+        fprintf(stderr, "Sparse rows hold widths up to %u bits, not %u\n", SPARSE_MAX_WIDTH, store->width);
+        return -1;
+    }
+
+    rows->count   = store->count;
+    rows->width   = store->width;
+    rows->offsets = (uint64_t *)malloc((store->count + 1) * sizeof(uint64_t));
+    if (!rows->offsets) {
+        fprintf(stderr, "Failed to allocate sparse rows\n");
+        return -1;
+    }
+
+    rows->offsets[0] = 0;
+    for (size_t i = 0; i < store->count; i++) {
+        rows->offsets[i + 1] = rows->offsets[i] + store->weights[i];
+    }
+
+    rows->bits = (uint16_t *)malloc((rows->offsets[store->count] + 1) * sizeof(uint16_t));
+    if (!rows->bits) {
+        fprintf(stderr, "Failed to allocate sparse rows\n");
+        sparseRowsFree(rows);
+        return -1;
+    }
+
+    for (size_t i = 0; i < store->count; i++) {
+        const uint64_t *row = fpStoreRow(store, i);
+        uint16_t       *dst = rows->bits + rows->offsets[i];
+
+        for (uint32_t w = 0; w < store->stride; w++) {
+            for (uint64_t word = row[w]; word; word &= word - 1) {
+                *dst++ = (uint16_t)(w * 64 + (uint32_t)__builtin_ctzll(word));
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+void sparseRowsFree(SparseRows *rows)
+{
+    free(rows->offsets);
+    free(rows->bits);
+    memset(rows, 0, sizeof(*rows));
+}
@@ -0,0 +1,87 @@
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "fpstore.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Sparse fingerprint rows
+ * Row i of a store as the ascending list of its set bit positions:
+ *
+ * offsets  - count + 1 entries, row i at bits[offsets[i], offsets[i + 1])
+ * bits     - 16-bit set bit positions, so widths up to SPARSE_MAX_WIDTH
+ *
+ * CNT(A & B) is then the number of positions of B that are set in the dense
+ * row of A: one (gathered) bit test per set bit of B instead of a popcount
+ * over every word, and B is read at 2 bytes per set bit. The rows follow
+ * the store they were built from (same order, IDs and weights are the
+ * store's).
+ */
+
+#define SPARSE_MAX_WIDTH    65536
+
+/*
+ * Sparse rows are used for a store of at least SPARSE_MIN_WIDTH bits whose
+ * mean weight is at most width / SPARSE_DENSITY_DIV: position lists of at
+ * most 1/16 of the dense row bytes. A gathered bit test costs about as much
+ * as 128 bits of the blocked popcount kernels, plus a fixed cost per pair,
+ * denser or narrower rows are faster dense.
+ */
+#define SPARSE_MIN_WIDTH    4096
+#define SPARSE_DENSITY_DIV  256
+
+typedef enum {
+    SPARSE_AUTO = 0,            /* Sparse rows if sparseRowsPreferred() */
+    SPARSE_OFF,
+    SPARSE_ON
+} SparseMode;
+
+typedef struct {
+    size_t     count;
+    uint32_t   width;
+    uint64_t  *offsets;
+    uint16_t  *bits;
+} SparseRows;
+
+/* Whether store is sparse enough for sparse rows, from its weights */
+bool sparseRowsPreferred(const FingerprintStore *store);
+
+/* Set bit positions of every row of store, weights computed. Returns 0 on success. */
+int  sparseRowsBuild(SparseRows *rows, const FingerprintStore *store);
+
+void sparseRowsFree(SparseRows *rows);
+
+/* Positions of row idx, *n of them */
+static inline const uint16_t *sparseRow(const SparseRows *rows, size_t idx, size_t *n)
+{
+    *n = (size_t)(rows->offsets[idx + 1] - rows->offsets[idx]);
+    return rows->bits + rows->offsets[idx];
+}
+
+/*
+ * CNT(A & B) for the dense row a and the n positions of B: the number of
+ * positions set in a. AVX-512 gathers 16 positions at a time if the CPU has
+ * it, scalar bit tests otherwise.
+ */
+uint32_t sparseProbe(const uint64_t *a, const uint16_t *bits, size_t n);
+
+/*
+ * sparseProbe() of the same positions in POPCNT_BLOCK_REF (4) dense rows
+ * starting at a, stride 64-bit words apart: cnt[r] for row r.
+ */
+void sparseProbeBlock(const uint64_t *a, size_t stride, const uint16_t *bits, size_t n, uint32_t *cnt);
+
+/* Human readable name of the sparseProbe() kernels, for logs */
+const char *sparseKernelName(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SPARSE_H
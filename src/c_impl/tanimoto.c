@@ -1,65 +1,198 @@
 #include "tanimoto.h"
 #include "test.h"
+#include "popcnt.h"
+#include "search.h"
 #include <stdbool.h>
+#include <string.h>
 
 /*
- * Declare global arrays. Functions defined within this file assume the
- * presence of these global arrays to work. Declared as extern in tanimoto.h
+ * Declare global vector stores. Functions defined within this file assume the
+ * presence of these globals to work. Declared as extern in tanimoto.h
  */
-BinaryVector referenceVectors[REF_VECTOR_NO];
-BinaryVector comparisonVectors[CMP_VECTOR_NO];
-BinaryVector intermediaryVectors[REF_VECTOR_NO*CMP_VECTOR_NO];
+FingerprintStore referenceVectors;
+FingerprintStore comparisonVectors;
+WeightBuckets    comparisonIndex;
 
-TanimotoResult tanimotoResults[REF_VECTOR_NO*CMP_VECTOR_NO];
+TanimotoResult *tanimotoResults = NULL;
 
 /* 
  * Function: initVectors
- * Initializes the 115-byte data fields of the global reference and comparison
- * vectors with random values to be used for testing.
+ * Allocates refNo reference and cmpNo comparison vectors of width bits, and
+ * fills their data with random values to be used for testing. The
+ * hard-coded test data only exists for the default vector counts and
+ * VECTOR_WIDTH.
  * ID assigned is the same as hardware. ID == 0 is reserved for the accelerator.
  * Weights are initialized to 0 as they are calculated later.
  */
-void initVectors(bool generate)
+int initVectors(size_t refNo, size_t cmpNo, uint32_t width, bool generate)
 {
     srand((unsigned) time(NULL));
 
+    if (!generate && (refNo != DEFAULT_REF_VECTOR_NO || cmpNo != DEFAULT_CMP_VECTOR_NO ||
+                      width != VECTOR_WIDTH)) {
+        fprintf(stderr, "Hard-coded test data is only available for %d ref and %d cmp vectors of %d bits.\n",
+                DEFAULT_REF_VECTOR_NO, DEFAULT_CMP_VECTOR_NO, VECTOR_WIDTH);
+        return -1;
+    }
+
+    if (width == 0) {
+        fprintf(stderr, "Vector width must be at least 1 bit.\n");
+        return -1;
+    }
+
+    if (fpStoreInit(&referenceVectors, refNo, width) ||
+        fpStoreInit(&comparisonVectors, cmpNo, width)) {
+        freeVectors();
+        return -1;
+    }
+
     if (generate) {
-        /* Initialize reference vectors */
-        for (int i = 0; i < REF_VECTOR_NO; i++) {
-            referenceVectors[i].id = i+1;
-            referenceVectors[i].weight = 0;
+        size_t   rowBytes = fpStoreRowBytes(&referenceVectors);
+        uint8_t *data     = (uint8_t *)malloc(rowBytes);
+        if (!data) {
+            fprintf(stderr, "Failed to allocate vector buffer\n");
+            freeVectors();
+            return -1;
+        }
 
-            for (int j = 0; j < 115; j++) {
-                referenceVectors[i].data[j] = (uint8_t)(rand() % 256);
+        /* Initialize reference vectors */
+        for (size_t i = 0; i < refNo; i++) {
+            for (size_t j = 0; j < rowBytes; j++) {
+                data[j] = (uint8_t)(rand() % 256);
             }
+            fpStoreSetRow(&referenceVectors, i, data);
         }
 
         /* Initialize comparison vectors */
-        for (int i = 0; i < CMP_VECTOR_NO; i++) {
-            comparisonVectors[i].id = i + REF_VECTOR_NO + 1;
-            comparisonVectors[i].weight = 0;
-
-            for (int j = 0; j < 115; j++) {
-                comparisonVectors[i].data[j] = (uint8_t)(rand() % 256);
+        for (size_t i = 0; i < cmpNo; i++) {
+            for (size_t j = 0; j < rowBytes; j++) {
+                data[j] = (uint8_t)(rand() % 256);
             }
+            fpStoreSetRow(&comparisonVectors, i, data);
         }
+
+        free(data);
+
+        fpStoreAssignIDs(&referenceVectors, 1);
+        fpStoreAssignIDs(&comparisonVectors, (uint32_t)refNo + 1);
     } else {
         /* Use hard-coded test data */
-        for(int i = 0; i < 8; i++){
-            referenceVectors[i] = testReferenceVectors[i];
+        for (size_t i = 0; i < refNo; i++) {
+            fpStoreSetRow(&referenceVectors, i, testReferenceVectors[i].data);
+            referenceVectors.ids[i] = testReferenceVectors[i].id;
         }
 
-        for(int i = 0; i < 24; i++){
-            comparisonVectors[i] = testComparisonVectors[i];
+        for (size_t i = 0; i < cmpNo; i++) {
+            fpStoreSetRow(&comparisonVectors, i, testComparisonVectors[i].data);
+            comparisonVectors.ids[i] = testComparisonVectors[i].id;
         }
     }
+
+    return 0;
+}
+
+
+/*
+ * Function: mapVectors
+ * Both stores map the same file, the kernel shares the pages. Nothing is
+ * read up front, rows are paged in as the search touches them.
+ */
+int mapVectors(const char *filename, size_t refNo)
+{
+    if (fpStoreMapFile(&referenceVectors, filename, 0, refNo) ||
+        fpStoreMapFile(&comparisonVectors, filename, refNo, FP_STORE_ALL)) {
+        fpStoreFree(&referenceVectors);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Function: writeVectorsToLibrary
+ * Writes ref then cmp vectors to a fingerprint file (see fpstore.h), which
+ * can be mapped by later runs instead of regenerating the vectors.
+ * Weights must already be calculated.
+ */
+int writeVectorsToLibrary(const char *filename)
+{
+    const FingerprintStore *stores[] = { &referenceVectors, &comparisonVectors };
+
+    return fpStoreWriteFile(filename, stores, 2);
+}
+
+
+/*
+ * Function: writeComparisonIndex
+ * Sorts a copy, the order of comparisonVectors (and of the results) is kept.
+ */
+int writeComparisonIndex(const char *filename)
+{
+    FingerprintStore sorted;
+    WeightBuckets    buckets;
+
+    if (fpStoreInit(&sorted, comparisonVectors.count, comparisonVectors.width)) {
+        return -1;
+    }
+    memcpy(sorted.bits, comparisonVectors.bits, comparisonVectors.count * fpStoreStrideBytes(&sorted));
+    memcpy(sorted.ids, comparisonVectors.ids, comparisonVectors.count * sizeof(uint32_t));
+    memcpy(sorted.weights, comparisonVectors.weights, comparisonVectors.count * sizeof(uint32_t));
+
+    if (fpStoreSortByWeight(&sorted, &buckets)) {
+        fpStoreFree(&sorted);
+        return -1;
+    }
+
+    int error = fpStoreWriteIndex(filename, &sorted, &buckets);
+
+    weightBucketsFree(&buckets);
+    fpStoreFree(&sorted);
+    return error;
+}
+
+
+/*
+ * Function: mapComparisonIndex
+ */
+int mapComparisonIndex(const char *filename)
+{
+    fpStoreFree(&comparisonVectors);
+
+    if (fpStoreMapIndex(&comparisonVectors, &comparisonIndex, filename)) {
+        return -1;
+    }
+
+    if (comparisonVectors.width != referenceVectors.width) {
+        fprintf(stderr, "%s holds %u-bit vectors, the ref vectors are %u bits wide.\n",
+                filename, comparisonVectors.width, referenceVectors.width);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Function: freeVectors
+ * Release everything allocated by initVectors and
+ * computeAllTanimotoSimilarities.
+ */
+void freeVectors(void)
+{
+    fpStoreFree(&referenceVectors);
+    fpStoreFree(&comparisonVectors);
+    weightBucketsFree(&comparisonIndex);
+
+    free(tanimotoResults);
+    tanimotoResults = NULL;
 }
 
 
 /*
  * Function: writeVectorsToFile
- * Writes the data[] bytes of the referenceVectors followed immediately
- * by the data[] bytes of the comparisonVectors to a single binary file,
+ * Writes the data bytes of the referenceVectors followed immediately
+ * by the data bytes of the comparisonVectors to a single binary file,
  * with no header or extra information.
  */
 int writeVectorsToFile(const char *filename)
@@ -70,30 +203,10 @@ int writeVectorsToFile(const char *filename)
         return -1;
     }
 
-    /* Write reference vectors' data (115 bytes each) */
-    for (int i = 0; i < REF_VECTOR_NO; i++) {
-        size_t written = fwrite(referenceVectors[i].data, 
-                                sizeof(uint8_t), 
-                                115, 
-                                fp);
-        if (written != 115) {
-            perror("Failed to write reference vector data");
-            fclose(fp);
-            return -1;
-        }
-    }
-
-    /* Write comparison vectors' data (115 bytes each) */
-    for (int i = 0; i < CMP_VECTOR_NO; i++) {
-        size_t written = fwrite(comparisonVectors[i].data, 
-                                sizeof(uint8_t), 
-                                115, 
-                                fp);
-        if (written != 115) {
-            perror("Failed to write comparison vector data");
-            fclose(fp);
-            return -1;
-        }
+    if (fpStoreWritePacked(&referenceVectors, fp) ||
+        fpStoreWritePacked(&comparisonVectors, fp)) {
+        fclose(fp);
+        return -1;
     }
 
     fclose(fp);
@@ -109,98 +222,71 @@ int writeVectorsToFile(const char *filename)
 */
 int writeIDsToFile(const char *filename, double threshold)
 {
-    uint32_t tmp[REF_VECTOR_NO*CMP_VECTOR_NO*2];
-    unsigned int cnt = 0;
+    static IDFileSink sink;
+    size_t resultNo = referenceVectors.count * comparisonVectors.count;
 
-    FILE *fp = fopen(filename, "wb");
-    if (!fp) {
-        perror("Failed to open output file");
+    if (idFileSinkOpen(&sink, filename) != 0) {
         return -1;
     }
 
-    for(int i = 0; i < REF_VECTOR_NO*CMP_VECTOR_NO; i++){
-        if(tanimotoResults[i].tanimotoCoefficient > threshold){
-            tmp[2*cnt]   = tanimotoResults[i].A->id;
-            tmp[2*cnt+1] = tanimotoResults[i].B->id;
-            cnt++;
+    for (size_t i = 0; i < resultNo; i++) {
+        if (tanimotoResults[i].tanimotoCoefficient > threshold) {
+            idFileSinkPush(&sink,
+                           referenceVectors.ids[tanimotoResults[i].refIdx],
+                           comparisonVectors.ids[tanimotoResults[i].cmpIdx],
+                           tanimotoResults[i].tanimotoCoefficient);
         }
     }
 
-    size_t written = fwrite(tmp,
-                            sizeof(uint32_t), 
-                            cnt*2, 
-                            fp);
-
-    if (written != cnt*2) {
-        perror("Failed to write comparison vector data");
-        fclose(fp);
-        return -1;
-    }
-
-    fclose(fp);
-    return 0;
+    return idFileSinkClose(&sink);
 }
 
 
 /*
- * Function: createIntermediaryVectors
- * For each pair (ref, cmp), compute the bitwise AND of the 115 data bytes
- * and store it in intermediaryVectors.
- * 
- * The index in intermediaryVectors is (i * CMP_VECTOR_NO + j), where:
- *   i in [0, REF_VECTOR_NO - 1]
- *   j in [0, CMP_VECTOR_NO - 1]
+ * Function: calculateBinaryWeights
+ * Counts the number of '1' bits of every reference and comparison vector
+ * and stores them in the weights array of the stores. Mapped stores
+ * already hold their weights, recounting would page in the whole file.
  */
-void createIntermediaryVectors(void)
+void calculateBinaryWeights(void)
 {
-    for (int i = 0; i < REF_VECTOR_NO; i++) {
-        for (int j = 0; j < CMP_VECTOR_NO; j++) {
-            int idx = i * CMP_VECTOR_NO + j; 
-
-            /* Initialize weight to 0 (will be calculated later) */
-            intermediaryVectors[idx].weight = 0;
-
-            /* Bitwise AND each byte of the data */
-            for (int k = 0; k < 115; k++) {
-                intermediaryVectors[idx].data[k] = 
-                    referenceVectors[i].data[k] & comparisonVectors[j].data[k];
-            }
-        }
+    if (!referenceVectors.map) {
+        fpStoreComputeWeights(&referenceVectors);
+    }
+    if (!comparisonVectors.map) {
+        fpStoreComputeWeights(&comparisonVectors);
     }
 }
 
 
 /*
- * Function: calculateBinaryWeight
- * Counts the number of '1' bits in the data[115] array of the input vector
- * and stores this value in the vector's weight field.
+ * Function: calculateIntersectionWeight
+ * Returns CNT(A & B) of the two input vectors. The AND vector is never
+ * stored, see popcnt.c for the SIMD kernels. Rows are zero-padded, so the
+ * full stride is counted.
  */
-void calculateBinaryWeight(BinaryVector *vec)
+uint32_t calculateIntersectionWeight(const FingerprintStore *a, size_t aIdx,
+                                     const FingerprintStore *b, size_t bIdx)
 {
-    uint32_t bitCount = 0;
-    for (int i = 0; i < 115; i++) {
-        bitCount += __builtin_popcount(vec->data[i]);
-    }
-    vec->weight = bitCount;
+    return popcntAnd((const uint8_t *)fpStoreRow(a, aIdx),
+                     (const uint8_t *)fpStoreRow(b, bIdx),
+                     fpStoreStrideBytes(a));
 }
 
 
 /*
  * Function: computeTanimotoSimilarity
- * Calculates the Tanimoto similarity between the reference, comparison,
- * and their ANDed intermediary vector. We assume weight fields have already
- * been computed.
+ * Calculates the Tanimoto similarity from the weights of the reference,
+ * comparison, and their ANDed intermediary vector.
  * 
  * TanimotoSimilarity = AND_weight / (ref_weight + cmp_weight - AND_weight).
  */
-double computeTanimotoSimilarity(const BinaryVector *ref,
-                                 const BinaryVector *cmp,
-                                 const BinaryVector *inter)
+double computeTanimotoSimilarity(uint32_t cntA, uint32_t cntB, uint32_t cntC)
 {
     /* Convert to double to avoid integer division */
-    double andWeight  = (double)inter->weight;
-    double refWeight  = (double)ref->weight;
-    double cmpWeight  = (double)cmp->weight;
+    double andWeight  = (double)cntC;
+    double refWeight  = (double)cntA;
+    double cmpWeight  = (double)cntB;
 
     double denominator = (refWeight + cmpWeight - andWeight);
 
@@ -215,25 +301,39 @@ double computeTanimotoSimilarity(const BinaryVector *ref,
 
 /*
  * Function: computeAllTanimotoSimilarities
- * Iterates over all referenceVector - comparisonVector pairs, along with
- * their corresponding intermediary vector, to compute and store the Tanimoto
- * similarity for each pairing in the global tanimotoResults[] array.
+ * Iterates over all referenceVector - comparisonVector pairs to compute and
+ * store the Tanimoto similarity for each pairing in the global
+ * tanimotoResults[] array, which is allocated here (ref x cmp entries).
+ * Weights must already be calculated.
  */
-void computeAllTanimotoSimilarities(void)
+int computeAllTanimotoSimilarities(void)
 {
-    for (int i = 0; i < REF_VECTOR_NO; i++) {
-        for (int j = 0; j < CMP_VECTOR_NO; j++) {
-            int idx = i * CMP_VECTOR_NO + j;
-            /* Compute Tanimoto using the ref, cmp, and intermediary vectors */
+    size_t refNo = referenceVectors.count;
+    size_t cmpNo = comparisonVectors.count;
+
+    free(tanimotoResults);
+    tanimotoResults = (TanimotoResult *)malloc(refNo * cmpNo * sizeof(TanimotoResult));
+    if (!tanimotoResults) {
+        fprintf(stderr, "Failed to allocate %zu results\n", refNo * cmpNo);
+        return -1;
+    }
+
+    for (size_t i = 0; i < refNo; i++) {
+        for (size_t j = 0; j < cmpNo; j++) {
+            size_t idx = i * cmpNo + j;
+
+            tanimotoResults[idx].refIdx = (uint32_t)i;
+            tanimotoResults[idx].cmpIdx = (uint32_t)j;
+            tanimotoResults[idx].cntC
+                = calculateIntersectionWeight(&referenceVectors, i, &comparisonVectors, j);
             tanimotoResults[idx].tanimotoCoefficient
-                = computeTanimotoSimilarity(&referenceVectors[i], 
-                                            &comparisonVectors[j], 
-                                            &intermediaryVectors[idx]);
-            tanimotoResults[idx].A = &referenceVectors[i];
-            tanimotoResults[idx].B = &comparisonVectors[j];
-            tanimotoResults[idx].C = &intermediaryVectors[idx];
+                = computeTanimotoSimilarity(referenceVectors.weights[i],
+                                            comparisonVectors.weights[j],
+                                            tanimotoResults[idx].cntC);
         }
     }
+
+    return 0;
 }
 
 
@@ -245,26 +345,30 @@ void computeAllTanimotoSimilarities(void)
 void printResult(const TanimotoResult result, double threshold)
 {
     if(result.tanimotoCoefficient > threshold) {
+        const uint8_t *a = (const uint8_t *)fpStoreRow(&referenceVectors, result.refIdx);
+        const uint8_t *b = (const uint8_t *)fpStoreRow(&comparisonVectors, result.cmpIdx);
+        size_t rowBytes  = fpStoreRowBytes(&referenceVectors);
+
         printf("refID:\t0x%08x\tcmpID:\t0x%08x\tcoeff:\t%f\n",
-               result.A->id,
-               result.B->id,
+               referenceVectors.ids[result.refIdx],
+               comparisonVectors.ids[result.cmpIdx],
                result.tanimotoCoefficient);
 
         printf("A: ");
-        for(unsigned int i = 0; i < 115; i++){
-            printf("%02x", result.A->data[i]);
+        for(size_t i = 0; i < rowBytes; i++){
+            printf("%02x", a[i]);
         }
         printf("\n");
 
         printf("B: ");
-        for(unsigned int i = 0; i < 115; i++){
-            printf("%02x", result.B->data[i]);
+        for(size_t i = 0; i < rowBytes; i++){
+            printf("%02x", b[i]);
         }
         printf("\n");
 
         printf("C: ");
-        for(unsigned int i = 0; i < 115; i++){
-            printf("%02x", result.C->data[i]);
+        for(size_t i = 0; i < rowBytes; i++){
+            printf("%02x", a[i] & b[i]);
         }
         printf("\n");
     }
@@ -283,16 +387,18 @@ void printAllResultsToTxtFile(const char *filename)
         return;
     }
 
-    for (int i = 0; i < REF_VECTOR_NO * CMP_VECTOR_NO; i++) {
+    for (size_t i = 0; i < referenceVectors.count * comparisonVectors.count; i++) {
+        const TanimotoResult *res = &tanimotoResults[i];
+
         fprintf(fp, "refID:\t0x%08x\tcmpID:\t0x%08x\tcoeff:\t%f\tCNT[A]:\t%d\tCNT[B]\t%d\tCNT[C]\t%d\n",
-                tanimotoResults[i].A->id,
-                tanimotoResults[i].B->id,
-                tanimotoResults[i].tanimotoCoefficient,
-                tanimotoResults[i].A->weight,
-                tanimotoResults[i].B->weight,
-                tanimotoResults[i].C->weight
+                referenceVectors.ids[res->refIdx],
+                comparisonVectors.ids[res->cmpIdx],
+                res->tanimotoCoefficient,
+                referenceVectors.weights[res->refIdx],
+                comparisonVectors.weights[res->cmpIdx],
+                res->cntC
         );
     }
 
     fclose(fp);
-}
\ No newline at end of file
+}
@@ -7,32 +7,58 @@
 #include <time.h>
 #include <getopt.h>
 #include <stdbool.h>
+#include "fpstore.h"
 
-#define REF_VECTOR_NO   8
-#define CMP_VECTOR_NO   24
-#define THRESHOLD       0.66
+#ifdef __cplusplus
+extern "C" {
+#endif
 
+#define DEFAULT_REF_VECTOR_NO   8       /* SHR_DEPTH of the accelerator */
+#define DEFAULT_CMP_VECTOR_NO   24
+#define VECTOR_WIDTH            920     /* Width of the test data and the accelerator */
+#define VECTOR_SIZE             ((VECTOR_WIDTH + 7) / 8)
+#define THRESHOLD               0.66
+
+/* Record format of the hard-coded test vectors (see test.c) */
 typedef struct {
     uint32_t id;                  /* ID of the vector */
     uint32_t weight;              /* Binary weight (number of set bits, etc.) */
-    uint8_t  data[115];           /* The 920-bit wide vector data */
+    uint8_t  data[VECTOR_SIZE];   /* The VECTOR_WIDTH-bit wide vector data */
 } BinaryVector;
 
-extern BinaryVector referenceVectors[REF_VECTOR_NO];
-extern BinaryVector comparisonVectors[CMP_VECTOR_NO];
-extern BinaryVector intermediaryVectors[REF_VECTOR_NO*CMP_VECTOR_NO];
+extern FingerprintStore referenceVectors;
+extern FingerprintStore comparisonVectors;
+extern WeightBuckets    comparisonIndex;    /* Weight buckets of a mapped index, see mapComparisonIndex() */
 
 typedef struct {
-    BinaryVector* A;
-    BinaryVector* B;
-    BinaryVector* C;
+    uint32_t refIdx;                    /* Row of A in referenceVectors */
+    uint32_t cmpIdx;                    /* Row of B in comparisonVectors */
+    uint32_t cntC;                      /* CNT(A & B) */
     double tanimotoCoefficient;         /* Calculated Tanimoto similarity coefficient */
 } TanimotoResult;
 
-extern TanimotoResult tanimotoResults[REF_VECTOR_NO*CMP_VECTOR_NO];
+extern TanimotoResult *tanimotoResults;
+
+/* Allocate refNo + cmpNo vectors of width bits, fill them with random or
+ * hard-coded data */
+int  initVectors(size_t refNo, size_t cmpNo, uint32_t width, bool generate);
+
+/* Map a fingerprint file: its first refNo rows as ref vectors, the rest as
+ * cmp vectors. Weights come from the file. */
+int  mapVectors(const char *filename, size_t refNo);
+
+/* Write ref and cmp vectors, weights and IDs to a fingerprint file */
+int  writeVectorsToLibrary(const char *filename);
 
-/* Fill vector data with randomly generated values */
-void initVectors(bool generate);
+/* Write the cmp vectors, sorted by weight, to an indexed fingerprint file */
+int  writeComparisonIndex(const char *filename);
+
+/* Replace the cmp vectors by a mapped indexed fingerprint file, its buckets
+ * are kept in comparisonIndex */
+int  mapComparisonIndex(const char *filename);
+
+/* Release the vector stores and the result array */
+void freeVectors(void);
 
 /* Write ref and cmp vectors to binary file */
 int  writeVectorsToFile(const char *filename);
@@ -40,19 +66,19 @@ int  writeVectorsToFile(const char *filename);
 /* Write the results of the calculation to binary file */
 int  writeIDsToFile(const char *filename, double threshold);
 
-/* Create C = A & B vectors */
-void createIntermediaryVectors(void);
+/* Calculate binary weight of every ref and cmp vector, mapped stores keep
+ * the weights of their file */
+void calculateBinaryWeights(void);
 
-/* Calculate binary weight of the input vector */
-void calculateBinaryWeight(BinaryVector *vec);
+/* Calculate CNT(A & B) without creating the intermediary vector */
+uint32_t calculateIntersectionWeight(const FingerprintStore *a, size_t aIdx,
+                                     const FingerprintStore *b, size_t bIdx);
 
-/* Calculate the Tanimoto coefficient using the weights of the input vectors */
-double computeTanimotoSimilarity(const BinaryVector *ref,
-                                 const BinaryVector *cmp,
-                                 const BinaryVector *inter);
+/* Calculate the Tanimoto coefficient from CNT(A), CNT(B) and CNT(A & B) */
+double computeTanimotoSimilarity(uint32_t cntA, uint32_t cntB, uint32_t cntC);
 
 /* Tanimoto coeff for all global vectors */
-void computeAllTanimotoSimilarities(void);
+int  computeAllTanimotoSimilarities(void);
 
 /* Print result struct to console */
 void printResult(const TanimotoResult result, double threshold);
@@ -60,4 +86,8 @@ void printResult(const TanimotoResult result, double threshold);
 /* Export results to TXT file */
 void printAllResultsToTxtFile(const char *filename);
 
-#endif // TANIMOTO_H
\ No newline at end of file
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TANIMOTO_H
@@ -0,0 +1,54 @@
+#include "threshold.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Function: thresholdTableInit
+ * The entry expression is the one of the host's configureThresholdRAM():
+ * float threshold, promoted to double, then truncated to unsigned int.
+ * Thresholds of 1 and above would divide by zero (or give negative
+ * entries), the hardware cannot express them either.
+ */
+int thresholdTableInit(ThresholdTable *table, uint32_t width, float threshold)
+{
+    uint32_t cntWidth = 0;
+
+    table->table = NULL;
+    if (!(threshold >= 0.0f && threshold < 1.0f)) {
+        fprintf(stderr, "Threshold %f is outside of [0, 1)\n", threshold);
+        return -1;
+    }
+
+    while ((1u << cntWidth) < width) {      // $clog2(VECTOR_WIDTH)
+        cntWidth++;
+    }
+
+    table->width     = width;
+    table->ramBits   = cntWidth + 1;
+    table->threshold = threshold;
+    table->table     = (uint32_t *)malloc(((size_t)width + 1) * sizeof(uint32_t));
+    if (!table->table) {
+        fprintf(stderr, "Failed to allocate threshold table\n");
+        return -1;
+    }
+
+    uint32_t mask = (table->ramBits < 32) ? (1u << table->ramBits) - 1 : 0xffffffffu;
+    table->wrapFrom = width + 1;
+    for (uint32_t cntC = 0; cntC <= width; cntC++) {
+        uint64_t entry = (uint64_t)((float)cntC * (2.0 - threshold) / (1.0 - threshold));
+
+        if (entry > mask && table->wrapFrom > width) {
+            table->wrapFrom = cntC;
+        }
+        table->table[cntC] = (uint32_t)(entry & mask);
+    }
+
+    return 0;
+}
+
+
+void thresholdTableFree(ThresholdTable *table)
+{
+    free(table->table);
+    table->table = NULL;
+}
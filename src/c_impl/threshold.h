@@ -0,0 +1,50 @@
+#ifndef THRESHOLD_H
+#define THRESHOLD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Threshold table of the accelerator's comparator
+ * The hardware never divides: comparator.v reports a pair when
+ *
+ *      CNT(A) + CNT(B) > table[CNT(A & B)]
+ *
+ * where table[c] = c * (2 - t) / (1 - t), computed once by the host with
+ * float threshold, truncated to unsigned and stored in a RAM of
+ * CNT_WIDTH + 1 bits (CNT_WIDTH = $clog2(VECTOR_WIDTH)). Entries that do not
+ * fit wrap around, exactly as they do in the RAM (for 920 bits and t = 0.66
+ * from CNT(A & B) = 520 on, where the hardware reports near identical pairs
+ * as dissimilar). The same table is written
+ * to the accelerator (configureThresholdRAM) and used by the software
+ * search, so both agree bit for bit.
+ */
+typedef struct {
+    uint32_t  width;            /* Fingerprint width, the table has width + 1 entries */
+    uint32_t  ramBits;          /* CNT_WIDTH + 1, width of a RAM word */
+    float     threshold;
+    uint32_t  wrapFrom;         /* First CNT(A & B) whose entry wrapped, width + 1 if none */
+    uint32_t *table;
+} ThresholdTable;
+
+/* Fill the table for threshold in [0, 1), returns 0 on success */
+int  thresholdTableInit(ThresholdTable *table, uint32_t width, float threshold);
+
+void thresholdTableFree(ThresholdTable *table);
+
+/* One add, one load, one compare */
+static inline bool thresholdTableMatch(const ThresholdTable *table,
+                                       uint32_t cntA, uint32_t cntB, uint32_t cntC)
+{
+    return cntA + cntB > table->table[cntC];
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // THRESHOLD_H
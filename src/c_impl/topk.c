@@ -0,0 +1,384 @@
+#include "topk.h"
+#include "worksteal.h"
+#include "popcnt.h"
+#include <string.h>
+
+// Pairs counted by a worker, one cache line each
+typedef struct {
+    uint64_t counted;
+} __attribute__((aligned(64))) TopKCounter;
+
+typedef struct {
+    const FingerprintStore *ref;
+    const FingerprintStore *cmp;
+    const SearchConfig     *cfg;
+    size_t                  k;
+    TopKResults            *results;
+    PopcntAndBlockFn        block;
+    TopKCounter            *counters;
+} TopKSearch;
+
+// Heaps of the refs of one block, heap[0] is the worst kept neighbour
+typedef struct {
+    size_t      refBegin;
+    size_t      refRows;
+    Neighbour  *heaps[POPCNT_BLOCK_REF];
+    uint32_t   *counts[POPCNT_BLOCK_REF];
+} RefBlock;
+
+/*
+ * Function: similarityOf
+ * Same expression as searchParallel() in MATCH_SIMILAR mode.
+ */
+static inline double similarityOf(uint32_t cntA, uint32_t cntB, uint32_t cntC)
+{
+    return 1.0 - computeTanimotoSimilarity(cntA, cntB, cntC);
+}
+
+static inline bool neighbourWorse(const Neighbour *x, const Neighbour *y)
+{
+    return x->similarity < y->similarity ||
+           (x->similarity == y->similarity && x->id > y->id);
+}
+
+static void heapSiftDown(Neighbour *heap, size_t n, size_t i)
+{
+    for (;;) {
+        size_t worst = i;
+        size_t l     = 2 * i + 1;
+        size_t r     = l + 1;
+
+        if (l < n && neighbourWorse(&heap[l], &heap[worst])) worst = l;
+        if (r < n && neighbourWorse(&heap[r], &heap[worst])) worst = r;
+        if (worst == i) {
+            return;
+        }
+
+        Neighbour tmp = heap[i];
+        heap[i]     = heap[worst];
+        heap[worst] = tmp;
+        i = worst;
+    }
+}
+
+static void heapSiftUp(Neighbour *heap, size_t i)
+{
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!neighbourWorse(&heap[i], &heap[parent])) {
+            return;
+        }
+
+        Neighbour tmp = heap[i];
+        heap[i]      = heap[parent];
+        heap[parent] = tmp;
+        i = parent;
+    }
+}
+
+/*
+ * Function: heapOffer
+ * Keep cand if the heap is not full yet (and cand reaches the minimum
+ * similarity), or if it beats the worst kept neighbour.
+ */
+static inline void heapOffer(Neighbour *heap, uint32_t *cnt, size_t k,
+                             const Neighbour *cand, double minSimilarity)
+{
+    if (*cnt < k) {
+        if (cand->similarity >= minSimilarity) {
+            heap[*cnt] = *cand;
+            heapSiftUp(heap, *cnt);
+            (*cnt)++;
+        }
+    } else if (neighbourWorse(&heap[0], cand)) {
+        heap[0] = *cand;
+        heapSiftDown(heap, k, 0);
+    }
+}
+
+/* Dynamic threshold of a ref: worst kept similarity once the heap is full */
+static inline double refThreshold(const TopKSearch *search, const RefBlock *blk, size_t r)
+{
+    return *blk->counts[r] < search->k ? search->cfg->threshold : blk->heaps[r][0].similarity;
+}
+
+/*
+ * Function: blockReachable
+ * Whether any ref of the block may still gain a neighbour from the cmp rows
+ * beyond weight w (above it if up, below it otherwise). Below a ref's own
+ * weight the bound grows with w, above it it shrinks, so only refs on the
+ * far side of w need the bound evaluated.
+ */
+static bool blockReachable(const TopKSearch *search, const RefBlock *blk, uint32_t w, bool up)
+{
+    for (size_t r = 0; r < blk->refRows; r++) {
+        uint32_t a = search->ref->weights[blk->refBegin + r];
+
+        if (up ? w <= a : w >= a) {
+            return true;
+        }
+        if (similarityOf(a, w, a < w ? a : w) >= refThreshold(search, blk, r)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Function: scanRows
+ * Count cmp rows [j, j + cmpRows) against the block and offer every pair to
+ * the heaps.
+ */
+static void scanRows(const TopKSearch *search, RefBlock *blk, size_t j, size_t cmpRows)
+{
+    const FingerprintStore *ref = search->ref;
+    const FingerprintStore *cmp = search->cmp;
+    uint32_t                cnt[POPCNT_BLOCK_REF * POPCNT_BLOCK_CMP];
+    size_t                  i = blk->refBegin;
+
+    if (blk->refRows == POPCNT_BLOCK_REF && cmpRows == POPCNT_BLOCK_CMP) {
+        search->block(fpStoreRow(ref, i), fpStoreRow(cmp, j), ref->stride, cnt);
+    } else {
+        for (size_t r = 0; r < blk->refRows; r++) {
+            for (size_t c = 0; c < cmpRows; c++) {
+                cnt[r * POPCNT_BLOCK_CMP + c] = calculateIntersectionWeight(ref, i + r, cmp, j + c);
+            }
+        }
+    }
+
+    for (size_t r = 0; r < blk->refRows; r++) {
+        for (size_t c = 0; c < cmpRows; c++) {
+            Neighbour cand;
+            cand.id         = cmp->ids[j + c];
+            cand.similarity = similarityOf(ref->weights[i + r], cmp->weights[j + c],
+                                           cnt[r * POPCNT_BLOCK_CMP + c]);
+            heapOffer(blk->heaps[r], blk->counts[r], search->k, &cand, search->cfg->threshold);
+        }
+    }
+}
+
+/*
+ * Function: topKTile
+ * TileFn of searchTopK, a tile is one block of POPCNT_BLOCK_REF refs, which
+ * owns its heaps. Without weight buckets every cmp row is scanned. With
+ * them the scan starts at the bucket of the block's middle ref and grows
+ * one POPCNT_BLOCK_CMP chunk up and one down per step, each direction stops
+ * for good once no ref of the block can be improved by what lies beyond.
+ * Finally the heaps are sorted in place, best first.
+ */
+static void topKTile(void *ctx, unsigned int worker, size_t tile)
+{
+    TopKSearch             *search  = (TopKSearch *)ctx;
+    const FingerprintStore *ref     = search->ref;
+    const FingerprintStore *cmp     = search->cmp;
+    TopKResults            *results = search->results;
+    RefBlock                blk;
+    uint64_t                counted = 0;
+
+    blk.refBegin = tile * POPCNT_BLOCK_REF;
+    blk.refRows  = ref->count - blk.refBegin < POPCNT_BLOCK_REF ? ref->count - blk.refBegin : POPCNT_BLOCK_REF;
+
+    for (size_t r = 0; r < blk.refRows; r++) {
+        blk.heaps[r]  = results->neighbours + (blk.refBegin + r) * search->k;
+        blk.counts[r] = &results->counts[blk.refBegin + r];
+        results->refIDs[blk.refBegin + r] = ref->ids[blk.refBegin + r];
+    }
+
+    if (!search->cfg->cmpBuckets) {
+        for (size_t j = 0; j < cmp->count; j += POPCNT_BLOCK_CMP) {
+            size_t rows = cmp->count - j < POPCNT_BLOCK_CMP ? cmp->count - j : POPCNT_BLOCK_CMP;
+            scanRows(search, &blk, j, rows);
+            counted += blk.refRows * rows;
+        }
+    } else {
+        uint32_t mid  = ref->weights[blk.refBegin + blk.refRows / 2];
+        size_t   up   = search->cfg->cmpBuckets->start[mid];
+        size_t   down = up;
+        bool     goUp   = up < cmp->count;
+        bool     goDown = down > 0;
+
+        while (goUp || goDown) {
+            if (goUp) {
+                if (blockReachable(search, &blk, cmp->weights[up], true)) {
+                    size_t rows = cmp->count - up < POPCNT_BLOCK_CMP ? cmp->count - up : POPCNT_BLOCK_CMP;
+                    scanRows(search, &blk, up, rows);
+                    counted += blk.refRows * rows;
+                    up     += rows;
+                    goUp    = up < cmp->count;
+                } else {
+                    goUp = false;
+                }
+            }
+            if (goDown) {
+                if (blockReachable(search, &blk, cmp->weights[down - 1], false)) {
+                    size_t rows = down < POPCNT_BLOCK_CMP ? down : POPCNT_BLOCK_CMP;
+                    down   -= rows;
+                    scanRows(search, &blk, down, rows);
+                    counted += blk.refRows * rows;
+                    goDown  = down > 0;
+                } else {
+                    goDown = false;
+                }
+            }
+        }
+    }
+
+    for (size_t r = 0; r < blk.refRows; r++) {
+        for (size_t n = *blk.counts[r]; n > 1; n--) {
+            Neighbour worst     = blk.heaps[r][0];
+            blk.heaps[r][0]     = blk.heaps[r][n - 1];
+            blk.heaps[r][n - 1] = worst;
+            heapSiftDown(blk.heaps[r], n - 1, 0);
+        }
+    }
+
+    search->counters[worker].counted += counted;
+}
+
+
+/*
+ * Function: searchTopK
+ * Every ref block is an independent tile on the work-stealing pool, heaps
+ * live in the result arrays and are only touched by the tile's worker.
+ */
+int searchTopK(const FingerprintStore *ref,
+               const FingerprintStore *cmp,
+               const SearchConfig *cfg,
+               size_t k,
+               TopKResults *results,
+               SearchStats *stats)
+{
+    TopKSearch   search;
+    unsigned int threadNo = cfg->threadNo ? cfg->threadNo : 1;
+
+    memset(results, 0, sizeof(*results));
+    if (k == 0) {
+        fprintf(stderr, "Top-k search needs k >= 1\n");
+        return -1;
+    }
+
+    results->refNo      = ref->count;
+    results->k          = k;
+    results->refIDs     = (uint32_t *)calloc(ref->count ? ref->count : 1, sizeof(uint32_t));
+    results->counts     = (uint32_t *)calloc(ref->count ? ref->count : 1, sizeof(uint32_t));
+    results->neighbours = (Neighbour *)malloc((ref->count ? ref->count : 1) * k * sizeof(Neighbour));
+    search.counters     = NULL;
+
+    if (!results->refIDs || !results->counts || !results->neighbours ||
+        posix_memalign((void **)&search.counters, 64, threadNo * sizeof(TopKCounter))) {
+        fprintf(stderr, "Failed to allocate top-k state\n");
+        topKResultsFree(results);
+        return -1;
+    }
+    memset(search.counters, 0, threadNo * sizeof(TopKCounter));
+
+    search.ref     = ref;
+    search.cmp     = cmp;
+    search.cfg     = cfg;
+    search.k       = k;
+    search.results = results;
+    search.block   = popcntAndBlockForWidth(ref->width);
+
+    workStealRun((ref->count + POPCNT_BLOCK_REF - 1) / POPCNT_BLOCK_REF, threadNo, topKTile, &search);
+
+    if (stats) {
+        uint64_t counted = 0;
+        uint64_t hits    = 0;
+
+        for (unsigned int w = 0; w < threadNo; w++) {
+            counted += search.counters[w].counted;
+        }
+        for (size_t i = 0; i < ref->count; i++) {
+            hits += results->counts[i];
+        }
+
+        stats->pairs      = (uint64_t)ref->count * cmp->count;
+        stats->pruned     = stats->pairs - counted;
+        stats->terminated = 0;
+        stats->hits       = hits;
+    }
+
+    free(search.counters);
+    return 0;
+}
+
+
+void topKResultsFree(TopKResults *results)
+{
+    free(results->refIDs);
+    free(results->counts);
+    free(results->neighbours);
+
+    results->refIDs     = NULL;
+    results->counts     = NULL;
+    results->neighbours = NULL;
+    results->refNo      = 0;
+}
+
+
+/*
+ * Function: writeTopKToTxtFile
+ * One line per neighbour, in rank order within every ref.
+ */
+int writeTopKToTxtFile(const TopKResults *results, const char *filename)
+{
+    FILE *fp = fopen(filename, "w");
+    if (!fp) {
+        perror("Error opening output file");
+        return -1;
+    }
+
+    for (size_t i = 0; i < results->refNo; i++) {
+        const Neighbour *list = results->neighbours + i * results->k;
+
+        for (uint32_t n = 0; n < results->counts[i]; n++) {
+            fprintf(fp, "refID:\t0x%08x\trank:\t%u\tcmpID:\t0x%08x\tsimilarity:\t%f\n",
+                    results->refIDs[i], n + 1, list[n].id, list[n].similarity);
+        }
+    }
+
+    if (fclose(fp) != 0) {
+        perror("Failed to close output file");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Function: writeTopKIDsToFile
+ * Same binary format as writeIDsToFile(), pairs of a ref in rank order.
+ */
+int writeTopKIDsToFile(const TopKResults *results, const char *filename)
+{
+    static IDFileSink sink;
+
+    if (idFileSinkOpen(&sink, filename) != 0) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < results->refNo; i++) {
+        const Neighbour *list = results->neighbours + i * results->k;
+
+        for (uint32_t n = 0; n < results->counts[i]; n++) {
+            idFileSinkPush(&sink, results->refIDs[i], list[n].id, list[n].similarity);
+        }
+    }
+
+    return idFileSinkClose(&sink);
+}
+
+
+void printTopK(const TopKResults *results)
+{
+    for (size_t i = 0; i < results->refNo; i++) {
+        const Neighbour *list = results->neighbours + i * results->k;
+
+        printf("refID:\t0x%08x\n", results->refIDs[i]);
+        for (uint32_t n = 0; n < results->counts[i]; n++) {
+            printf("\t%3u.\tcmpID:\t0x%08x\tsimilarity:\t%f\n", n + 1, list[n].id, list[n].similarity);
+        }
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef TOPK_H
+#define TOPK_H
+
+#include "search.h"
+
+/*
+ * Top-k nearest neighbour search
+ * For every ref vector the k cmp vectors of highest Tanimoto similarity are
+ * kept in a bounded min-heap. Once a heap is full its worst entry is the
+ * ref's dynamic threshold: cmp weights whose bound (see searchParallel())
+ * cannot reach it are not visited any more. With cmp sorted by weight, a
+ * block of refs scans outward from its own weight, so the heaps fill with
+ * close neighbours first and the window shrinks quickly.
+ */
+
+typedef struct {
+    uint32_t id;                /* cmp vector ID */
+    double   similarity;        /* Tanimoto similarity */
+} Neighbour;
+
+/* Ranked lists, best first. Equal similarities are ranked by ascending ID. */
+typedef struct {
+    size_t     refNo;
+    size_t     k;
+    uint32_t  *refIDs;          /* refNo entries */
+    uint32_t  *counts;          /* refNo entries, number of neighbours found (<= k) */
+    Neighbour *neighbours;      /* refNo * k entries, ref i at [i * k, i * k + counts[i]) */
+} TopKResults;
+
+/*
+ * Find the k most similar cmp vectors of every ref vector, on cfg->threadNo
+ * threads. cfg->threshold is a minimum similarity, lists are shorter than k
+ * if not enough vectors reach it. cfg->mode is not used. If cmp is sorted
+ * by weight and cfg->cmpBuckets is set, impossible weights are pruned
+ * (sorting ref as well keeps ref blocks' windows tight). stats may be NULL.
+ * Returns 0 on success.
+ */
+int  searchTopK(const FingerprintStore *ref,
+                const FingerprintStore *cmp,
+                const SearchConfig *cfg,
+                size_t k,
+                TopKResults *results,
+                SearchStats *stats);
+
+void topKResultsFree(TopKResults *results);
+
+/* Ranked lists as text, one neighbour per line */
+int  writeTopKToTxtFile(const TopKResults *results, const char *filename);
+
+/* Neighbours as {refID, cmpID} pairs in the writeIDsToFile() format, ranked */
+int  writeTopKIDsToFile(const TopKResults *results, const char *filename);
+
+/* Print the ranked lists to the console */
+void printTopK(const TopKResults *results);
+
+#endif // TOPK_H
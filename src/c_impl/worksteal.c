@@ -0,0 +1,177 @@
+#include "worksteal.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+// Tile range owned by one worker, one cache line each to avoid false sharing
+typedef struct {
+    pthread_mutex_t lock;
+    size_t          begin;
+    size_t          end;
+} __attribute__((aligned(64))) TileRange;
+
+typedef struct {
+    TileRange    *ranges;
+    unsigned int  threadNo;
+    TileFn        fn;
+    void         *ctx;
+} WorkStealPool;
+
+typedef struct {
+    WorkStealPool *pool;
+    unsigned int   worker;
+} WorkerArg;
+
+
+/*
+ * Function: popTile
+ * Take the next tile from the front of the worker's own range.
+ */
+static int popTile(TileRange *own, size_t *tile)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&own->lock);
+    if (own->begin < own->end) {
+        *tile = own->begin++;
+        found = 1;
+    }
+    pthread_mutex_unlock(&own->lock);
+
+    return found;
+}
+
+
+/*
+ * Function: stealTiles
+ * Move the upper half of the first non-empty victim range (searching
+ * round-robin from the next worker) into the thief's own range.
+ */
+static int stealTiles(WorkStealPool *pool, unsigned int thief)
+{
+    for (unsigned int k = 1; k < pool->threadNo; k++) {
+        TileRange *victim = &pool->ranges[(thief + k) % pool->threadNo];
+        size_t begin = 0, end = 0;
+
+        pthread_mutex_lock(&victim->lock);
+        if (victim->begin < victim->end) {
+            size_t mid = victim->begin + (victim->end - victim->begin) / 2;
+            begin       = mid;
+            end         = victim->end;
+            victim->end = mid;
+        }
+        pthread_mutex_unlock(&victim->lock);
+
+        if (begin < end) {
+            TileRange *own = &pool->ranges[thief];
+
+            pthread_mutex_lock(&own->lock);
+            own->begin = begin;
+            own->end   = end;
+            pthread_mutex_unlock(&own->lock);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+static void *workerMain(void *arg)
+{
+    WorkStealPool *pool   = ((WorkerArg *)arg)->pool;
+    unsigned int   worker = ((WorkerArg *)arg)->worker;
+    size_t         tile;
+
+    for (;;) {
+        if (popTile(&pool->ranges[worker], &tile)) {
+            pool->fn(pool->ctx, worker, tile);
+        } else if (!stealTiles(pool, worker)) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Function: workStealRun
+ * Threads that fail to start simply leave their range to be stolen by the
+ * others. Worker 0 only returns once a steal sweep finds every range empty,
+ * so every tile is processed as long as the calling thread runs.
+ */
+unsigned int workStealRun(size_t tileNo, unsigned int threadNo, TileFn fn, void *ctx)
+{
+    if (threadNo == 0) {
+        threadNo = 1;
+    }
+    if (threadNo > tileNo && tileNo > 0) {
+        threadNo = (unsigned int)tileNo;
+    }
+
+    WorkStealPool pool;
+    pool.threadNo = threadNo;
+    pool.fn       = fn;
+    pool.ctx      = ctx;
+    pool.ranges   = NULL;
+
+    pthread_t *threads = (pthread_t *)calloc(threadNo, sizeof(pthread_t));
+    WorkerArg *args    = (WorkerArg *)calloc(threadNo, sizeof(WorkerArg));
+    int       *started = (int *)calloc(threadNo, sizeof(int));
+    if (posix_memalign((void **)&pool.ranges, 64, threadNo * sizeof(TileRange)) ||
+        !threads || !args || !started) {
+        fprintf(stderr, "Failed to allocate worker state, running single-threaded\n");
+        free(pool.ranges);
+        free(threads);
+        free(args);
+        free(started);
+
+        for (size_t t = 0; t < tileNo; t++) {
+            fn(ctx, 0, t);
+        }
+        return 1;
+    }
+
+    for (unsigned int w = 0; w < threadNo; w++) {
+        pthread_mutex_init(&pool.ranges[w].lock, NULL);
+        pool.ranges[w].begin = tileNo * w / threadNo;
+        pool.ranges[w].end   = tileNo * (w + 1) / threadNo;
+        args[w].pool   = &pool;
+        args[w].worker = w;
+    }
+
+    unsigned int running = 1;
+    for (unsigned int w = 1; w < threadNo; w++) {
+        if (pthread_create(&threads[w], NULL, workerMain, &args[w]) == 0) {
+            started[w] = 1;
+            running++;
+        }
+    }
+
+    workerMain(&args[0]);
+
+    for (unsigned int w = 1; w < threadNo; w++) {
+        if (started[w]) {
+            pthread_join(threads[w], NULL);
+        }
+    }
+
+    for (unsigned int w = 0; w < threadNo; w++) {
+        pthread_mutex_destroy(&pool.ranges[w].lock);
+    }
+    free(pool.ranges);
+    free(threads);
+    free(args);
+    free(started);
+
+    return running;
+}
+
+
+unsigned int workStealDefaultThreads(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (unsigned int)cpus : 1;
+}
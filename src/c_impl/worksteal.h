@@ -0,0 +1,35 @@
+#ifndef WORKSTEAL_H
+#define WORKSTEAL_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Work-stealing tile scheduler
+ * Tiles [0, tileNo) are split into one contiguous range per worker. A worker
+ * takes tiles from the front of its own range, and when that runs out it
+ * steals the upper half of another worker's range. Every range has its own
+ * lock, there is no shared queue, so cheap (e.g. pruned) tiles and expensive
+ * ones can be mixed freely without workers idling.
+ */
+
+/* Called once for every tile, worker is in [0, threadNo) */
+typedef void (*TileFn)(void *ctx, unsigned int worker, size_t tile);
+
+/*
+ * Process every tile on threadNo threads (the calling thread is worker 0),
+ * returns when all tiles are done. Returns the number of workers that ran.
+ */
+unsigned int workStealRun(size_t tileNo, unsigned int threadNo, TileFn fn, void *ctx);
+
+/* Number of online CPUs, at least 1 */
+unsigned int workStealDefaultThreads(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // WORKSTEAL_H
@@ -90,25 +90,36 @@ void vec_intf(  bus_t*              ref_vec,
 // AXI-Stream ==> AXI
 
 /*
- * id_in: ID pair output of tanimoto_top.
- * id_out: ID pairs forwarded to PS.
+ * id_in:       ID pair output of tanimoto_top.
+ * id_out:      ID pairs forwarded to PS.
+ * id_out_cap:  Number of ID pairs id_out holds.
+ * id_count:    Number of ID pairs of the run, the terminating zero pair of
+ *              tanimoto_top is not written. Above id_out_cap the buffer
+ *              overflowed: the pairs past it were read and dropped.
  *
  * NOTE: Only does one transaction, as the number of ID pair data that needs
- * to be read is unknown.
+ * to be read is unknown. The stream is always read to its last pair, so a
+ * full buffer never halts the pipeline.
  */
 
 void id_intf(   axi_stream_id_pair_t&  id_in,
-                id_pair_t*             id_out    )
+                id_pair_t*             id_out,
+                unsigned int           id_out_cap,
+                unsigned int*          id_count  )
 {
 
     axis_id_pair_t tmp;
+    unsigned int   count = 0;
 
     id_loop: while(1){
         tmp = id_in.read();
-        *(id_out++) = tmp.data;
         if(tmp.last) break;
+        if(count < id_out_cap) *(id_out++) = tmp.data;
+        count++;
     }
 
+    *id_count = count;
+
 }
 
 // Interface
@@ -119,18 +130,21 @@ void hls_dma(   bus_t*                  vec_ref,
                 axi_stream_id_pair_t&   id_in,
                 id_pair_t*              id_out,
                 unsigned int            ref_sub_vec_no,
-                unsigned int            cmp_sub_vec_no  )
+                unsigned int            cmp_sub_vec_no,
+                unsigned int            id_out_cap,
+                unsigned int*           id_count  )
 {
 #pragma HLS INTERFACE m_axi bundle=gmem1 max_read_burst_length=AXI_BURST_LENGTH port=vec_ref
 #pragma HLS INTERFACE m_axi bundle=gmem1 max_read_burst_length=AXI_BURST_LENGTH port=vec_cmp
 #pragma HLS INTERFACE axis register_mode=both port=vec_out register
 #pragma HLS INTERFACE axis register_mode=both port=id_in register
 #pragma HLS INTERFACE m_axi bundle=gmem2 port=id_out
+#pragma HLS INTERFACE m_axi bundle=gmem2 port=id_count
 
 #pragma HLS DATAFLOW
 
     vec_intf(vec_ref, vec_cmp, vec_out, ref_sub_vec_no, cmp_sub_vec_no);
-    id_intf(id_in, id_out);
+    id_intf(id_in, id_out, id_out_cap, id_count);
 
 }
 
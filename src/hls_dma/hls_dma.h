@@ -9,7 +9,9 @@
 
 #define BUS_WIDTH 128
 #define BUS_WIDTH_BYTES 16
-#define VEC_ID_WIDTH 8
+#ifndef VEC_ID_WIDTH
+#define VEC_ID_WIDTH 16                         // vector ID width, set by the build (ID_WIDTH in the Makefile)
+#endif
 #define REF_VEC_NO 8                            // how many ref_vecs can be pushed before the comparison vectors (SHR_DEPTH)
 #define AXI_BURST_LENGTH 16
 
@@ -41,7 +43,9 @@ void vec_intf(  bus_t*              ref_vec,
             );
 
 void id_intf(   axi_stream_id_pair_t& id_in,
-                id_pair_t*            id_out
+                id_pair_t*            id_out,
+                unsigned int          id_out_cap,
+                unsigned int*         id_count
             );
 
 extern "C" void hls_dma(    bus_t*                  vec_ref,
@@ -50,7 +54,9 @@ extern "C" void hls_dma(    bus_t*                  vec_ref,
                             axi_stream_id_pair_t&   id_in,
                             id_pair_t*              id_out,
                             unsigned int            ref_sub_vec_no,
-                            unsigned int            cmp_sub_vec_no
+                            unsigned int            cmp_sub_vec_no,
+                            unsigned int            id_out_cap,
+                            unsigned int*           id_count
                         );
 
 #endif
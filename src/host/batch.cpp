@@ -0,0 +1,169 @@
+#include <cstdint>
+#include "batch.h"
+#include "extract.h"
+#include "globals.h"
+
+size_t batchIDRange()
+{
+    uint64_t id_no = ID_SIZE >= 4 ? 1ull << 32 : 1ull << (8 * ID_SIZE);
+
+    return id_no - 1 - REF_VEC_NO;
+}
+
+/*
+ * Function: batchTraffic
+ * Bytes the tiles of plan_ move, filled into its counters.
+ */
+static void batchTraffic(BatchPlan* plan_)
+{
+    plan_->ref_bytes = 0;
+    plan_->cmp_bytes = 0;
+
+    for (const BatchTile& tile : plan_->tiles) {
+        KernelInput layout;
+
+        kernelInputLayout(&layout, tile.cmp_no);
+        plan_->ref_bytes += layout.ref_buf_size;
+        plan_->cmp_bytes += tile.new_cmp ? layout.cmp_buf_size : 0;
+    }
+}
+
+/*
+ * Function: batchTiles
+ * Tiles of plan_ in _order, group and chunk counts already set.
+ */
+static void batchTiles(BatchPlan* plan_, BatchOrder _order, size_t _ref_no, size_t _cmp_no, size_t _slot_no)
+{
+    std::vector<size_t> slot_chunk(_slot_no, SIZE_MAX);    // Chunk in the slot, none yet
+    std::vector<size_t> slot_used(_slot_no, 0);            // Tile that used the slot last
+
+    size_t outer_no = _order == BATCH_REF_STATIONARY ? plan_->group_no : plan_->chunk_no;
+    size_t inner_no = _order == BATCH_REF_STATIONARY ? plan_->chunk_no : plan_->group_no;
+
+    plan_->order = _order;
+    plan_->tiles.clear();
+    plan_->tiles.reserve(outer_no * inner_no);
+
+    for (size_t outer = 0; outer < outer_no; outer++) {
+        for (size_t inner = 0; inner < inner_no; inner++) {
+            size_t    group = _order == BATCH_REF_STATIONARY ? outer : inner;
+            size_t    chunk = _order == BATCH_REF_STATIONARY ? inner : outer;
+            BatchTile tile;
+
+            // Chunks differ by one row at most, the first ones take the remainder
+            tile.ref_first = group * REF_VEC_NO;
+            tile.ref_no    = _ref_no - tile.ref_first < REF_VEC_NO ? _ref_no - tile.ref_first : REF_VEC_NO;
+            tile.cmp_first = chunk * (_cmp_no / plan_->chunk_no)
+                           + (chunk < _cmp_no % plan_->chunk_no ? chunk : _cmp_no % plan_->chunk_no);
+            tile.cmp_no    = _cmp_no / plan_->chunk_no + (chunk < _cmp_no % plan_->chunk_no);
+
+            // The slot holding the chunk, or the least recently used one
+            size_t slot = 0;
+            for (size_t i = 0; i < _slot_no; i++) {
+                if (slot_chunk[i] == chunk) {
+                    slot = i;
+                    break;
+                }
+                if (slot_used[i] < slot_used[slot]) {
+                    slot = i;
+                }
+            }
+            tile.cmp_slot    = slot;
+            tile.new_cmp     = slot_chunk[slot] != chunk;
+            slot_chunk[slot] = chunk;
+            slot_used[slot]  = plan_->tiles.size() + 1;
+            plan_->tiles.push_back(tile);
+        }
+    }
+    batchTraffic(plan_);
+}
+
+void batchPlan(
+    BatchPlan* plan_,
+    size_t     _ref_no,
+    size_t     _cmp_no,
+    size_t     _chunk_rows,
+    size_t     _slot_no
+){
+    size_t range = batchIDRange();
+
+    if (_chunk_rows == 0 || _chunk_rows > range) {
+        _chunk_rows = range;
+    }
+    plan_->group_no   = (_ref_no + REF_VEC_NO - 1) / REF_VEC_NO;
+    plan_->chunk_no   = (_cmp_no + _chunk_rows - 1) / _chunk_rows;
+    plan_->chunk_rows = plan_->chunk_no ? (_cmp_no + plan_->chunk_no - 1) / plan_->chunk_no : 0;
+    if (_slot_no == 0) {
+        _slot_no = 1;
+    }
+
+    batchTiles(plan_, BATCH_CMP_STATIONARY, _ref_no, _cmp_no, _slot_no);
+    uint64_t cmp_stationary = plan_->ref_bytes + plan_->cmp_bytes;
+
+    batchTiles(plan_, BATCH_REF_STATIONARY, _ref_no, _cmp_no, _slot_no);
+    uint64_t ref_stationary = plan_->ref_bytes + plan_->cmp_bytes;
+
+    if (cmp_stationary < ref_stationary) {
+        batchTiles(plan_, BATCH_CMP_STATIONARY, _ref_no, _cmp_no, _slot_no);
+    }
+}
+
+void batchSplit(
+    std::vector<BatchTile>& tiles_,
+    const BatchTile&        _tile,
+    size_t                  _pair_no,
+    size_t                  _max_pairs,
+    size_t                  _slot_no
+){
+    size_t rows = (uint64_t)_tile.cmp_no * _max_pairs / (2 * (uint64_t)_pair_no);
+
+    if (rows == 0) {
+        rows = 1;
+    }
+    if (_slot_no == 0) {
+        _slot_no = 1;
+    }
+    size_t piece_no = (_tile.cmp_no + rows - 1) / rows;
+
+    // Pieces differ by one row at most, like the chunks of a plan
+    for (size_t piece = 0; piece < piece_no; piece++) {
+        BatchTile tile = _tile;
+
+        tile.cmp_first = _tile.cmp_first + piece * (_tile.cmp_no / piece_no)
+                       + (piece < _tile.cmp_no % piece_no ? piece : _tile.cmp_no % piece_no);
+        tile.cmp_no    = _tile.cmp_no / piece_no + (piece < _tile.cmp_no % piece_no);
+        tile.cmp_slot  = tiles_.size() % _slot_no;
+        tile.new_cmp   = true;
+        tiles_.push_back(tile);
+    }
+}
+
+void batchDecode(
+    const uint8_t*       _id_buf,
+    size_t               _pair_no,
+    const BatchTile&     _tile,
+    std::vector<IDPair>& hits_
+){
+    const size_t block = 1024;
+    const size_t pair_size = 2 * ID_SIZE;
+    uint32_t     ref_ids[block];
+    uint32_t     cmp_ids[block];
+
+    hits_.reserve(hits_.size() + _pair_no);
+
+    for (size_t first = 0; first < _pair_no; first += block) {
+        size_t n = _pair_no - first < block ? _pair_no - first : block;
+
+        decodeIDPairs(_id_buf + first * pair_size, n, ref_ids, cmp_ids);
+
+        // Kernel IDs are positions in the run's stream, back to job rows
+        for (size_t i = 0; i < n; i++) {
+            uint32_t ref_row = ref_ids[i] - 1;
+            uint32_t cmp_row = cmp_ids[i] - REF_VEC_NO - 1;
+
+            if (ref_row < _tile.ref_no && cmp_row < _tile.cmp_no) {
+                hits_.push_back({(uint32_t)(_tile.ref_first + ref_row), (uint32_t)(_tile.cmp_first + cmp_row)});
+            }
+        }
+    }
+}
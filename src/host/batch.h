@@ -0,0 +1,109 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "check.h"
+
+/*
+ * Batch scheduler
+ * The kernel compares REF_VEC_NO (SHR_DEPTH) refs against the cmp vectors
+ * that fit its ID range per run: vectors are numbered from 1 in ID_SIZE
+ * bytes, ID 0 terminates the output, so a run takes at most
+ * 2^(8 * ID_SIZE) - 1 - REF_VEC_NO cmp vectors (65527 for the default 2
+ * byte IDs). A job of N refs and M cmp vectors is cut into
+ * ceil(N / REF_VEC_NO) ref groups and ceil(M / chunk) equally sized cmp
+ * chunks, one tile per kernel run.
+ *
+ * Every run sends the ref buffer (its tail carries the start of the cmp
+ * chunk, see KernelInput); ID pairs are only read back as far as the run
+ * wrote them, the same bytes in either order. Cmp chunks are kept in
+ * _slot_no cmp buffers on the device, a chunk is only sent when it is not
+ * in one of them; the least recently used one is replaced. The two orders
+ * differ in how often that happens:
+ *
+ * BATCH_REF_STATIONARY - ref group outer, cmp chunks inner: every chunk is
+ *                        sent once per group, unless all chunks fit the slots
+ * BATCH_CMP_STATIONARY - cmp chunk outer, ref groups inner: every chunk is
+ *                        sent once
+ *
+ * batchPlan() counts the bytes each order moves between host and DDR and
+ * takes the smaller one, ref-stationary on a tie as its hits come out
+ * ref-major. With the current buffers that is cmp-stationary as soon as a
+ * job has more than one group and more chunks than slots.
+ */
+
+enum BatchOrder {
+    BATCH_REF_STATIONARY = 0,
+    BATCH_CMP_STATIONARY
+};
+
+struct BatchTile {
+    size_t ref_first;       // First job row of the ref group
+    size_t ref_no;          // Up to REF_VEC_NO, the kernel sees copies of the first after them
+    size_t cmp_first;       // First job row of the cmp chunk
+    size_t cmp_no;
+    size_t cmp_slot;        // Cmp buffer holding the chunk
+    bool   new_cmp;         // Chunk not in the slot yet, pack and send it
+};
+
+struct BatchPlan {
+    BatchOrder             order;
+    size_t                 chunk_rows;      // Cmp rows of the largest chunk
+    size_t                 group_no;
+    size_t                 chunk_no;
+    uint64_t               ref_bytes;       // Host to DDR, ref buffers
+    uint64_t               cmp_bytes;       // Host to DDR, cmp buffers
+    std::vector<BatchTile> tiles;           // In run order
+};
+
+/*
+ * Function: batchIDRange
+ * Largest number of cmp vectors one kernel run can number.
+ */
+size_t batchIDRange();
+
+/*
+ * Function: batchPlan
+ * Tiles of _ref_no x _cmp_no, _chunk_rows cmp rows per chunk at most
+ * (0: the ID range), chunks kept in _slot_no cmp buffers, in the order that
+ * moves fewer bytes.
+ */
+void batchPlan(
+    BatchPlan* plan_,
+    size_t     _ref_no,
+    size_t     _cmp_no,
+    size_t     _chunk_rows,
+    size_t     _slot_no
+);
+
+/*
+ * Function: batchSplit
+ * A run of _tile produced _pair_no ID pairs, its buffer held _max_pairs:
+ * appends tiles of the same refs and fewer cmp rows to tiles_, sized from
+ * the hit rate of the run to fill half a buffer, one row at least. Every
+ * one sends its chunk, slots go round the _slot_no cmp buffers.
+ */
+void batchSplit(
+    std::vector<BatchTile>& tiles_,
+    const BatchTile&        _tile,
+    size_t                  _pair_no,
+    size_t                  _max_pairs,
+    size_t                  _slot_no
+);
+
+/*
+ * Function: batchDecode
+ * Appends the _pair_no ID pairs of a run of _tile to hits_ as job rows.
+ * Pairs are id_pair_t as the kernel writes them (cmp ID in the low bytes,
+ * little endian), hits of padding rows are dropped.
+ */
+void batchDecode(
+    const uint8_t*       _id_buf,
+    size_t               _pair_no,
+    const BatchTile&     _tile,
+    std::vector<IDPair>& hits_
+);
+
+#endif // BATCH_H
@@ -0,0 +1,125 @@
+#include <iostream>
+#include <algorithm>
+#include <random>
+#include <vector>
+#include <stdlib.h>
+#include <getopt.h>
+#include "globals.h"
+#include "extract.h"
+#include "check.h"
+#include "../c_impl/popcnt.h"
+#include "../c_impl/bench.h"
+
+/*
+ * Benchmark of the host's result path without the accelerator: decoding the
+ * raw ID buffer (extractResults) and verifying it against the expected
+ * pairs (compareResults). The buffer is synthetic, in the accelerator's
+ * output format. Prints CSV lines in the bench.h format.
+ */
+
+// Same values as host.cpp
+const unsigned int VECTOR_WIDTH = 920;
+const unsigned int VECTOR_SIZE = (VECTOR_WIDTH + 7) / 8;
+unsigned int REF_VEC_NO = 8;
+unsigned int CMP_VEC_NO = 24;
+const unsigned int ID_SIZE = VEC_ID_WIDTH / 8;
+const unsigned int MEMORY_BUS_WIDTH_BYTES = 16;
+const unsigned int MEMORY_BUS_WIDTH_BITS = 128;
+
+#define BENCH_HOST_DEFAULT_PAIRS    (1u << 18)
+#define BENCH_HOST_DEFAULT_REPEAT   5
+
+int main(int argc, char *argv[])
+{
+    unsigned int pairNo = BENCH_HOST_DEFAULT_PAIRS;
+    unsigned int repeat = BENCH_HOST_DEFAULT_REPEAT;
+    bool header = true;
+
+    static struct option long_opts[] = {
+        // name             has_arg               flag  short-val
+        { "pairs",          required_argument   , NULL, 'P' },
+        { "repeat",         required_argument   , NULL, 'n' },
+        { "no-header",      no_argument         , NULL, 'N' },
+        { NULL,             0                   , NULL,  0  }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "P:n:N", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'P':
+                pairNo = (unsigned int)strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                repeat = (unsigned int)strtoul(optarg, NULL, 0);
+                break;
+            case 'N':
+                header = false;
+                break;
+            default:
+                std::cerr << "Usage: " << argv[0] << " [--pairs N] [--repeat N] [--no-header]" << std::endl;
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (pairNo == 0 || repeat == 0) {
+        std::cerr << "[ERROR] Pair count and repeat must be positive." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // Raw output buffer: {cmp ID, ref ID} per pair, ID_SIZE bytes each, as
+    // the accelerator writes it. IDs wrap at ID_SIZE bytes, so a pair may
+    // repeat, which compareResults() then also has to handle.
+    unsigned int idNo = pairNo * 2;
+    std::vector<uint8_t> raw(idNo * ID_SIZE);
+    std::mt19937 rng(12345);
+    for (auto &byte : raw) {
+        byte = (uint8_t)rng();
+    }
+
+    BenchRecord rec = { "host", "", popcntKernelName(popcntKernel()), VECTOR_WIDTH,
+                        REF_VEC_NO, CMP_VEC_NO, 0.0, 0.0, 1, 0.0, idNo, idNo * ID_SIZE, 0 };
+    uint32_t *ref_ids = nullptr;
+    uint32_t *cmp_ids = nullptr;
+
+    if (header) {
+        std::cout << BENCH_CSV_HEADER << std::endl;
+    }
+
+    rec.name = "extract_results";
+    for (unsigned int i = 0; i < repeat; i++) {
+        free(ref_ids);
+        free(cmp_ids);
+        double start   = benchNow();
+        extractResults(idNo, raw.data(), &ref_ids, &cmp_ids);
+        double elapsed = benchNow() - start;
+        rec.seconds    = (i == 0 || elapsed < rec.seconds) ? elapsed : rec.seconds;
+    }
+    benchPrint(&rec);
+
+    // Verify a shuffled copy of the results against themselves
+    std::vector<IDPair> results(pairNo);
+    for (unsigned int i = 0; i < pairNo; i++) {
+        results[i].ref_id = ref_ids[i];
+        results[i].cmp_id = cmp_ids[i];
+    }
+    std::vector<IDPair> expected(results);
+    std::shuffle(expected.begin(), expected.end(), rng);
+
+    rec.name  = "compare_results";
+    rec.items = pairNo;
+    rec.bytes = 0;
+    for (unsigned int i = 0; i < repeat; i++) {
+        ComparisonResult comparison;
+        double start   = benchNow();
+        compareResults(&comparison, expected.data(), results.data(), (int)pairNo, (int)pairNo);
+        double elapsed = benchNow() - start;
+        rec.seconds    = (i == 0 || elapsed < rec.seconds) ? elapsed : rec.seconds;
+        rec.hits       = (uint64_t)comparison.missing_count + comparison.unexpected_count;
+        freeComparisonResult(comparison);
+    }
+    benchPrint(&rec);
+
+    free(ref_ids);
+    free(cmp_ids);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,133 @@
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "device.h"
+#include "globals.h"
+#include "../c_impl/threshold.h"
+
+/*  ################################
+ *  DEFINES
+ */
+
+// Threshold RAM address limits
+#define BRAM_BASEADDR 0x82000000    // BRAM base address
+#define BRAM_MAXADDR 0x82001FFF     // BRAM region upper limit as integer pointer
+#define BRAM_IO_SIZE 32768          // BRAM region size in bytes
+
+/*  ################################
+ *  FUNCTION DEFINITIONS
+ */
+
+/*
+ * Function: programAccelerator
+ * The xclbin is read into a vector which is released once the program is
+ * created, the device keeps its own copy.
+ */
+int programAccelerator(
+    Accelerator* acc_,
+    const std::string& _xclbin,
+    cl_command_queue_properties _queue_props
+){
+    std::vector<cl::Device> devices;            // vector of device objects
+    std::vector<cl::Platform> platforms;        // vector of platform objects
+    cl_int err;
+    bool found_device = false;
+
+    // Find targeted device on Xilinx platform.
+    cl::Platform::get(&platforms);
+    for (size_t i = 0; (i < platforms.size()) & (found_device == false); i++) {
+        cl::Platform platform = platforms[i];
+        std::string platformName = platform.getInfo<CL_PLATFORM_NAME>();
+        if (platformName == "Xilinx") {
+            devices.clear();
+            platform.getDevices(CL_DEVICE_TYPE_ACCELERATOR, &devices);
+            if (devices.size()) {
+                found_device = true;
+                break;
+            }
+        }
+    }
+    if (found_device == false) {
+        std::cout << "[ERROR][DEVICE] Unable to find Target Device " << std::endl;
+        return 1;
+    }
+
+    std::cout << "[INFO] Opening " << _xclbin << std::endl;
+    std::ifstream bin_file(_xclbin, std::ifstream::binary);
+    if (!bin_file) {
+        printf("[ERROR][FILE_OPS] %s xclbin not available please run <make xclbin> in the project root directory.\n", _xclbin.c_str());
+        return 1;
+    }
+    // Load xclbin
+    std::cout << "Loading: '" << _xclbin << "'\n";
+    bin_file.seekg(0, bin_file.end);
+    size_t nb = bin_file.tellg();
+    bin_file.seekg(0, bin_file.beg);
+    std::vector<char> buf(nb);
+    bin_file.read(buf.data(), nb);
+
+    // Creating Program from Binary File
+    cl::Program::Binaries bins;
+    bins.push_back({buf.data(), nb});
+    for (unsigned int i = 0; i < devices.size(); i++) {
+        auto device = devices[i];
+        // Creating Context and Command Queue for selected Device
+        OCL_CHECK(err, acc_->context = cl::Context(device, nullptr, nullptr, nullptr, &err));
+        OCL_CHECK(err, acc_->q = cl::CommandQueue(acc_->context, device, _queue_props, &err));
+        std::cout << "[INFO] Attempting to program device[" << i << "]: " << device.getInfo<CL_DEVICE_NAME>() << std::endl;
+        cl::Program program(acc_->context, {device}, bins, nullptr, &err);
+        if (err != CL_SUCCESS) {
+            std::cout << "[ERROR][DEVICE] Failed to program device[" << i << "] with xclbin file!\n";
+        } else {
+            std::cout << "[INFO] Device[" << i << "]: program successful!\n";
+            OCL_CHECK(err, acc_->kernel = cl::Kernel(program, "hls_dma", &err));   // hls_dma is the visible interface of the kernel
+            return 0;
+        }
+    }
+
+    std::cout << "[ERROR][DEVICE] Failed to program any device found, exit!\n";
+    return 1;
+}
+
+/*
+ * Function: configureThresholdRAM
+ * Load division results to the threshold BRAM in the comparator module
+ * See documentation on how this avoids doing division in the PL
+ * Use /dev/mem and mmap to access memory mapped IO in physical memory
+ */
+int configureThresholdRAM(float _threshold){
+    int mem_fp = open("/dev/mem", O_RDWR | O_SYNC);
+    if(mem_fp < 0){
+        std::cout << "[ERROR][CFG_THRESHOLD] Cannot open /dev/mem.\n";
+        return 1;
+    }
+
+    void *mem = mmap(0, BRAM_IO_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fp, BRAM_BASEADDR);
+    if (mem == MAP_FAILED){
+        std::cout << "[ERROR][CFG_THRESHOLD] mmap() call failed, cannot access BRAM IO!\n";
+        close(mem_fp);
+        return 1;
+    }
+
+    // Configure threshold RAM, with the same table the software search uses
+    ThresholdTable table;
+    if (thresholdTableInit(&table, VECTOR_WIDTH, _threshold)) {
+        munmap(mem, BRAM_IO_SIZE);
+        close(mem_fp);
+        return 1;
+    }
+
+    unsigned int *bram = (unsigned int*) mem;
+    for(unsigned int cnt_c = 0; cnt_c <= VECTOR_WIDTH; cnt_c++){
+        *(bram + cnt_c) = table.table[cnt_c];
+    }
+    thresholdTableFree(&table);
+
+    munmap(mem, BRAM_IO_SIZE);
+    close(mem_fp);
+    return 0;
+}
@@ -0,0 +1,44 @@
+#ifndef DEVICE_H
+#define DEVICE_H
+
+#include <string>
+#include "host.h"
+
+// Macro that submits OpenCL calls, then checks whether an error has occurred.
+#define OCL_CHECK(error, call)                                                                   \
+    call;                                                                                        \
+    if (error != CL_SUCCESS) {                                                                   \
+        printf("[ERROR][OCL_CHECK] %s:%d Error calling " #call ", error code is: %d\n", __FILE__, __LINE__, error); \
+        exit(EXIT_FAILURE);                                                                      \
+    }
+
+/*
+ * Struct: Accelerator
+ * A programmed device: its context, command queue and the hls_dma kernel.
+ * Buffers are created by the user of the device.
+ */
+struct Accelerator {
+    cl::Context      context;
+    cl::CommandQueue q;
+    cl::Kernel       kernel;
+};
+
+/*
+ * Function: programAccelerator
+ * Find the Xilinx accelerator, program it with the xclbin and create the
+ * queue (with queue_props) and kernel. Returns 0 on success.
+ */
+int programAccelerator(
+    Accelerator* acc_,
+    const std::string& _xclbin,
+    cl_command_queue_properties _queue_props
+);
+
+/*
+ * Function: configureThresholdRAM
+ * Write the threshold table for _threshold to the comparator's BRAM.
+ * Returns 0 on success.
+ */
+int configureThresholdRAM(float _threshold);
+
+#endif // DEVICE_H
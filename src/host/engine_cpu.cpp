@@ -0,0 +1,68 @@
+#include <iostream>
+#include "server.h"
+#include "../c_impl/popcnt.h"
+#include "../c_impl/search.h"
+#include "../c_impl/worksteal.h"
+
+/*
+ * Function: collectHit
+ * HitSink of the CPU engine, IDs are the job's row indices.
+ */
+static void collectHit(void* _ctx, uint32_t _ref_id, uint32_t _cmp_id, double _coeff)
+{
+    (void)_coeff;
+    static_cast<std::vector<IDPair>*>(_ctx)->push_back({_ref_id, _cmp_id});
+}
+
+/*
+ * Class: CpuEngine
+ * searchParallel() on the job's stores. The threshold table of the last
+ * dissimilarity job is kept, interactive clients tend to reuse a threshold.
+ * Similarity jobs sort cmp by weight first, so the weight bound prunes.
+ */
+class CpuEngine : public Engine {
+public:
+    explicit CpuEngine(unsigned int _thread_no)
+        : thread_no(_thread_no ? _thread_no : workStealDefaultThreads()) {}
+
+    ~CpuEngine() override { thresholdTableFree(&table); }
+
+    const char* name() const override { return "cpu"; }
+
+    JobStatus run(SearchJob& job_, std::vector<IDPair>& hits_) override
+    {
+        WeightBuckets buckets = { 0, NULL };
+        SearchConfig cfg = { job_.threshold, MATCH_SIMILAR, thread_no, NULL, NULL, 0, SPARSE_AUTO };
+
+        if (job_.flags & JOB_FLAG_SIMILAR) {
+            if (fpStoreSortByWeight(&job_.cmp, &buckets)) {
+                return JOB_FAILED;
+            }
+            cfg.cmpBuckets = &buckets;
+        } else {
+            if (!table.table || table.width != job_.cmp.width || table.threshold != (float)job_.threshold) {
+                thresholdTableFree(&table);
+                if (thresholdTableInit(&table, job_.cmp.width, (float)job_.threshold)) {
+                    return JOB_FAILED;
+                }
+            }
+            cfg.mode  = MATCH_TABLE;
+            cfg.table = &table;
+        }
+
+        int error = searchParallel(&job_.ref, &job_.cmp, &cfg, collectHit, &hits_, NULL);
+        weightBucketsFree(&buckets);
+        return error ? JOB_FAILED : JOB_OK;
+    }
+
+private:
+    unsigned int   thread_no;
+    ThresholdTable table = { 0, 0, 0.0f, 0, NULL };
+};
+
+Engine* createCpuEngine(unsigned int _thread_no)
+{
+    std::cout << "[INFO] CPU engine, " << (_thread_no ? _thread_no : workStealDefaultThreads())
+              << " threads, " << popcntKernelName(popcntKernel()) << " kernel.\n";
+    return new CpuEngine(_thread_no);
+}
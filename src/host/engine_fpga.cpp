@@ -0,0 +1,195 @@
+#include <iostream>
+#include "engine_kernel.h"
+#include "device.h"
+#include "globals.h"
+
+/*
+ * Class: FpgaEngine
+ * The device is programmed once, context, queue, kernel and buffers live as
+ * long as the engine. The ref and cmp buffers stay mapped: the ref buffers
+ * hold one group of refs and the start of the cmp data, the cmp buffers grow
+ * to the largest chunk seen so far and are reused by every later job. The
+ * ID buffers have a fixed size (KERNEL_ID_PAIRS) and are never uploaded,
+ * the kernel writes the number of pairs of a run to a one word count
+ * buffer and only that prefix is read back. The threshold RAM is only
+ * rewritten when a job's threshold differs from the last one.
+ *
+ * The queue is out of order, a run's commands are chained by events: the
+ * upload of its ref buffer, the task waiting for it and for the last upload
+ * of its chunk, the read back of the count waiting for the task. Runs on
+ * different sets are independent, so the device moves the next set's data
+ * while the kernel runs. Kernel arguments are set before
+ * each task and taken as they are at the enqueue. The same code runs on
+ * XRT's emulation targets (XCL_EMULATION_MODE) without a board.
+ */
+class FpgaEngine : public KernelEngine {
+public:
+    ~FpgaEngine() override
+    {
+        cl_int err;
+
+        if (!ptr_ref[0]) {
+            return;     // open() failed
+        }
+        releaseCmpBuffers();
+        for (unsigned int i = 0; i < KERNEL_SET_NO; i++) {
+            OCL_CHECK(err, err = acc.q.enqueueUnmapMemObject(ref_buffer[i], ptr_ref[i]));
+        }
+        OCL_CHECK(err, err = acc.q.finish());
+    }
+
+    const char* name() const override { return "fpga"; }
+
+    /*
+     * Function: open
+     * Program the device and set up the ref buffers, returns 0 on success.
+     */
+    int open(const std::string& _xclbin)
+    {
+        KernelInput layout;
+        cl_int err;
+
+        if (programAccelerator(&acc, _xclbin, CL_QUEUE_PROFILING_ENABLE | CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE)) {
+            return 1;
+        }
+
+        // The ref and ID buffers do not depend on the cmp count
+        kernelInputLayout(&layout, 0);
+        for (unsigned int i = 0; i < KERNEL_SET_NO; i++) {
+            id_host[i].resize((size_t)KERNEL_ID_PAIRS * ID_SIZE * 2);
+            ptr_idp[i] = id_host[i].data();
+            OCL_CHECK(err, ref_buffer[i] = cl::Buffer(acc.context, CL_MEM_READ_ONLY, layout.ref_buf_size, NULL, &err));
+            OCL_CHECK(err, id_pair_buffer[i] = cl::Buffer(acc.context, CL_MEM_WRITE_ONLY, id_host[i].size(), NULL, &err));
+            OCL_CHECK(err, id_count_buffer[i] = cl::Buffer(acc.context, CL_MEM_WRITE_ONLY, sizeof(uint32_t), NULL, &err));
+            OCL_CHECK(err, ptr_ref[i] =
+                (uint8_t*)acc.q.enqueueMapBuffer(ref_buffer[i], CL_TRUE, CL_MAP_WRITE, 0, layout.ref_buf_size, NULL, NULL, &err));
+        }
+        return 0;
+    }
+
+protected:
+    int writeThreshold(float _threshold) override
+    {
+        if (configureThresholdRAM(_threshold)) {
+            std::cout << "[ERROR][CFG_THRESHOLD] Someting went wrong when accessing the memory mapped threshold BRAMs.\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    /*
+     * Function: reserveBuffers
+     * Grow the cmp buffers to at least _cmp_no rows, in powers of two.
+     */
+    void reserveBuffers(const KernelInput& _layout, size_t _cmp_no) override
+    {
+        KernelInput grown;
+        cl_int err;
+
+        (void)_layout;
+        if (_cmp_no <= cmp_capacity) {
+            return;
+        }
+        releaseCmpBuffers();
+
+        cmp_capacity = 1;
+        while (cmp_capacity < _cmp_no) {
+            cmp_capacity *= 2;
+        }
+        kernelInputLayout(&grown, cmp_capacity);
+        cmp_buf_size = grown.cmp_buf_size;
+
+        std::cout << "[INFO] Growing OCL buffers to " << cmp_capacity << " compare vectors.\n";
+        for (unsigned int i = 0; i < KERNEL_SET_NO; i++) {
+            OCL_CHECK(err, cmp_buffer[i] = cl::Buffer(acc.context, CL_MEM_READ_ONLY, cmp_buf_size, NULL, &err));
+            OCL_CHECK(err, ptr_cmp[i] =
+                (uint8_t*)acc.q.enqueueMapBuffer(cmp_buffer[i], CL_TRUE, CL_MAP_WRITE, 0, cmp_buf_size, NULL, NULL, &err));
+        }
+    }
+
+    void submit(unsigned int _set, unsigned int _slot, const KernelInput& _layout, bool _send_cmp) override
+    {
+        std::vector<cl::Event> inputs(2);
+        std::vector<cl::Event> task(1);
+        cl_int err;
+
+        // The task waits for its set and for the upload of its chunk, which an earlier run may have sent
+        if (_send_cmp) {
+            OCL_CHECK(err, err = acc.q.enqueueMigrateMemObjects({cmp_buffer[_slot]}, 0 /* 0 means from host*/,
+                                                                NULL, &cmp_sent[_slot]));
+        }
+        OCL_CHECK(err, err = acc.q.enqueueMigrateMemObjects({ref_buffer[_set]}, 0, NULL, &inputs[0]));
+        inputs[1] = cmp_sent[_slot];
+
+        OCL_CHECK(err, err = acc.kernel.setArg(0, ref_buffer[_set]));
+        OCL_CHECK(err, err = acc.kernel.setArg(1, cmp_buffer[_slot]));
+        OCL_CHECK(err, err = acc.kernel.setArg(4, id_pair_buffer[_set]));
+        OCL_CHECK(err, err = acc.kernel.setArg(5, _layout.ref_bus_cycle_no));
+        OCL_CHECK(err, err = acc.kernel.setArg(6, _layout.cmp_bus_cycle_no));
+        OCL_CHECK(err, err = acc.kernel.setArg(7, (unsigned int)KERNEL_ID_PAIRS));
+        OCL_CHECK(err, err = acc.kernel.setArg(8, id_count_buffer[_set]));
+        OCL_CHECK(err, err = acc.q.enqueueTask(acc.kernel, &inputs, &task[0]));
+
+        OCL_CHECK(err, err = acc.q.enqueueReadBuffer(id_count_buffer[_set], CL_FALSE, 0, sizeof(uint32_t),
+                                                     &id_counts[_set], &task, &read_back[_set]));
+        OCL_CHECK(err, err = acc.q.flush());
+    }
+
+    /*
+     * Function: complete
+     * Wait for the count of the run on _set, then read back the pairs the
+     * ID buffer holds of it, not the whole buffer.
+     */
+    int complete(unsigned int _set, size_t* pair_no_) override
+    {
+        cl_int err;
+
+        OCL_CHECK(err, err = read_back[_set].wait());
+        *pair_no_ = id_counts[_set];
+
+        size_t pair_no = *pair_no_ < KERNEL_ID_PAIRS ? *pair_no_ : KERNEL_ID_PAIRS;
+        if (pair_no) {
+            OCL_CHECK(err, err = acc.q.enqueueReadBuffer(id_pair_buffer[_set], CL_TRUE, 0, pair_no * ID_SIZE * 2,
+                                                         ptr_idp[_set]));
+        }
+        return 0;
+    }
+
+private:
+    void releaseCmpBuffers()
+    {
+        cl_int err;
+
+        if (cmp_capacity == 0) {
+            return;
+        }
+        for (unsigned int i = 0; i < KERNEL_SET_NO; i++) {
+            OCL_CHECK(err, err = acc.q.enqueueUnmapMemObject(cmp_buffer[i], ptr_cmp[i]));
+        }
+        OCL_CHECK(err, err = acc.q.finish());
+        cmp_capacity = 0;
+    }
+
+    Accelerator acc;
+    cl::Buffer  ref_buffer[KERNEL_SET_NO];
+    cl::Buffer  cmp_buffer[KERNEL_SET_NO];      // By slot
+    cl::Buffer  id_pair_buffer[KERNEL_SET_NO];
+    cl::Buffer  id_count_buffer[KERNEL_SET_NO];
+    cl::Event   cmp_sent[KERNEL_SET_NO];        // Last upload of the chunk, by slot
+    cl::Event   read_back[KERNEL_SET_NO];       // Last run's count read back, by set
+    uint32_t    id_counts[KERNEL_SET_NO] = {};
+    std::vector<uint8_t> id_host[KERNEL_SET_NO];    // Pairs read back, ptr_idp
+    size_t      cmp_buf_size = 0;
+    size_t      cmp_capacity = 0;
+};
+
+Engine* createFpgaEngine(const std::string& _xclbin)
+{
+    FpgaEngine* engine = new FpgaEngine();
+
+    if (engine->open(_xclbin)) {
+        delete engine;
+        return nullptr;
+    }
+    return engine;
+}
@@ -0,0 +1,130 @@
+#include <iostream>
+#include <algorithm>
+#include "engine_kernel.h"
+#include "globals.h"
+
+JobStatus KernelEngine::run(SearchJob& job_, std::vector<IDPair>& hits_)
+{
+    const FingerprintStore& ref = job_.ref;
+    const FingerprintStore& cmp = job_.cmp;
+
+    if (job_.flags & JOB_FLAG_SIMILAR) {
+        std::cout << "[ERROR][JOB] The accelerator only runs dissimilarity searches.\n";
+        return JOB_UNSUPPORTED;
+    }
+    if (ref.width != VECTOR_WIDTH) {
+        std::cout << "[ERROR][JOB] The accelerator takes " << VECTOR_WIDTH << "-bit vectors, not "
+                  << ref.width << "-bit.\n";
+        return JOB_UNSUPPORTED;
+    }
+    if (ref.count == 0 || cmp.count == 0) {
+        return JOB_OK;
+    }
+
+    if ((float)job_.threshold != threshold) {
+        if (writeThreshold((float)job_.threshold)) {
+            return JOB_FAILED;
+        }
+        threshold = (float)job_.threshold;
+    }
+
+    BatchPlan   plan;
+    KernelInput layout;
+
+    batchPlan(&plan, ref.count, cmp.count, KERNEL_CHUNK_ROWS, KERNEL_SET_NO);
+    if (plan.tiles.size() > 1) {
+        std::cout << "[INFO] " << plan.group_no << " ref groups x " << plan.chunk_no << " cmp chunks, "
+                  << (plan.order == BATCH_REF_STATIONARY ? "ref" : "cmp") << "-stationary, "
+                  << (plan.ref_bytes + plan.cmp_bytes) / 1024 << " KiB sent.\n";
+    }
+    kernelInputLayout(&layout, plan.chunk_rows);
+    reserveBuffers(layout, plan.chunk_rows);
+
+    // Overflowed tiles run again in pieces, until no run overflows
+    std::vector<BatchTile> tiles = std::move(plan.tiles);
+
+    while (!tiles.empty()) {
+        std::vector<BatchTile> overflow;
+
+        if (runTiles(job_, tiles, hits_, overflow)) {
+            return JOB_FAILED;
+        }
+        if (!overflow.empty()) {
+            std::cout << "[INFO] ID buffers overflowed, rerunning as " << overflow.size() << " smaller tiles.\n";
+        }
+        tiles.swap(overflow);
+    }
+    return JOB_OK;
+}
+
+int KernelEngine::runTiles(
+    const SearchJob&              _job,
+    const std::vector<BatchTile>& _tiles,
+    std::vector<IDPair>&          hits_,
+    std::vector<BatchTile>&       overflow_
+){
+    const FingerprintStore& ref = _job.ref;
+    const FingerprintStore& cmp = _job.cmp;
+    KernelInput layout;
+
+    size_t slot_user[KERNEL_SET_NO];    // Last tile on the slot, + 1
+    size_t submitted = 0;
+    size_t retired = 0;                 // Tiles complete and decoded
+    int    error = 0;
+
+    std::fill(slot_user, slot_user + KERNEL_SET_NO, 0);
+
+    // Complete and decode the tiles before _end in order, failed runs are still waited for
+    auto retire = [&](size_t _end) {
+        for (; retired < _end; retired++) {
+            const BatchTile& tile = _tiles[retired];
+            unsigned int     set  = retired % KERNEL_SET_NO;
+            size_t           pair_no = 0;
+
+            if (complete(set, &pair_no)) {
+                error = 1;
+            } else if (error) {
+                continue;
+            } else if (pair_no <= KERNEL_ID_PAIRS) {
+                batchDecode(ptr_idp[set], pair_no, tile, hits_);
+            } else if (tile.cmp_no > 1) {
+                batchSplit(overflow_, tile, pair_no, KERNEL_ID_PAIRS, KERNEL_SET_NO);
+            } else {
+                std::cout << "[ERROR][JOB] One cmp row produced " << pair_no << " ID pairs, an ID buffer holds "
+                          << KERNEL_ID_PAIRS << ".\n";
+                error = 1;
+            }
+        }
+    };
+
+    for (size_t k = 0; k < _tiles.size() && !error; k++) {
+        const BatchTile& tile = _tiles[k];
+        unsigned int     set  = k % KERNEL_SET_NO;
+        unsigned int     slot = tile.cmp_slot;
+        FingerprintStore rows = ref;
+        FingerprintStore chunk = cmp;
+
+        rows.bits   = fpStoreRow(&ref, tile.ref_first);
+        rows.count  = tile.ref_no;
+        chunk.bits  = fpStoreRow(&cmp, tile.cmp_first);
+        chunk.count = tile.cmp_no;
+        kernelInputLayout(&layout, tile.cmp_no);
+
+        if (k >= KERNEL_SET_NO) {
+            retire(k - KERNEL_SET_NO + 1);
+        }
+        if (tile.new_cmp) {
+            retire(slot_user[slot]);
+            packKernelCmp(&layout, &chunk, ptr_cmp[slot]);
+        }
+        slot_user[slot] = k + 1;
+
+        packKernelRefs(&layout, &rows, ptr_ref[set]);
+        packKernelTail(&layout, &chunk, ptr_ref[set]);
+        submit(set, slot, layout, tile.new_cmp);
+        submitted = k + 1;
+    }
+    retire(submitted);
+
+    return error;
+}
@@ -0,0 +1,71 @@
+#ifndef ENGINE_KERNEL_H
+#define ENGINE_KERNEL_H
+
+#include <cmath>
+#include "server.h"
+#include "extract.h"
+#include "batch.h"
+
+// Buffer sets in flight: one being filled, one on the kernel, one being read back
+#define KERNEL_SET_NO       3
+
+// Cmp rows per run at most, with 32-bit IDs the ID range would not bound the buffers
+#define KERNEL_CHUNK_ROWS   (1u << 18)
+
+// ID pairs an ID buffer holds, whatever the chunk size
+#define KERNEL_ID_PAIRS     (1u << 18)
+
+/*
+ * Class: KernelEngine
+ * Engine on the hls_dma kernel interface, whatever runs the kernel: the
+ * device (FpgaEngine) or the behavioural model (ModelEngine). The base runs
+ * a job as the host does, subclasses provide the buffers and the runs.
+ *
+ * A job runs as the tiles batchPlan() cuts it into, one kernel run each:
+ * up to REF_VEC_NO (SHR_DEPTH) refs, padded with copies of the first,
+ * against a cmp chunk that fits the kernel's ID range. The buffers are laid
+ * out as KernelInput describes, and the kernel's IDs are mapped back to job
+ * rows while decoding.
+ *
+ * Runs are pipelined over KERNEL_SET_NO buffer sets (ref and ID buffer)
+ * and as many cmp buffers (slots, a chunk is only sent when it is in none
+ * of them). submit() queues the upload, the run and the read back of a set
+ * without waiting, complete() waits for them. While tile k runs, tile k + 1
+ * is packed and uploaded and tile k - 1 decoded; a set or slot is only
+ * reused once every tile that used it is complete, tiles are decoded in
+ * plan order.
+ *
+ * ID buffers hold KERNEL_ID_PAIRS pairs, however many cmp rows a chunk has.
+ * The kernel counts the pairs of a run and only that many are read back. A
+ * run that produced more is not decoded, its tile is split (batchSplit())
+ * and the pieces run once the rest of the job is through, again until none
+ * overflows.
+ */
+class KernelEngine : public Engine {
+public:
+    JobStatus run(SearchJob& job_, std::vector<IDPair>& hits_) override;
+
+protected:
+    // Threshold table of _threshold to the comparators, 0 on success. No run is in flight
+    virtual int  writeThreshold(float _threshold) = 0;
+    // Every slot's cmp buffer for chunks of up to _cmp_no rows. No run is in flight
+    virtual void reserveBuffers(const KernelInput& _layout, size_t _cmp_no) = 0;
+    // Queue a run on set _set and slot _slot, the slot's cmp buffer is sent first if _send_cmp
+    virtual void submit(unsigned int _set, unsigned int _slot, const KernelInput& _layout, bool _send_cmp) = 0;
+    // Wait for the last run submitted on _set, pair_no_ the ID pairs it produced; the first
+    // KERNEL_ID_PAIRS of them at most are in its ID buffer afterwards. 0 on success
+    virtual int  complete(unsigned int _set, size_t* pair_no_) = 0;
+
+    uint8_t* ptr_ref[KERNEL_SET_NO] = {};
+    uint8_t* ptr_cmp[KERNEL_SET_NO] = {};
+    uint8_t* ptr_idp[KERNEL_SET_NO] = {};   // KERNEL_ID_PAIRS pairs each
+
+private:
+    // Run _tiles through the sets, the pieces of the ones that overflowed into overflow_. 0 on success
+    int      runTiles(const SearchJob& _job, const std::vector<BatchTile>& _tiles,
+                      std::vector<IDPair>& hits_, std::vector<BatchTile>& overflow_);
+
+    float    threshold = NAN;       // Threshold the comparators have, none yet
+};
+
+#endif // ENGINE_KERNEL_H
@@ -0,0 +1,113 @@
+#include <iostream>
+#include <future>
+#include <vector>
+#include "engine_kernel.h"
+#include "model.h"
+#include "globals.h"
+
+/*
+ * Class: ModelEngine
+ * The FPGA engine's job path with hlsDmaModel() in place of the device:
+ * same buffer layout, same kernel arguments, same ID decoding, same
+ * pipeline. Buffers are host vectors, the cmp ones grow like the OCL
+ * buffers do.
+ * Runs are asynchronous like the device's: each one on its own thread,
+ * started once the run submitted before it has finished, so the kernel
+ * runs one at a time while the host packs and decodes the other sets.
+ */
+class ModelEngine : public KernelEngine {
+public:
+    ModelEngine()
+    {
+        KernelInput layout;
+
+        kernelInputLayout(&layout, 0);
+        for (unsigned int i = 0; i < KERNEL_SET_NO; i++) {
+            ref_buf[i].resize(layout.ref_buf_size);
+            idp_buf[i].resize((size_t)KERNEL_ID_PAIRS * ID_SIZE * 2);
+            ptr_ref[i] = ref_buf[i].data();
+            ptr_idp[i] = idp_buf[i].data();
+        }
+    }
+
+    ~ModelEngine() override
+    {
+        if (last_run.valid()) {
+            last_run.wait();
+        }
+        thresholdTableFree(&table);
+    }
+
+    const char* name() const override { return "model"; }
+
+protected:
+    int writeThreshold(float _threshold) override
+    {
+        thresholdTableFree(&table);
+        return thresholdTableInit(&table, VECTOR_WIDTH, _threshold);
+    }
+
+    void reserveBuffers(const KernelInput& _layout, size_t _cmp_no) override
+    {
+        (void)_cmp_no;
+        for (unsigned int i = 0; i < KERNEL_SET_NO; i++) {
+            if (_layout.cmp_buf_size > cmp_buf[i].size()) {
+                cmp_buf[i].resize(_layout.cmp_buf_size);
+            }
+            ptr_cmp[i] = cmp_buf[i].data();
+        }
+    }
+
+    void submit(unsigned int _set, unsigned int _slot, const KernelInput& _layout, bool _send_cmp) override
+    {
+        std::shared_future<int> previous = last_run;
+        const uint8_t* vec_ref = ptr_ref[_set];
+        const uint8_t* vec_cmp = ptr_cmp[_slot];
+        uint8_t*       id_out  = ptr_idp[_set];
+        uint32_t*      id_count = &id_counts[_set];
+        unsigned int   ref_sub_vec_no = _layout.ref_bus_cycle_no;
+        unsigned int   cmp_sub_vec_no = _layout.cmp_bus_cycle_no;
+
+        (void)_send_cmp;
+        last_run = std::async(std::launch::async, [=]() {
+            ModelStats stats;
+
+            if (previous.valid()) {
+                previous.wait();
+            }
+            if (hlsDmaModel(vec_ref, vec_cmp, id_out, ref_sub_vec_no, cmp_sub_vec_no, KERNEL_ID_PAIRS, id_count,
+                            &table, &stats)) {
+                return 1;
+            }
+            if (stats.max_fifo > MODEL_FIFO_DEPTH) {
+                std::cout << "[INFO] A FIFO of the model held " << stats.max_fifo
+                          << " pairs, the device would have halted the pipeline.\n";
+            }
+            return 0;
+        }).share();
+        runs[_set] = last_run;
+    }
+
+    int complete(unsigned int _set, size_t* pair_no_) override
+    {
+        int error = runs[_set].get();
+
+        *pair_no_ = id_counts[_set];
+        return error;
+    }
+
+private:
+    std::vector<uint8_t>    ref_buf[KERNEL_SET_NO];
+    std::vector<uint8_t>    cmp_buf[KERNEL_SET_NO];     // By slot
+    std::vector<uint8_t>    idp_buf[KERNEL_SET_NO];
+    uint32_t                id_counts[KERNEL_SET_NO] = {};
+    std::shared_future<int> runs[KERNEL_SET_NO];        // Last run, by set
+    std::shared_future<int> last_run;                   // Last run submitted
+    ThresholdTable          table = { 0, 0, 0.0f, 0, NULL };
+};
+
+Engine* createModelEngine()
+{
+    std::cout << "[INFO] Model engine, behavioural model of the kernel.\n";
+    return new ModelEngine();
+}
@@ -2,58 +2,159 @@
 #include <iostream>
 #include <bitset>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include "host.h"
 #include "globals.h"
-#include <CL/cl2.hpp>
+#include "extract.h"
+#include "../c_impl/resultfile.h"
+
+/*
+ * Function: mapVectorsFile
+ * Map a fingerprint file, the rows are used in place. The file's width
+ * must be the accelerator's VECTOR_WIDTH.
+ */
+static int mapVectorsFile(FingerprintStore *ref_, FingerprintStore *cmp_, const char *_filename)
+{
+    FingerprintFileHeader header;
+
+    if (fpStoreReadFileHeader(_filename, &header)) {
+        return 1;
+    }
+
+    if (header.width != VECTOR_WIDTH || header.count <= REF_VEC_NO) {
+        std::cout << "[ERROR][FILE_OPS] Fingerprint file holds " << header.width << "-bit vectors instead of "
+                  << VECTOR_WIDTH << "-bit ones, or no compare vectors.\n";
+        return 1;
+    }
+
+    if (fpStoreMapFile(ref_, _filename, 0, REF_VEC_NO)) {
+        return 1;
+    }
+    if (fpStoreMapFile(cmp_, _filename, REF_VEC_NO, FP_STORE_ALL)) {
+        fpStoreFree(ref_);
+        return 1;
+    }
+
+    // The mapping is private, the file keeps its own IDs
+    fpStoreAssignIDs(ref_, 1);
+    fpStoreAssignIDs(cmp_, REF_VEC_NO + 1);
+
+    return 0;
+}
 
 /*
  * Function: readVectorsFromFile
- * ptr_ref_ - pre-allocated output array to contain reference vectors
- * ptr_cmp_ - pre-allocated output array to contain compare vectors
+ * ref_ - output store for reference vectors, _allocated by the function_
+ * cmp_ - output store for compare vectors, _allocated by the function_
  * _filename - fully binary file to read vectors from
  * 
  * Description:
- * - Open binary file, read contents into _output arrays already existing in memory._
- * - Required globals: REF_VEC_NO, CMP_VEC_NO
+ * - Open binary file, the first REF_VEC_NO vectors are reference vectors,
+ *   every other vector in the file is a compare vector.
+ * - Fingerprint files (see fpstore.h) are mapped, anything else is read as
+ *   packed vectors without a header.
+ * - IDs are assigned the way the accelerator numbers its input: 1, 2, ...
+ * - Required globals: VECTOR_WIDTH, VECTOR_SIZE, REF_VEC_NO
  */
-int readVectorsFromFile(uint8_t *ptr_ref_, uint8_t *ptr_cmp_, const char *_filename)
+int readVectorsFromFile(FingerprintStore *ref_, FingerprintStore *cmp_, const char *_filename)
 {
+    uint32_t magic = 0;
     FILE *fp = fopen(_filename, "rb");
     if (fp == NULL) {
         perror("[ERROR][FILE_OPS] Error opening vectors file");
         return 1;
     }
 
-    size_t refBytes = REF_VEC_NO * 115;
-    size_t cmpBytes = CMP_VEC_NO * 115;
+    if (fread(&magic, sizeof(magic), 1, fp) == 1 && magic == FP_FILE_MAGIC) {
+        fclose(fp);
+        return mapVectorsFile(ref_, cmp_, _filename);
+    }
 
-    /* Read reference vectors (refBytes total) */
-    size_t bytesRead = fread(ptr_ref_, sizeof(uint8_t), refBytes, fp);
-    if (bytesRead != refBytes) {
-        perror("[ERROR][FILE_OPS] Error reading reference vectors");
+    if (fseek(fp, 0, SEEK_END) != 0) {
+        perror("[ERROR][FILE_OPS] Error seeking vectors file");
         fclose(fp);
         return 1;
     }
 
-    /* Read comparison vectors (cmpBytes total) */
-    bytesRead = fread(ptr_cmp_, sizeof(uint8_t), cmpBytes, fp);
-    if (bytesRead != cmpBytes) {
-        perror("[ERROR][FILE_OPS] Error reading comparison vectors");
+    long bytes = ftell(fp);
+    rewind(fp);
+
+    if (bytes < 0 || (bytes % VECTOR_SIZE) != 0 || (size_t) bytes / VECTOR_SIZE <= REF_VEC_NO) {
+        std::cout << "[ERROR][FILE_OPS] Vectors file size is not a multiple of " << VECTOR_SIZE
+                  << " bytes, or holds no compare vectors.\n";
         fclose(fp);
         return 1;
     }
 
+    size_t vecNo = (size_t) bytes / VECTOR_SIZE;
+
+    if (fpStoreInit(ref_, REF_VEC_NO, VECTOR_WIDTH) ||
+        fpStoreInit(cmp_, vecNo - REF_VEC_NO, VECTOR_WIDTH)) {
+        fclose(fp);
+        return 1;
+    }
+
+    /* Read reference vectors, then comparison vectors */
+    if (fpStoreReadPacked(ref_, fp) || fpStoreReadPacked(cmp_, fp)) {
+        std::cout << "[ERROR][FILE_OPS] Error reading vectors.\n";
+        fpStoreFree(ref_);
+        fpStoreFree(cmp_);
+        fclose(fp);
+        return 1;
+    }
+
+    fpStoreAssignIDs(ref_, 1);
+    fpStoreAssignIDs(cmp_, REF_VEC_NO + 1);
+
     fclose(fp);
     return 0;
 }
 
+/*
+ * Function: readCompactIDs
+ * Decode a compact result file (see resultfile.h) straight from its mapping
+ * into the interleaved ID array readIDsFromFile() returns.
+ */
+static size_t readCompactIDs(uint32_t** buf_out_, const char* _filename)
+{
+    ResultReader reader;
+    uint32_t ref_id, cmp_id;
+
+    if (resultReaderOpen(&reader, _filename) != 0) {
+        return -1;
+    }
+
+    size_t no_ids = (size_t) reader.header.pairNo * 2;
+    uint32_t *buf_in = (uint32_t*) malloc((no_ids ? no_ids : 1) * sizeof(uint32_t));
+    if (buf_in == NULL) {
+        std::cout << "[ERROR][FILE_OPS] Failed to allocate the expected IDs.\n";
+        resultReaderClose(&reader);
+        return -1;
+    }
+
+    size_t i = 0;
+    while (i < no_ids && resultReaderNext(&reader, &ref_id, &cmp_id, NULL) == 1) {
+        buf_in[i++] = ref_id;
+        buf_in[i++] = cmp_id;
+    }
+    resultReaderClose(&reader);
+
+    if (i != no_ids) {
+        std::cout << "[ERROR][FILE_OPS] Compact results file is truncated or corrupt.\n";
+        free(buf_in);
+        return -1;
+    }
+
+    *buf_out_ = buf_in;
+    return no_ids;
+}
+
 /*
  * Function: readIDsFromFile
  * buf_out_ - data output pointer, _memory will be allocated by the function_
- * _filename - filename
+ * _filename - filename, raw interleaved uint32_t IDs or a compact result file
  */
 size_t readIDsFromFile(uint32_t** buf_out_, const char* _filename)
 {
@@ -63,6 +164,10 @@ size_t readIDsFromFile(uint32_t** buf_out_, const char* _filename)
 
     std::cout << "[INFO] Read pre-calculated IDs from results file." << std::endl;
 
+    if (resultFileIsCompact(_filename)) {
+        return readCompactIDs(buf_out_, _filename);
+    }
+
     FILE *fp = fopen(_filename, "rb");
     if (fp == NULL) {
         perror("[ERROR][FILE_OPS] Error opening results file");
@@ -136,30 +241,48 @@ void extractExpectedIDs(
 }
 
 /*
- * Function: countOutputIDs
- * _id_buf - input array containing an unknown number of ID-pairs, terminated by a 0 ID.
+ * Function: decodeIDPairsOf
+ * decodeIDPairs() for one pair word type: plain loads, masks and shifts
+ * without branches, which the compiler vectorizes (SSE/AVX2, NEON). Words
+ * are read in host byte order, both targets are little endian.
  */
-unsigned int countOutputIDs(
-    uint8_t* _id_buf
+template <typename Pair>
+static void decodeIDPairsOf(
+    const uint8_t* _id_buf,
+    size_t         _pair_no,
+    uint32_t*      ref_id_,
+    uint32_t*      cmp_id_
 ){
+    const unsigned int bits = sizeof(Pair) * 4;
+    const Pair         mask = (Pair)(((Pair)1 << bits) - 1);
 
-    bool current_id_is_zero = false;
-    unsigned int cnt = 0;
+    for (size_t i = 0; i < _pair_no; i++) {
+        Pair pair;
 
-    // Look for two consecutive zeroes
-    while(!current_id_is_zero){
-        current_id_is_zero = true;
-
-        for(unsigned int i = 0; i < ID_SIZE; i++){
-            if(_id_buf[ID_SIZE*cnt+i] != 0){
-                current_id_is_zero = false;
-            }
-        }
-
-        cnt++;
+        memcpy(&pair, _id_buf + i * sizeof(Pair), sizeof(Pair));
+        cmp_id_[i] = (uint32_t)(pair & mask);
+        ref_id_[i] = (uint32_t)(pair >> bits);
     }
+}
 
-    return cnt-1;
+/*
+ * Function: decodeIDPairs
+ * _id_buf  - _pair_no ID pairs, {ref ID, cmp ID} in an id_pair_t of 2 * ID_SIZE
+ *            bytes, the cmp ID in the low half, little endian.
+ * ref_id_  - Output array for the ref IDs, _pair_no entries.
+ * cmp_id_  - Output array for the cmp IDs, _pair_no entries.
+ */
+void decodeIDPairs(
+    const uint8_t* _id_buf,
+    size_t         _pair_no,
+    uint32_t*      ref_id_,
+    uint32_t*      cmp_id_
+){
+    switch (ID_SIZE) {
+        case 1:  decodeIDPairsOf<uint16_t>(_id_buf, _pair_no, ref_id_, cmp_id_); break;
+        case 2:  decodeIDPairsOf<uint32_t>(_id_buf, _pair_no, ref_id_, cmp_id_); break;
+        default: decodeIDPairsOf<uint64_t>(_id_buf, _pair_no, ref_id_, cmp_id_); break;
+    }
 }
 
 /*
@@ -169,10 +292,9 @@ unsigned int countOutputIDs(
  * ref_id_result_ - Output array for uninterleaved reference IDs, in order.
  * cmp_id_result_ - Output array for uninterleaved compare IDs, in order.
  * _Memory for output arrays allocated by the function._
- * 
+ *
  * Description:
- * Convert ID_SIZE byte wide vector IDs to uint32_t, store them in intermediate
- * array. Then uninterleave the intermediate array into the output arrays.
+ * Split the kernel's id_pair_t words into ref and cmp IDs (decodeIDPairs).
  */
 void extractResults(
     unsigned int _no_result_ids,
@@ -180,27 +302,10 @@ void extractResults(
     uint32_t**   ref_id_result_,
     uint32_t**   cmp_id_result_
 ){
-    uint32_t tmp;
-    uint32_t tmp_interleaved_buf[_no_result_ids];
     uint32_t* ref_id_result = (uint32_t*) malloc(_no_result_ids/2 * sizeof(uint32_t));
     uint32_t* cmp_id_result = (uint32_t*) malloc(_no_result_ids/2 * sizeof(uint32_t));
 
-    for(unsigned int id = 0; id < _no_result_ids; id++){
-        tmp = 0;
-
-        for(unsigned int j = 0; j < ID_SIZE; j++){
-            tmp += (uint32_t) _result_buffer[id*ID_SIZE+j];
-            tmp = tmp << (ID_SIZE-j-1)*8;
-        }
-
-        tmp_interleaved_buf[id] = tmp;
-    }
-
-    for(unsigned int i = 0; i < _no_result_ids/2; i++){
-        // interleaved in the other direction due to ID_out endianness
-        ref_id_result[i] = tmp_interleaved_buf[2*i+1];
-        cmp_id_result[i] = tmp_interleaved_buf[2*i];
-    }
+    decodeIDPairs(_result_buffer, _no_result_ids/2, ref_id_result, cmp_id_result);
 
     *ref_id_result_ = ref_id_result;
     *cmp_id_result_ = cmp_id_result;
@@ -246,4 +351,99 @@ void dumpIDs(
 
     fclose(fp);
 
-}
\ No newline at end of file
+}
+
+/*
+ * Function: kernelInputLayout
+ * layout_ - buffer sizes and kernel arguments for REF_VEC_NO refs and _cmp_no cmp vectors
+ */
+void kernelInputLayout(
+    KernelInput* layout_,
+    size_t       _cmp_no
+){
+    size_t ref_bytes = REF_VEC_NO * VECTOR_SIZE;
+    size_t cmp_bytes = _cmp_no * VECTOR_SIZE;
+
+    // Round the ref words up, the cmp data fills the rest of the last one
+    layout_->ref_bus_cycle_no = (ref_bytes + MEMORY_BUS_WIDTH_BYTES - 1) / MEMORY_BUS_WIDTH_BYTES;
+    layout_->ref_buf_size     = layout_->ref_bus_cycle_no * MEMORY_BUS_WIDTH_BYTES;
+    layout_->ref_tail         = layout_->ref_buf_size - ref_bytes;
+
+    cmp_bytes = cmp_bytes > layout_->ref_tail ? cmp_bytes - layout_->ref_tail : 0;
+    layout_->cmp_bus_cycle_no = (cmp_bytes + MEMORY_BUS_WIDTH_BYTES - 1) / MEMORY_BUS_WIDTH_BYTES;
+    layout_->cmp_buf_size     = layout_->cmp_bus_cycle_no * MEMORY_BUS_WIDTH_BYTES;
+}
+
+/*
+ * Function: packKernelCmp
+ * Rows are copied at their stream offset, less the ref_tail bytes that go
+ * to the ref buffer (packKernelTail). Unused bytes of the last word are
+ * zeroed, vec_cat drops the incomplete vector they form.
+ */
+void packKernelCmp(
+    const KernelInput*      _layout,
+    const FingerprintStore* _cmp,
+    uint8_t*                cmp_buf_
+){
+    size_t row_bytes = fpStoreRowBytes(_cmp);
+    size_t pos = 0;
+
+    memset(cmp_buf_, 0, _layout->cmp_buf_size);
+
+    for (size_t i = 0; i < _cmp->count; i++, pos += row_bytes) {
+        const uint8_t* row = (const uint8_t*) fpStoreRow(_cmp, i);
+
+        if (pos + row_bytes <= _layout->ref_tail) {
+            continue;
+        }
+        size_t skip = pos < _layout->ref_tail ? _layout->ref_tail - pos : 0;
+        memcpy(cmp_buf_ + pos + skip - _layout->ref_tail, row + skip, row_bytes - skip);
+    }
+}
+
+/*
+ * Function: packKernelTail
+ * The first ref_tail bytes of the cmp rows into the end of the ref buffer.
+ */
+void packKernelTail(
+    const KernelInput*      _layout,
+    const FingerprintStore* _cmp,
+    uint8_t*                ref_buf_
+){
+    uint8_t* tail = ref_buf_ + _layout->ref_buf_size - _layout->ref_tail;
+    size_t   row_bytes = fpStoreRowBytes(_cmp);
+
+    memset(tail, 0, _layout->ref_tail);
+
+    for (size_t i = 0, pos = 0; i < _cmp->count && pos < _layout->ref_tail; i++, pos += row_bytes) {
+        size_t n = _layout->ref_tail - pos < row_bytes ? _layout->ref_tail - pos : row_bytes;
+
+        memcpy(tail + pos, fpStoreRow(_cmp, i), n);
+    }
+}
+
+/*
+ * Function: packKernelRefs
+ * Missing rows are copies of the first ref. A zero row would be a hit
+ * against every nonzero cmp vector in the dissimilarity test, filling the
+ * ID buffer with pairs that are dropped; a copy only repeats the first
+ * ref's hits. Without refs the rows are zeroed.
+ */
+void packKernelRefs(
+    const KernelInput*      _layout,
+    const FingerprintStore* _ref,
+    uint8_t*                ref_buf_
+){
+    size_t ref_bytes = _layout->ref_buf_size - _layout->ref_tail;
+    size_t row_bytes = fpStoreRowBytes(_ref);
+    size_t used      = _ref->count * row_bytes;
+
+    fpStorePack(_ref, ref_buf_);
+    if (_ref->count == 0) {
+        memset(ref_buf_, 0, ref_bytes);
+        return;
+    }
+    for (size_t pos = used; pos < ref_bytes; pos += row_bytes) {
+        memcpy(ref_buf_ + pos, ref_buf_, ref_bytes - pos < row_bytes ? ref_bytes - pos : row_bytes);
+    }
+}
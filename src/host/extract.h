@@ -2,10 +2,11 @@
 #define EXTRACT_H
 
 #include <stdlib.h>
+#include "../c_impl/fpstore.h"
 
 int readVectorsFromFile(
-    uint8_t* ptr_ref,
-    uint8_t* ptr_cmp,
+    FingerprintStore* ref,
+    FingerprintStore* cmp,
     const char* filename
 );
 
@@ -21,8 +22,56 @@ void extractExpectedIDs(
     uint32_t**   cmp_id_exp_
 );
 
-unsigned int countOutputIDs(
-    uint8_t* _id_buf
+/*
+ * Struct: KernelInput
+ * hls_dma streams ref_bus_cycle_no whole bus words of the ref buffer, then
+ * cmp_bus_cycle_no words of the cmp buffer, and vec_cat cuts that stream
+ * every VECTOR_WIDTH bits, across the border of the two buffers. The
+ * REF_VEC_NO refs rarely fill whole words (8 x 115 bytes = 57.5 words), so
+ * the last ref_tail bytes of the ref buffer carry the start of the first
+ * cmp vector, and the cmp buffer starts ref_tail bytes into the cmp data.
+ * The stream is then exactly the packed vectors, as in vectors.bin.
+ */
+struct KernelInput {
+    size_t       ref_buf_size;      // Bytes, whole bus words
+    size_t       cmp_buf_size;
+    size_t       ref_tail;          // Bytes of cmp data at the end of the ref buffer
+    unsigned int ref_bus_cycle_no;
+    unsigned int cmp_bus_cycle_no;
+};
+
+void kernelInputLayout(
+    KernelInput* layout_,
+    size_t       _cmp_no
+);
+
+/* The cmp vectors into the cmp buffer, but for the ones in the ref buffer's tail */
+void packKernelCmp(
+    const KernelInput*      _layout,
+    const FingerprintStore* _cmp,
+    uint8_t*                cmp_buf_
+);
+
+/* The start of the cmp vectors into the tail of the ref buffer */
+void packKernelTail(
+    const KernelInput*      _layout,
+    const FingerprintStore* _cmp,
+    uint8_t*                ref_buf_
+);
+
+/* Up to REF_VEC_NO refs into the ref buffer, missing rows copies of the first, the tail is kept */
+void packKernelRefs(
+    const KernelInput*      _layout,
+    const FingerprintStore* _ref,
+    uint8_t*                ref_buf_
+);
+
+/* The kernel's id_pair_t words (cmp ID low, ref ID high, little endian) to ID arrays */
+void decodeIDPairs(
+    const uint8_t* _id_buf,
+    size_t         _pair_no,
+    uint32_t*      ref_id_,
+    uint32_t*      cmp_id_
 );
 
 void extractResults(
@@ -0,0 +1,228 @@
+#include <iostream>
+#include <deque>
+#include <vector>
+#include <string.h>
+#include "model.h"
+#include "globals.h"
+#include "../c_impl/fpstore.h"
+#include "../c_impl/search.h"
+#include "../c_impl/worksteal.h"
+
+/*
+ * Struct: ModelStream
+ * The stream hls_dma sends: the ref words, then the cmp words.
+ */
+struct ModelStream {
+    const uint8_t* ref;
+    const uint8_t* cmp;
+    size_t         ref_bytes;
+};
+
+/*
+ * Function: streamCopy
+ * _size bytes of the stream from _offset on, across the buffer border.
+ */
+static void streamCopy(const ModelStream* _stream, size_t _offset, size_t _size, uint8_t* dst_)
+{
+    if (_offset < _stream->ref_bytes) {
+        size_t n = _stream->ref_bytes - _offset < _size ? _stream->ref_bytes - _offset : _size;
+
+        memcpy(dst_, _stream->ref + _offset, n);
+        dst_    += n;
+        _offset += n;
+        _size   -= n;
+    }
+    memcpy(dst_, _stream->cmp + _offset - _stream->ref_bytes, _size);
+}
+
+/*
+ * Struct: ModelHits
+ * Comparator outputs by slot: bit k of slots[t] is set when stage k reports
+ * its pair in slot t.
+ */
+struct ModelHits {
+    std::vector<uint32_t> slots;
+    uint64_t              count;
+};
+
+/*
+ * Function: collectSlot
+ * HitSink of the model, IDs are row indices of the ref and cmp stores.
+ * Every (slot, stage) is reported by exactly one ref x cmp pair, so the
+ * workers never write the same bit; the word itself is shared by up to
+ * SHR_DEPTH pairs, hence the atomic or.
+ */
+static void collectSlot(void* _ctx, uint32_t _ref_id, uint32_t _cmp_id, double _coeff)
+{
+    ModelHits*   hits  = static_cast<ModelHits*>(_ctx);
+    unsigned int stage = REF_VEC_NO - 1 - _ref_id;
+
+    (void)_coeff;
+    __atomic_fetch_or(&hits->slots[_cmp_id + stage], 1u << stage, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hits->count, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Function: writePair
+ * One id_pair_t, cmp ID in the low bytes, both little endian.
+ */
+static void writePair(uint8_t* dst_, uint32_t _ref_id, uint32_t _cmp_id)
+{
+    for (unsigned int b = 0; b < ID_SIZE; b++) {
+        dst_[b]           = (uint8_t)(_cmp_id >> (8 * b));
+        dst_[ID_SIZE + b] = (uint8_t)(_ref_id >> (8 * b));
+    }
+}
+
+int hlsDmaModel(
+    const uint8_t*        _vec_ref,
+    const uint8_t*        _vec_cmp,
+    uint8_t*              id_out_,
+    unsigned int          _ref_sub_vec_no,
+    unsigned int          _cmp_sub_vec_no,
+    unsigned int          _id_out_cap,
+    uint32_t*             id_count_,
+    const ThresholdTable* _table,
+    ModelStats*           stats_
+){
+    const unsigned int shr_depth = REF_VEC_NO;
+    const size_t       pair_size = 2 * ID_SIZE;
+    const uint32_t     id_mask = ID_SIZE >= 4 ? 0xffffffffu : (1u << (8 * ID_SIZE)) - 1;
+    const uint64_t     sub_vector_no = (VECTOR_WIDTH + MEMORY_BUS_WIDTH_BITS - 1) / MEMORY_BUS_WIDTH_BITS;
+    ModelStats         stats = { 0, 0, 0 };
+
+    if (VECTOR_WIDTH % 8 || shr_depth == 0 || shr_depth > 32 || (shr_depth & (shr_depth - 1))) {
+        std::cout << "[ERROR][MODEL] The model takes whole-byte vectors and a power of two SHR_DEPTH up to 32.\n";
+        return -1;
+    }
+    if (!_table || _table->width != VECTOR_WIDTH) {
+        std::cout << "[ERROR][MODEL] No threshold table for " << VECTOR_WIDTH << "-bit vectors.\n";
+        return -1;
+    }
+
+    // vec_cat: whole vectors of the stream, the refs first
+    ModelStream stream = { _vec_ref, _vec_cmp, (size_t)_ref_sub_vec_no * MEMORY_BUS_WIDTH_BYTES };
+    size_t      vec_no = (stream.ref_bytes + (size_t)_cmp_sub_vec_no * MEMORY_BUS_WIDTH_BYTES) / VECTOR_SIZE;
+    size_t      cmp_no = vec_no > shr_depth ? vec_no - shr_depth : 0;
+
+    if (cmp_no == 0) {
+        *id_count_ = 0;
+        if (stats_) {
+            *stats_ = stats;
+        }
+        return 0;
+    }
+
+    FingerprintStore ref, cmp;
+    std::vector<uint8_t> row(VECTOR_SIZE);
+
+    if (fpStoreInit(&ref, shr_depth, VECTOR_WIDTH)) {
+        return -1;
+    }
+    if (fpStoreInit(&cmp, cmp_no, VECTOR_WIDTH)) {
+        fpStoreFree(&ref);
+        return -1;
+    }
+    for (size_t v = 0; v < vec_no; v++) {
+        streamCopy(&stream, v * VECTOR_SIZE, VECTOR_SIZE, row.data());
+        if (v < shr_depth) {
+            fpStoreSetRow(&ref, v, row.data());
+        } else {
+            fpStoreSetRow(&cmp, v - shr_depth, row.data());
+        }
+    }
+    fpStoreAssignIDs(&ref, 0);
+    fpStoreAssignIDs(&cmp, 0);
+    fpStoreComputeWeights(&ref);
+    fpStoreComputeWeights(&cmp);
+
+    // Comparators: every stage against every cmp vector
+    ModelHits   hits;
+    SearchConfig cfg = { _table->threshold, MATCH_TABLE, workStealDefaultThreads(), NULL, _table, 0, SPARSE_AUTO };
+
+    hits.slots.assign(cmp_no + shr_depth - 1, 0);
+    hits.count = 0;
+    int error = searchParallel(&ref, &cmp, &cfg, collectSlot, &hits, NULL);
+    fpStoreFree(&ref);
+    fpStoreFree(&cmp);
+    if (error) {
+        return -1;
+    }
+
+    // FIFO tree: leaf of stage k at heap index shr_depth + k, node i merges 2i and 2i + 1
+    std::vector<std::deque<uint64_t>> fifo(2 * shr_depth);
+    std::vector<uint8_t>  prev(shr_depth, 0);
+    std::vector<unsigned> src(shr_depth, 0);
+    uint64_t queued = 0;
+    uint64_t cycle  = 0;
+    size_t   slot   = 0;
+    uint64_t written = 0;
+
+    while (slot < hits.slots.size() || queued) {
+        if (!queued) {
+            // Idle until the next slot with a hit, every node selects the even side meanwhile
+            while (slot < hits.slots.size() && !hits.slots[slot]) {
+                slot++;
+            }
+            if (slot == hits.slots.size()) {
+                break;
+            }
+            cycle = slot * sub_vector_no;
+            std::fill(prev.begin(), prev.end(), 0);
+        }
+
+        // Root read, then every node moves one pair from the FIFOs as they were at the clock edge
+        if (!fifo[1].empty()) {
+            uint64_t pair = fifo[1].front();
+
+            if (written < _id_out_cap) {
+                writePair(id_out_ + written * pair_size, (uint32_t)(pair >> 32), (uint32_t)pair);
+            }
+            written++;
+            fifo[1].pop_front();
+            queued--;
+            stats.cycles = cycle;
+        }
+        for (unsigned int i = 1; i < shr_depth; i++) {
+            bool    even = !fifo[2 * i].empty();
+            bool    odd  = !fifo[2 * i + 1].empty();
+            uint8_t sel  = even && odd ? !prev[i] : odd;
+
+            src[i]  = even || odd ? 2 * i + sel : 0;
+            prev[i] = sel;
+        }
+        for (unsigned int i = 1; i < shr_depth; i++) {
+            if (src[i]) {
+                fifo[i].push_back(fifo[src[i]].front());
+                fifo[src[i]].pop_front();
+            }
+        }
+
+        // Comparator outputs of this cycle into the leaves
+        if (slot < hits.slots.size() && cycle == slot * sub_vector_no) {
+            for (uint32_t mask = hits.slots[slot]; mask; mask &= mask - 1) {
+                unsigned int stage = __builtin_ctz(mask);
+                uint32_t     ref_id = (shr_depth - stage) & id_mask;
+                uint32_t     cmp_id = (uint32_t)(shr_depth + slot - stage + 1) & id_mask;
+
+                fifo[shr_depth + stage].push_back((uint64_t)ref_id << 32 | cmp_id);
+                queued++;
+            }
+            slot++;
+        }
+        for (unsigned int i = 1; i < 2 * shr_depth; i++) {
+            if (fifo[i].size() > stats.max_fifo) {
+                stats.max_fifo = fifo[i].size();
+            }
+        }
+        cycle++;
+    }
+
+    // id_intf drops o_IDPair_Last and the pairs past the buffer
+    *id_count_  = (uint32_t)hits.count;
+    stats.pairs = hits.count;
+    if (stats_) {
+        *stats_ = stats;
+    }
+    return 0;
+}
@@ -0,0 +1,72 @@
+#ifndef MODEL_H
+#define MODEL_H
+
+#include <cstddef>
+#include <cstdint>
+#include "../c_impl/threshold.h"
+
+/*
+ * Behavioural model of the kernel
+ * hlsDmaModel() takes the arguments hls_dma takes (ref and cmp buffers,
+ * ID pair buffer, bus word counts, ID pair capacity and count) plus the
+ * comparators' threshold table, and writes what the kernel would write:
+ *
+ * hls_dma      - ref_sub_vec_no words of the ref buffer, then cmp_sub_vec_no
+ *                words of the cmp buffer, as one stream
+ * vec_cat      - the stream cut every VECTOR_WIDTH bits, vectors numbered
+ *                1, 2, ... in VEC_ID_WIDTH (ID_SIZE bytes) bits, wrapping;
+ *                an incomplete last vector is dropped
+ * shift regs   - the first SHR_DEPTH (REF_VEC_NO) vectors are the refs,
+ *                stage k holds ref SHR_DEPTH - 1 - k and sees cmp vector j
+ *                in slot j + k, one slot every SUB_VECTOR_NO cycles
+ * comparator   - CNT(A) + CNT(B) > table[CNT(A & B)], the table as written
+ *                to the threshold RAM (thresholdTableMatch())
+ * FIFO tree    - one leaf FIFO per stage, merged by round-robin nodes that
+ *                move one pair per cycle and remember the last source on
+ *                every cycle (empty cycles select the even side), the root
+ *                read every cycle
+ * id_intf      - the first _id_out_cap pairs into the ID pair buffer, the
+ *                number of pairs into id_count_, o_IDPair_Last (a zero pair
+ *                after the last hit) is not written
+ *
+ * Pairs are written as the kernel writes id_pair_t: cmp ID in the low
+ * ID_SIZE bytes, ref ID in the high ones, little endian. CNT(A & B) for the
+ * comparators is computed by the C implementation's searchParallel(), on
+ * all cores, so jobs of millions of vectors run in seconds; only the hits
+ * go through the FIFO tree, cycle by cycle while it holds pairs.
+ *
+ * Timing is modelled as far as it decides the emission order: every FIFO
+ * has one cycle from write to read (the xpm FWFT latency is not modelled),
+ * FIFOs never fill up (no pipeline halt), and every ref x cmp pair is
+ * compared once, including the ones that leave the pipeline during FLUSH.
+ * Results equal the hardware's; the order equals it as long as no FIFO
+ * would have filled, see ModelStats.
+ */
+
+// Depth of the FIFO tree's FIFOs in tanimoto_top
+#define MODEL_FIFO_DEPTH    32
+
+struct ModelStats {
+    uint64_t     cycles;        // Cycle of the last pair leaving the FIFO tree
+    uint64_t     pairs;         // ID pairs of the run, written or not
+    unsigned int max_fifo;      // Fullest any FIFO got, above MODEL_FIFO_DEPTH the hardware halts
+};
+
+/*
+ * Function: hlsDmaModel
+ * One kernel run. id_out_ holds _id_out_cap ID pairs, *id_count_ above it
+ * is an overflow as on the device. stats_ may be NULL. Returns 0 on success.
+ */
+int hlsDmaModel(
+    const uint8_t*        _vec_ref,
+    const uint8_t*        _vec_cmp,
+    uint8_t*              id_out_,
+    unsigned int          _ref_sub_vec_no,
+    unsigned int          _cmp_sub_vec_no,
+    unsigned int          _id_out_cap,
+    uint32_t*             id_count_,
+    const ThresholdTable* _table,
+    ModelStats*           stats_
+);
+
+#endif // MODEL_H
@@ -0,0 +1,152 @@
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <regex>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+#include "globals.h"
+#include "extract.h"
+#include "model.h"
+
+/*
+ * Emission order check of the kernel model against the RTL testbench.
+ * Runs hlsDmaModel() on the testbench's input (vectors.bin: REF_VEC_NO refs,
+ * then the cmp vectors) as one kernel run and prints the ID pairs in the
+ * order the model writes them, as tb_tanimoto_top.v displays them:
+ *
+ *   id_pair_out[n]: <ref ID> - <cmp ID>
+ *
+ * Given the simulator's log, compares the model's pairs with the log's
+ * id_pair_out lines instead, in order. The testbench displays every word
+ * the FIFO tree's root gives once the run is over as well, zero pairs, they
+ * are not pairs of the run. Build with the testbench's VEC_ID_WIDTH.
+ */
+
+// Same values as host.cpp
+const unsigned int VECTOR_WIDTH = 920;
+const unsigned int VECTOR_SIZE = (VECTOR_WIDTH + 7) / 8;
+unsigned int REF_VEC_NO = 8;
+unsigned int CMP_VEC_NO = 24;
+const unsigned int ID_SIZE = VEC_ID_WIDTH / 8;
+const unsigned int MEMORY_BUS_WIDTH_BYTES = 16;
+const unsigned int MEMORY_BUS_WIDTH_BITS = 128;
+
+// THRESHOLD of tb_tanimoto_top.v
+#define MODEL_ORDER_DEFAULT_THRESHOLD   0.66f
+
+struct RawPair {
+    uint32_t ref_id;
+    uint32_t cmp_id;
+};
+
+/*
+ * Function: readSimPairs
+ * The non-zero id_pair_out pairs of a tb_tanimoto_top simulation log, in
+ * order. Returns 0 on success.
+ */
+static int readSimPairs(const char* _log, std::vector<RawPair>* pairs_)
+{
+    std::ifstream log(_log);
+    const std::regex line_re("id_pair_out\\[\\s*[0-9]+\\]:\\s*([0-9a-fA-F]+)\\s*-\\s*([0-9a-fA-F]+)");
+    std::smatch match;
+    std::string line;
+
+    if (!log) {
+        std::cerr << "[ERROR] Cannot open simulation log " << _log << std::endl;
+        return 1;
+    }
+    while (std::getline(log, line)) {
+        if (!std::regex_search(line, match, line_re)) {
+            continue;
+        }
+        RawPair pair = { (uint32_t)strtoul(match[1].str().c_str(), NULL, 16),
+                         (uint32_t)strtoul(match[2].str().c_str(), NULL, 16) };
+        if (pair.ref_id != 0 || pair.cmp_id != 0) {
+            pairs_->push_back(pair);
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || argc > 4) {
+        std::cerr << "Usage: " << argv[0] << " VECTORS [THRESHOLD] [SIM_LOG]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    float threshold = (argc > 2) ? strtof(argv[2], NULL) : MODEL_ORDER_DEFAULT_THRESHOLD;
+    FingerprintStore ref_store;
+    FingerprintStore cmp_store;
+    ThresholdTable table;
+    KernelInput layout;
+
+    if (readVectorsFromFile(&ref_store, &cmp_store, argv[1])) {
+        return EXIT_FAILURE;
+    }
+    CMP_VEC_NO = cmp_store.count;
+    if (thresholdTableInit(&table, VECTOR_WIDTH, threshold)) {
+        std::cerr << "[ERROR] Invalid threshold " << threshold << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // One run, every pair fits, as in the testbench
+    kernelInputLayout(&layout, CMP_VEC_NO);
+    std::vector<uint8_t> ref_buf(layout.ref_buf_size);
+    std::vector<uint8_t> cmp_buf(layout.cmp_buf_size);
+    unsigned int id_pair_cap = REF_VEC_NO * CMP_VEC_NO;
+    std::vector<uint8_t> id_buf((size_t)id_pair_cap * ID_SIZE * 2);
+    uint32_t id_count = 0;
+    ModelStats stats;
+
+    packKernelRefs(&layout, &ref_store, ref_buf.data());
+    packKernelTail(&layout, &cmp_store, ref_buf.data());
+    packKernelCmp(&layout, &cmp_store, cmp_buf.data());
+    fpStoreFree(&ref_store);
+    fpStoreFree(&cmp_store);
+
+    int error = hlsDmaModel(ref_buf.data(), cmp_buf.data(), id_buf.data(), layout.ref_bus_cycle_no,
+                            layout.cmp_bus_cycle_no, id_pair_cap, &id_count, &table, &stats);
+    thresholdTableFree(&table);
+    if (error) {
+        std::cerr << "[ERROR] Model run failed." << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (stats.max_fifo > MODEL_FIFO_DEPTH) {
+        std::cerr << "[WARNING] A FIFO of the model held " << stats.max_fifo
+                  << " pairs, the simulation halts the pipeline and may emit in another order." << std::endl;
+    }
+
+    std::vector<uint32_t> ref_ids(id_count);
+    std::vector<uint32_t> cmp_ids(id_count);
+    decodeIDPairs(id_buf.data(), id_count, ref_ids.data(), cmp_ids.data());
+
+    if (argc < 4) {
+        for (uint32_t i = 0; i < id_count; i++) {
+            std::cout << "id_pair_out[" << i << "]: " << std::hex << std::setfill('0')
+                      << std::setw(ID_SIZE * 2) << ref_ids[i] << " - "
+                      << std::setw(ID_SIZE * 2) << cmp_ids[i] << std::dec << "\n";
+        }
+        return EXIT_SUCCESS;
+    }
+
+    std::vector<RawPair> sim_pairs;
+    if (readSimPairs(argv[3], &sim_pairs)) {
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < id_count && i < sim_pairs.size(); i++) {
+        if (sim_pairs[i].ref_id != ref_ids[i] || sim_pairs[i].cmp_id != cmp_ids[i]) {
+            std::cout << "[ERROR] Pair " << i << ": model " << ref_ids[i] << " - " << cmp_ids[i]
+                      << ", simulation " << sim_pairs[i].ref_id << " - " << sim_pairs[i].cmp_id << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    if (sim_pairs.size() != id_count) {
+        std::cout << "[ERROR] The model emits " << id_count << " pairs, the simulation "
+                  << sim_pairs.size() << "." << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << "[INFO] " << id_count << " pairs, the model emits them in the simulation's order." << std::endl;
+    return EXIT_SUCCESS;
+}
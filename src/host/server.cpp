@@ -0,0 +1,504 @@
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "server.h"
+#include "globals.h"
+#include "extract.h"
+
+/*
+ * Search server: programs the accelerator once, then runs the jobs clients
+ * send over a Unix socket (protocol in server.h) on the same context,
+ * queue and buffers. Clients are served one at a time, in the order they
+ * connect, the device runs one job at a time anyway. The CPU engine runs
+ * the same jobs without a board, the model engine runs them through the
+ * behavioural model of the kernel (model.h) as the device would.
+ *
+ * With --query the program is a client instead: it sends the vectors file
+ * as a job (the first --ref-no vectors are the refs) and writes the
+ * returned pairs in the writeIDsToFile() format, with the IDs host.cpp and
+ * the C implementation give the vectors.
+ */
+
+// Same values as host.cpp
+const unsigned int VECTOR_WIDTH = 920;
+const unsigned int VECTOR_SIZE = (VECTOR_WIDTH + 7) / 8;
+unsigned int REF_VEC_NO = 8;
+unsigned int CMP_VEC_NO = 24;
+const unsigned int ID_SIZE = VEC_ID_WIDTH / 8;
+const unsigned int MEMORY_BUS_WIDTH_BYTES = 16;
+const unsigned int MEMORY_BUS_WIDTH_BITS = 128;
+
+#define SERVER_DEFAULT_THRESHOLD    0.66
+#define SERVER_BACKLOG              16
+#define SERVER_IO_ROWS              4096    // Rows per read() of a job, as in fpStoreReadPacked()
+#define SERVER_DEFAULT_TIMEOUT      30      // Seconds a client may stall a read() or write()
+
+static volatile sig_atomic_t stop_server = 0;
+
+static void onStopSignal(int _signal)
+{
+    (void)_signal;
+    stop_server = 1;
+}
+
+/*
+ * Function: writeFull
+ * write() until all _size bytes are out, returns 0 on success.
+ */
+static int writeFull(int _fd, const void* _buf, size_t _size)
+{
+    const uint8_t* buf = (const uint8_t*)_buf;
+
+    while (_size) {
+        ssize_t n = write(_fd, buf, _size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 1;
+        }
+        buf   += n;
+        _size -= n;
+    }
+    return 0;
+}
+
+/*
+ * Function: readFull
+ * read() until all _size bytes are in. Returns 0 on success, -1 on end of
+ * file before the first byte, 1 on errors (a timeout too) or a short read.
+ */
+static int readFull(int _fd, void* _buf, size_t _size)
+{
+    uint8_t* buf = (uint8_t*)_buf;
+    size_t   got = 0;
+
+    while (got < _size) {
+        ssize_t n = read(_fd, buf + got, _size - got);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return (n == 0 && got == 0) ? -1 : 1;
+        }
+        got += n;
+    }
+    return 0;
+}
+
+static int sendReply(int _fd, JobStatus _status, const std::vector<IDPair>& _hits, uint64_t _micros)
+{
+    JobReply reply = { JOB_MAGIC, _status, _status == JOB_OK ? _hits.size() : 0, _micros };
+
+    if (writeFull(_fd, &reply, sizeof(reply))) {
+        return 1;
+    }
+    return reply.pairNo ? writeFull(_fd, _hits.data(), _hits.size() * sizeof(IDPair)) : 0;
+}
+
+/*
+ * Function: readJobStore
+ * Allocate store_ for _count packed rows of _width bits and read them from
+ * the socket, IDs are the row indices. Returns 0 on success.
+ */
+static int readJobStore(int _fd, FingerprintStore* store_, uint32_t _count, uint32_t _width)
+{
+    if (fpStoreInit(store_, _count, _width)) {
+        return 1;
+    }
+
+    size_t row_bytes = fpStoreRowBytes(store_);
+    std::vector<uint8_t> buf(SERVER_IO_ROWS * row_bytes);
+
+    for (size_t i = 0; i < _count; i += SERVER_IO_ROWS) {
+        size_t rows = std::min<size_t>(_count - i, SERVER_IO_ROWS);
+
+        if (readFull(_fd, buf.data(), rows * row_bytes)) {
+            fpStoreFree(store_);
+            return 1;
+        }
+        for (size_t j = 0; j < rows; j++) {
+            fpStoreSetRow(store_, i + j, buf.data() + j * row_bytes);
+        }
+    }
+
+    fpStoreAssignIDs(store_, 0);
+    fpStoreComputeWeights(store_);
+    return 0;
+}
+
+/*
+ * Function: stalled
+ * Whether the last read() or write() on a client failed on its timeout.
+ */
+static bool stalled()
+{
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+/*
+ * Function: serveClient
+ * Run the client's jobs until it disconnects, sends a malformed request or
+ * stalls past the socket timeouts.
+ */
+static void serveClient(int _fd, Engine* _engine)
+{
+    std::vector<IDPair> hits;
+    JobHeader header;
+    int status;
+
+    while ((status = readFull(_fd, &header, sizeof(header))) == 0) {
+        uint64_t row_bytes = ((uint64_t)header.width + 7) / 8;
+
+        if (header.magic != JOB_MAGIC || header.version != JOB_VERSION || header.width == 0 ||
+            row_bytes * ((uint64_t)header.refNo + header.cmpNo) > JOB_MAX_BYTES ||
+            !(header.threshold >= 0.0 && header.threshold < 1.0)) {
+            std::cout << "[ERROR][JOB] Malformed job header, closing the connection.\n";
+            sendReply(_fd, JOB_BAD_REQUEST, hits, 0);
+            return;
+        }
+
+        SearchJob job = { header.flags, header.threshold, {}, {} };
+        if (readJobStore(_fd, &job.ref, header.refNo, header.width)) {
+            std::cout << (stalled() ? "[ERROR][JOB] The client stalled sending the reference vectors.\n"
+                                    : "[ERROR][JOB] Failed to receive the reference vectors.\n");
+            return;
+        }
+        if (readJobStore(_fd, &job.cmp, header.cmpNo, header.width)) {
+            std::cout << (stalled() ? "[ERROR][JOB] The client stalled sending the compare vectors.\n"
+                                    : "[ERROR][JOB] Failed to receive the compare vectors.\n");
+            fpStoreFree(&job.ref);
+            return;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        hits.clear();
+        JobStatus job_status = _engine->run(job, hits);
+        uint64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+
+        fpStoreFree(&job.ref);
+        fpStoreFree(&job.cmp);
+
+        std::sort(hits.begin(), hits.end(), [](const IDPair& a, const IDPair& b) {
+            return a.ref_id != b.ref_id ? a.ref_id < b.ref_id : a.cmp_id < b.cmp_id;
+        });
+        std::cout << "[INFO] Job " << header.refNo << " x " << header.cmpNo << " @ " << header.threshold
+                  << ": status " << job_status << ", " << hits.size() << " pairs, " << micros << " us.\n";
+
+        if (sendReply(_fd, job_status, hits, micros)) {
+            std::cout << (stalled() ? "[WARNING] Client stopped reading its reply, closing the connection.\n"
+                                    : "[WARNING] Client went away before the reply was sent.\n");
+            return;
+        }
+    }
+    if (status > 0) {
+        std::cout << (stalled() ? "[WARNING] Client idle or stalled in a job header, closing the connection.\n"
+                                : "[WARNING] Connection lost in the middle of a job header.\n");
+    }
+}
+
+static int socketAddress(struct sockaddr_un* addr_, const char* _path)
+{
+    memset(addr_, 0, sizeof(*addr_));
+    addr_->sun_family = AF_UNIX;
+    if (strlen(_path) >= sizeof(addr_->sun_path)) {
+        std::cerr << "[ERROR][SOCKET] Socket path too long: " << _path << std::endl;
+        return 1;
+    }
+    strcpy(addr_->sun_path, _path);
+    return 0;
+}
+
+/*
+ * Function: runServer
+ * Accept loop, until SIGINT or SIGTERM. The socket file is removed on exit.
+ * Clients are served one at a time, a read() or write() that makes no
+ * progress for _timeout seconds drops the client, so none can hold the
+ * others up for longer.
+ */
+static int runServer(const char* _socket_path, Engine* _engine, unsigned int _timeout)
+{
+    struct sockaddr_un addr;
+    if (socketAddress(&addr, _socket_path)) {
+        return 1;
+    }
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        perror("[ERROR][SOCKET] socket()");
+        return 1;
+    }
+    unlink(_socket_path);
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(listen_fd, SERVER_BACKLOG)) {
+        perror("[ERROR][SOCKET] Cannot listen on the socket");
+        close(listen_fd);
+        return 1;
+    }
+
+    // No SA_RESTART: a signal interrupts accept()
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onStopSignal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    std::cout << "[INFO] " << _engine->name() << " engine listening on " << _socket_path << std::endl;
+    while (!stop_server) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("[ERROR][SOCKET] accept()");
+            break;
+        }
+
+        struct timeval timeout = { (time_t)_timeout, 0 };
+        if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) ||
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout))) {
+            perror("[ERROR][SOCKET] setsockopt()");
+            close(fd);
+            continue;
+        }
+        serveClient(fd, _engine);
+        close(fd);
+    }
+
+    std::cout << "[INFO] Shutting down.\n";
+    close(listen_fd);
+    unlink(_socket_path);
+    return 0;
+}
+
+/*
+ * Function: runQuery
+ * Client side: send the vectors file as one job _repeat times, write the
+ * pairs of the last reply to _results.
+ */
+static int runQuery(const char* _socket_path, const char* _vectors, const char* _results,
+                    double _threshold, uint32_t _flags, unsigned int _repeat)
+{
+    FingerprintStore ref, cmp;
+    struct sockaddr_un addr;
+
+    if (socketAddress(&addr, _socket_path) || readVectorsFromFile(&ref, &cmp, _vectors)) {
+        return 1;
+    }
+
+    JobHeader header = { JOB_MAGIC, JOB_VERSION, ref.width, _flags,
+                         (uint32_t)ref.count, (uint32_t)cmp.count, _threshold };
+    std::vector<uint8_t> rows((ref.count + cmp.count) * fpStoreRowBytes(&ref));
+    fpStorePack(&ref, rows.data());
+    fpStorePack(&cmp, rows.data() + ref.count * fpStoreRowBytes(&ref));
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+        perror("[ERROR][SOCKET] Cannot connect to the server");
+        if (fd >= 0) close(fd);
+        fpStoreFree(&ref);
+        fpStoreFree(&cmp);
+        return 1;
+    }
+
+    std::vector<IDPair> pairs;
+    JobReply reply = { 0, JOB_FAILED, 0, 0 };
+    int error = 0;
+
+    for (unsigned int r = 0; r < _repeat && !error; r++) {
+        auto start = std::chrono::steady_clock::now();
+
+        error = writeFull(fd, &header, sizeof(header)) || writeFull(fd, rows.data(), rows.size()) ||
+                readFull(fd, &reply, sizeof(reply)) || reply.magic != JOB_MAGIC;
+        if (!error) {
+            pairs.resize(reply.pairNo);
+            error = reply.pairNo && readFull(fd, pairs.data(), pairs.size() * sizeof(IDPair));
+        }
+        if (!error) {
+            uint64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+            std::cout << "[INFO] Reply: status " << reply.status << ", " << reply.pairNo << " pairs, "
+                      << reply.micros << " us in the engine, " << micros << " us round trip.\n";
+        }
+    }
+    close(fd);
+
+    if (error || reply.status != JOB_OK) {
+        std::cout << "[ERROR][JOB] Job failed.\n";
+        fpStoreFree(&ref);
+        fpStoreFree(&cmp);
+        return 1;
+    }
+
+    // Rows back to vector IDs, rows outside the job are a broken reply
+    for (const auto& pair : pairs) {
+        if (pair.ref_id >= ref.count || pair.cmp_id >= cmp.count) {
+            std::cout << "[ERROR][JOB] Reply holds row pair " << pair.ref_id << ", " << pair.cmp_id
+                      << ", the job has " << ref.count << " x " << cmp.count << " rows.\n";
+            fpStoreFree(&ref);
+            fpStoreFree(&cmp);
+            return 1;
+        }
+    }
+    for (auto& pair : pairs) {
+        pair.ref_id = ref.ids[pair.ref_id];
+        pair.cmp_id = cmp.ids[pair.cmp_id];
+    }
+    fpStoreFree(&ref);
+    fpStoreFree(&cmp);
+
+    FILE* fp = fopen(_results, "wb");
+    if (fp == NULL || fwrite(pairs.data(), sizeof(IDPair), pairs.size(), fp) != pairs.size()) {
+        perror("[ERROR][FILE_OPS] Error writing results file");
+        if (fp) fclose(fp);
+        return 1;
+    }
+    fclose(fp);
+    std::cout << "[INFO] " << pairs.size() << " pairs written to " << _results << std::endl;
+    return 0;
+}
+
+/*
+ * Function: parseCount
+ * A count option: a whole number from 1 to _max, nothing after it.
+ */
+static bool parseCount(const char* _arg, unsigned long _max, unsigned int* value_)
+{
+    char* end;
+    unsigned long n;
+
+    if (*_arg == '-' || *_arg == '\0') {
+        return false;
+    }
+    errno = 0;
+    n = strtoul(_arg, &end, 0);
+    if (errno || *end != '\0' || n == 0 || n > _max) {
+        return false;
+    }
+    *value_ = (unsigned int)n;
+    return true;
+}
+
+/*
+ * Function: parseThreshold
+ * A threshold: a number in [0, 1), the range thresholdTableInit() takes.
+ */
+static bool parseThreshold(const char* _arg, double* value_)
+{
+    char* end;
+    double t;
+
+    errno = 0;
+    t = strtod(_arg, &end);
+    if (errno || end == _arg || *end != '\0' || !(t >= 0.0 && t < 1.0)) {
+        return false;
+    }
+    *value_ = t;
+    return true;
+}
+
+static void usage(const char* _prog)
+{
+    std::cerr << "Usage: " << _prog << " [--socket PATH] [--engine cpu|fpga|model] [--xclbin FILE] [--threads N]\n"
+              << "              [--timeout S]\n"
+              << "       " << _prog << " --query [--socket PATH] [--vectors FILE] [--ref-no N] [--threshold T]\n"
+              << "              [--similar] [--results FILE] [--repeat N]" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* socket_path = SERVER_DEFAULT_SOCKET;
+    const char* vectors = "vectors.bin";
+    const char* results = "results.bin";
+    std::string engine_name = "fpga";
+    std::string xclbin = "tanimoto_krnl.xclbin";
+    unsigned int thread_no = 0;
+    unsigned int timeout = SERVER_DEFAULT_TIMEOUT;
+    unsigned int repeat = 1;
+    unsigned int ref_no = REF_VEC_NO;
+    double threshold = SERVER_DEFAULT_THRESHOLD;
+    uint32_t flags = 0;
+    bool query = false;
+
+    static struct option long_opts[] = {
+        // name             has_arg               flag  short-val
+        { "socket",         required_argument   , NULL, 's' },
+        { "engine",         required_argument   , NULL, 'E' },
+        { "xclbin",         required_argument   , NULL, 'x' },
+        { "threads",        required_argument   , NULL, 'j' },
+        { "timeout",        required_argument   , NULL, 't' },
+        { "query",          no_argument         , NULL, 'q' },
+        { "vectors",        required_argument   , NULL, 'v' },
+        { "ref-no",         required_argument   , NULL, 'R' },
+        { "threshold",      required_argument   , NULL, 'T' },
+        { "similar",        no_argument         , NULL, 'S' },
+        { "results",        required_argument   , NULL, 'r' },
+        { "repeat",         required_argument   , NULL, 'n' },
+        { NULL,             0                   , NULL,  0  }
+    };
+
+    int opt;
+    bool valid = true;
+    while ((opt = getopt_long(argc, argv, "s:E:x:j:t:qv:R:T:Sr:n:", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 's': socket_path = optarg; break;
+            case 'E': engine_name = optarg; break;
+            case 'x': xclbin = optarg; break;
+            case 'j': valid = parseCount(optarg, UINT_MAX, &thread_no); break;
+            case 't': valid = parseCount(optarg, UINT_MAX, &timeout); break;
+            case 'q': query = true; break;
+            case 'v': vectors = optarg; break;
+            case 'R': valid = parseCount(optarg, UINT32_MAX, &ref_no); break;
+            case 'T': valid = parseThreshold(optarg, &threshold); break;
+            case 'S': flags |= JOB_FLAG_SIMILAR; break;
+            case 'r': results = optarg; break;
+            case 'n': valid = parseCount(optarg, UINT_MAX, &repeat); break;
+            default:
+                valid = false;
+                break;
+        }
+        if (!valid) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (query) {
+        REF_VEC_NO = ref_no;    // readVectorsFromFile() splits the file after REF_VEC_NO vectors
+        return runQuery(socket_path, vectors, results, threshold, flags, repeat) ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    Engine* engine = nullptr;
+    if (engine_name == "cpu") {
+        engine = createCpuEngine(thread_no);
+    } else if (engine_name == "model") {
+        engine = createModelEngine();
+    } else if (engine_name == "fpga") {
+#ifdef SERVER_CPU_ONLY
+        std::cerr << "[ERROR] Built without the accelerator, use --engine cpu or model." << std::endl;
+#else
+        engine = createFpgaEngine(xclbin);
+#endif
+    } else {
+        usage(argv[0]);
+    }
+    if (!engine) {
+        return EXIT_FAILURE;
+    }
+
+    int error = runServer(socket_path, engine, timeout);
+    delete engine;
+    return error ? EXIT_FAILURE : EXIT_SUCCESS;
+}
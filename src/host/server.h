@@ -0,0 +1,111 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "check.h"
+#include "../c_impl/fpstore.h"
+
+/*
+ * Job protocol of the search server
+ * A client connects to the server's Unix socket and sends any number of
+ * jobs, one after the other, each answered before the next one is read:
+ *
+ * request  - JobHeader, then refNo + cmpNo packed fingerprints of
+ *            (width + 7) / 8 bytes each, ref rows first (the vectors.bin
+ *            layout, see fpStorePack)
+ * reply    - JobReply, then pairNo {ref row, cmp row} uint32_t pairs,
+ *            rows counted from 0 within the job's ref and cmp sets,
+ *            sorted ref-major
+ *
+ * Both sides are on the same machine, so all fields are in host byte
+ * order. A reply with a non-zero status carries no pairs, the connection
+ * stays usable unless the request itself could not be read.
+ */
+
+#define JOB_MAGIC           0x424a5046u     // "FPJB"
+#define JOB_VERSION         1u
+
+#define JOB_FLAG_SIMILAR    0x1u    // Tanimoto >= threshold instead of the accelerator's dissimilarity test
+
+// Upper limit of the fingerprint data of a single job
+#define JOB_MAX_BYTES       (1ull << 32)
+
+#define SERVER_DEFAULT_SOCKET   "/tmp/fp_accel.sock"
+
+struct JobHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;         // Fingerprint width in bits
+    uint32_t flags;         // JOB_FLAG_*
+    uint32_t refNo;
+    uint32_t cmpNo;
+    double   threshold;     // In [0, 1), the accelerator takes it as float
+};
+
+enum JobStatus : int32_t {
+    JOB_OK = 0,
+    JOB_BAD_REQUEST,        // Malformed header, the connection is closed
+    JOB_UNSUPPORTED,        // Valid job the engine cannot run (width, flags)
+    JOB_FAILED              // Engine error
+};
+
+struct JobReply {
+    uint32_t magic;
+    int32_t  status;        // JobStatus
+    uint64_t pairNo;
+    uint64_t micros;        // Time spent in the engine
+};
+
+/*
+ * Struct: SearchJob
+ * A received job: ref and cmp as stores whose IDs are their row indices,
+ * weights computed.
+ */
+struct SearchJob {
+    uint32_t         flags;
+    double           threshold;
+    FingerprintStore ref;
+    FingerprintStore cmp;
+};
+
+/*
+ * Class: Engine
+ * Backend the server runs jobs on. An engine is created once and keeps its
+ * resources (programmed device, buffers, threshold table) between jobs.
+ * run() appends the matching {ref row, cmp row} pairs to hits_ in any order
+ * and returns a JobStatus. It may reorder the job's stores (the IDs move
+ * with the rows).
+ */
+class Engine {
+public:
+    virtual ~Engine() {}
+    virtual const char* name() const = 0;
+    virtual JobStatus run(SearchJob& job_, std::vector<IDPair>& hits_) = 0;
+};
+
+/*
+ * Function: createCpuEngine
+ * Engine on the C implementation's searchParallel(), _thread_no threads
+ * (0: all cores). Dissimilarity jobs use the accelerator's threshold table,
+ * so the results are the ones the accelerator reports.
+ */
+Engine* createCpuEngine(unsigned int _thread_no);
+
+/*
+ * Function: createFpgaEngine
+ * Engine on the hls_dma kernel, the device is programmed with _xclbin once.
+ * Returns nullptr if that fails.
+ */
+Engine* createFpgaEngine(const std::string& _xclbin);
+
+/*
+ * Function: createModelEngine
+ * Engine on the behavioural model of the kernel (hlsDmaModel), the FPGA
+ * engine's job path without a device. Results and their order are the
+ * device's, see model.h for what the model leaves out.
+ */
+Engine* createModelEngine();
+
+#endif // SERVER_H
@@ -14,7 +14,7 @@ module top_intf
         //
         SUB_VECTOR_NO   = $ceil(VECTOR_WIDTH/BUS_WIDTH) ,
         GRANULE_WIDTH   = 6                             ,
-        VEC_ID_WIDTH    = 8                             ,
+        VEC_ID_WIDTH    = 16                            ,
         //
         CNT_WIDTH       = $clog2(VECTOR_WIDTH)          ,
         FIFO_TREE_DEPTH = ($clog2(SHR_DEPTH) + 1)
@@ -19,7 +19,7 @@ module vec_cat
     #(
         BUS_WIDTH       = 128,
         VECTOR_WIDTH    = 920,
-        VEC_ID_WIDTH    = 8,
+        VEC_ID_WIDTH    = 16,
         //
         SUB_VEC_NO      = $rtoi($ceil($itor(VECTOR_WIDTH)/$itor(BUS_WIDTH)))
     )